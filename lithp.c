@@ -1,1380 +1,9606 @@
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 
-#include "readline.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "lithp.h"
 #include "vendor/mpc/mpc.h"
 
-#define UNUSED(x) (void)(x)
+#if defined(__x86_64__) && !defined(_WIN32)
+#define LITHP_JIT
+#endif
 
-#define LASSERT(args, cond, fmt, ...) \
-  if (!(cond)) { \
-    lval* err = lval_err(fmt, ##__VA_ARGS__); \
-    lval_del(args); \
-    return err; \
-  }
+/**
+ * reference counts, and a few counters, are shared with the threads running
+ * the parallel builtins, so they are always updated atomically.
+ */
+#define LREF_INC(count) __atomic_add_fetch(&(count), 1, __ATOMIC_RELAXED)
+#define LREF_DEC(count) __atomic_sub_fetch(&(count), 1, __ATOMIC_ACQ_REL)
 
-#define LASSERT_ARG_COUNT(args, func, expected) \
-  LASSERT(args, expected == args->count, \
-    "Function '%s' expects %i argument but got %i.", \
-      func, expected, args->count);
+/**
+ * how many parallel jobs the current thread is running inside of, see
+ * `builtin_pmap`.
+ */
+_Thread_local int PARALLEL_DEPTH = 0;
 
-#define LASSERT_ARG_TYPE_AT(args, func, expected, index) \
-  LASSERT(args, args->cell[index]->type == expected, \
-    "Function '%s' expects a %s but got (a/an) %s at index %i instead.", \
-      func, ltype_name(expected), ltype_name(args->cell[index]->type), index);
+/**
+ * the evaluator recurses on the C stack, a handful of frames for every call
+ * of a lambda. so that deep recursion ends in an error instead of a crash,
+ * every such call checks `CALL_DEPTH`, the number of calls the current
+ * thread or coroutine is nested in, against the `max_depth` of the context,
+ * and its own address against `STACK_LIMIT`, the lowest address the current
+ * stack may grow down to, if it is known. the public entry points run on a
+ * stack of their own, reserved to fit `max_depth` calls of `EVAL_FRAME_SIZE`
+ * bytes each, see `lstack_run`.
+ */
+#define DEFAULT_MAX_DEPTH 100000
+#define EVAL_FRAME_SIZE 2048
+#define STACK_MARGIN (128 * 1024)
+
+_Thread_local long CALL_DEPTH = 0;
+_Thread_local char* STACK_LIMIT = NULL;
+
+struct ljit;
+struct lpool;
+struct ltrace;
+struct lprefetch;
+typedef struct ljit ljit;
+typedef struct lpool lpool;
+typedef struct ltrace ltrace;
+typedef struct lprefetch lprefetch;
+typedef struct lstage_stats lstage_stats;
+typedef struct lswitch lswitch;
 
-const char* PROMPT = "lithp> ";
-const char* VERSION = "0.0.0";
+/**
+ * every environment knows which context it belongs to. frames and the
+ * environments of partially applied functions have the same context as the
+ * environment they were created from.
+ */
+struct lenv {
+  int refs;
+  int count;
+  int cap;
+  int borrowed;
+  lithp_ctx* ctx;
+  lenv* par;
+  char** syms;
+  lval** vals;
+};
 
-mpc_parser_t* Lithp;
+/**
+ * every symbol that is read carries an inline cache, shared between all copies
+ * of that symbol, so each call site remembers which global value it resolved
+ * to last time. the cache is only good for as long as `epoch` matches the
+ * epoch of the context. `local` marks labels that have already been recorded
+ * in the set of names that are bound outside of the global environment.
+ */
+struct lcache {
+  int refs;
+  int local;
+  long epoch;
+  lval* val;
+};
 
-struct lval;
-struct lenv;
-typedef struct lval lval;
-typedef struct lenv lenv;
+typedef enum {
+  JIT_COLD,
+  JIT_COMPILED,
+  JIT_REJECTED
+} ljit_state;
 
-typedef lval*(*lbuiltin)(lenv*, lval*);
+/**
+ * compiled code returns its result in rax and a bail out flag in rdx, which is
+ * exactly how the native calling convention returns a struct of two longs.
+ * the last three arguments are the `STACK_LIMIT` of the calling thread, the
+ * address of its `CALL_DEPTH` and the `max_depth` of the context, which the
+ * code passes along to every call it makes, see `jit_compile_self`.
+ */
+typedef struct {
+  long value;
+  long bail;
+} ljit_result;
+
+#define JIT_BAIL 1
+#define JIT_BAIL_DEPTH 2
+
+typedef ljit_result(*ljit_code)(
+  long, long, long, long, long, long, char*, long*, long
+);
+
+struct ljit {
+  ljit_state state;
+  long calls;
+  long epoch;
+  ljit_code code;
+  size_t size;
+};
 
-typedef enum {
-  LVAL_STR,
-  LVAL_FUN,
-  LVAL_SYM,
-  LVAL_SEXPR,
-  LVAL_QEXPR,
-  LVAL_NUM,
-  LVAL_ERR
-} lval_type;
-
-struct lval {
-  lval_type type;
-
-  // basic
-  long num;
-  char* err;
-  char* sym;
-  char* str;
+typedef struct {
+  long compiled;
+  long rejected;
+  long native;
+  long guards;
+  long bailouts;
+} ljit_stats;
 
-  // function
-  lbuiltin builtin;
-  lenv* env;
+/**
+ * lambdas never change once they have been created. their formals, body and
+ * jit state live in a single record shared by every copy of the function, so
+ * copying a function, or calling it, costs the same no matter how big its
+ * body is. the `env` of a function `lval` only holds the arguments that were
+ * bound by partial application, and is `NULL` when there are none. that
+ * environment never changes either, so it is shared by reference between all
+ * copies of the function.
+ */
+struct lfunc {
+  int refs;
   lval* formals;
   lval* body;
+  lval* code;
+  ljit* jit;
+  lswitch* table;
+};
 
-  // expression
-  int count;
-  struct lval** cell;
+/**
+ * a coroutine runs a function on a C stack of its own, so the recursive
+ * evaluator can be suspended anywhere and picked up again later. `next` links
+ * the task into the run queue or into the wait list of a channel, never both.
+ * `depth` and `limit` hold the `CALL_DEPTH` and `STACK_LIMIT` of the task
+ * while it isn't running. a task runs under the budget of whoever switched to
+ * it, unless it was suspended inside a budget of its own, kept in `budget`.
+ */
+typedef struct ltask ltask;
+
+struct ltask {
+  ucontext_t context;
+  lithp_ctx* ctx;
+  lval* func;
+  void* stack;
+  int blocked;
+  long depth;
+  char* limit;
+  struct lbudget* budget;
+  ltask* next;
 };
 
-struct lenv {
+typedef struct {
+  ltask* head;
+  ltask* tail;
+} lqueue;
+
+/**
+ * bounded channels keep their values in a ring buffer. coroutines that find
+ * it full, or empty, wait in `senders`, or `receivers`, until another one
+ * makes room, or sends something.
+ */
+struct lchan {
+  int refs;
+  int cap;
   int count;
-  lenv* par;
-  char** syms;
-  lval** vals;
+  int head;
+  lval** items;
+  lqueue senders;
+  lqueue receivers;
 };
 
-lval* lval_call(lenv*, lval*, lval*);
-lval* lval_pop(lval*, int);
-lval* lval_eval(lenv*, lval*);
-lval* lval_copy(lval*);
-lenv* lenv_new();
-void lenv_del(lenv* env);
-void lval_print(lval*);
+/**
+ * lazy sequences only describe how to produce their elements, which happens
+ * one at a time when something walks over them with a `lcursor`. they're
+ * immutable, so copies share them the same way functions share their
+ * `lfunc`. `source` is the Q-Expression or sequence that a sequence of kind
+ * `LSEQ_MAP`, `LSEQ_FILTER` or `LSEQ_TAKE_WHILE` reads from, and the seed
+ * of `LSEQ_ITERATE`. `LSEQ_LINES` is the exception: `data` is a file mapped
+ * into memory, `end` its size, and `start` the offset of the next line, which
+ * `next-line` moves forward for every copy of the sequence.
+ */
+typedef enum {
+  LSEQ_RANGE,
+  LSEQ_ITERATE,
+  LSEQ_MAP,
+  LSEQ_FILTER,
+  LSEQ_TAKE_WHILE,
+  LSEQ_LINES
+} lseq_kind;
+
+struct lseq {
+  int refs;
+  lseq_kind kind;
+  int infinite;
+
+  long start;
+  long end;
+  long step;
+
+  lval* func;
+  lval* source;
+
+  char* data;
+};
 
-lval* builtin_op(lenv*, lval*, char*);
-lval* builtin_comp(lenv*, lval*, char*);
+typedef struct lcursor {
+  lval* list;
+  lseq* seq;
+  long next;
+  lval* val;
+  struct lcursor* source;
+  int done;
+} lcursor;
 
-lval* lval_qexpr(void) {
-  lval* val = malloc(sizeof(lval));
-  val->type = LVAL_QEXPR;
-  val->cell = NULL;
-  val->count = 0;
-  return val;
-}
+/**
+ * `root` stands in for whatever is running on the original stack, the REPL
+ * or a file being loaded. coroutines only ever switch to and from the root,
+ * which is where the run queue gets worked through.
+ */
+#define COROUTINE_STACK_SIZE (1024 * 1024)
+#define COROUTINE_STACK_POOL 64
+
+typedef struct {
+  ltask root;
+  ltask* current;
+  lqueue ready;
+  void* stacks[COROUTINE_STACK_POOL];
+  int stack_count;
+  long spawned;
+} lsched;
+
+#define LOCALS_SIZE 1024
+
+typedef struct {
+  char* data;
+  size_t len;
+  size_t cap;
+} lbuf;
 
-lval* lval_builtin(lbuiltin func) {
-  lval* val = malloc(sizeof(lval));
-  val->type = LVAL_FUN;
-  val->builtin = func;
-  return val;
-}
+/**
+ * the characters of every string and symbol live in a `lstr`, which copies of
+ * the value share by counting references rather than copying the characters.
+ * with hash-consing turned on, strings and symbols read from source, from
+ * dumps and from files with `open-lines` are interned in the `lstrtab` of
+ * their context, so equal ones share a single `lstr` wherever they came from,
+ * and `==` tells two interned ones apart by their address alone. `tab` is
+ * the table an interned `lstr` is in, until that table goes away.
+ *
+ * Q-Expressions read from source or dumps, and the ones `list`, `head`,
+ * `tail` and `join` return, are interned the same way in the `lcellstab` of
+ * their context. equal ones share an `lcells` holding their elements, which
+ * copies share as well, so copying an interned list takes a single increment
+ * and `==` tells two of them apart by the address of their cells. since
+ * builtins change the lists they're given in place, anything that changes
+ * the cells of a list has to `lval_unshare` it first, which gives it a copy
+ * of the elements of its own, or takes them over if it held the last
+ * reference. `hash` is what `lval_hash` returns for the list.
+ */
+typedef struct lstr lstr;
+
+typedef struct {
+  lstr** buckets;
+  size_t cap;
+  size_t count;
+  long lookups;
+  long hits;
+  long saved;
+  pthread_mutex_t lock;
+} lstrtab;
+
+struct lstr {
+  int refs;
+  size_t len;
+  unsigned long hash;
+  lstrtab* tab;
+  lstr* next;
+  char data[];
+};
 
-lval* lval_sexpr(void) {
-  lval* val = malloc(sizeof(lval));
-  val->type = LVAL_SEXPR;
-  val->cell = NULL;
-  val->count = 0;
-  return val;
-}
+typedef struct {
+  lcells** buckets;
+  size_t cap;
+  size_t count;
+  long lookups;
+  long hits;
+  long saved;
+  pthread_mutex_t lock;
+} lcellstab;
+
+struct lcells {
+  int refs;
+  int count;
+  unsigned long hash;
+  lcellstab* tab;
+  lcells* next;
+  lval* cell[];
+};
 
-lval* lval_sym(char* sym) {
-  lval* val = malloc(sizeof(lval));
-  val->type = LVAL_SYM;
-  val->sym = malloc(strlen(sym) + 1);
-  strcpy(val->sym, sym);
-  return val;
-}
+typedef struct lname {
+  char* sym;
+  struct lname* next;
+} lname;
 
-lval* lval_num(long num) {
-  lval* val = malloc(sizeof(lval));
-  val->type = LVAL_NUM;
-  val->num = num;
-  return val;
-}
+typedef struct ldeferred {
+  char* sym;
+  lval* form;
+  struct ldeferred* next;
+} ldeferred;
 
-lval* lval_err(char* fmt, ...) {
-  lval* val = malloc(sizeof(lval));
-  val->type = LVAL_ERR;
+/**
+ * `epoch` is bumped every time a global definition changes, and every time a
+ * new name shows up in a local environment. anything that caches the result
+ * of resolving a global symbol, like symbol inline caches or the jit,
+ * remembers the epoch it was built in and throws its work away once the two
+ * no longer match.
+ */
+struct lithp_ctx {
+  mpc_parser_t* parsers[8];
+  mpc_parser_t* lithp;
+  lenv* env;
+  long epoch;
 
-  va_list args;
-  va_start(args, fmt);
+  long errors;
 
-  val->err = malloc(512);
-  vsnprintf(val->err, 511, fmt, args);
-  val->err = realloc(val->err, strlen(val->err) + 1);
+  lname* locals[LOCALS_SIZE];
+  pthread_mutex_t locals_lock;
 
-  va_end(args);
-  return val;
-}
+  int lazy;
+  ldeferred* deferred[LOCALS_SIZE];
+  long deferred_count;
 
-lval* lval_str(char* str) {
-  lval* val = malloc(sizeof(lval));
-  val->type = LVAL_STR;
+  int cache;
+  char* cache_dir;
+  unsigned long grammar_hash;
 
-  val->str = malloc(strlen(str) + 1);
-  strcpy(val->str, str);
+  int jit;
+  ljit_stats stats;
+  int optimize;
 
-  return val;
-}
+  int hashcons;
+  lstrtab strings;
+  lcellstab lists;
 
-lval* lval_lambda(lval* formals, lval* body) {
-  lval* val = malloc(sizeof(lval));
+  lbuf out;
+  pthread_mutex_t out_lock;
 
-  val->type = LVAL_FUN;
-  val->builtin = NULL;
-  val->env = lenv_new();
-  val->formals = formals;
-  val->body = body;
+  int threads;
+  lpool* pool;
+  lprefetch* prefetch;
 
-  return val;
-}
+  lstage_stats* pipeline_stats;
+  int pipeline_stages;
 
-void lval_del(lval* val) {
-  switch (val->type) {
-    case LVAL_NUM: break;
+  lsched sched;
 
-    case LVAL_STR:
-      free(val->str);
-      break;
+  long max_depth;
+  void* stack;
+  size_t stack_size;
 
-    case LVAL_ERR:
-      free(val->err);
-      break;
+  ltrace* trace;
 
-    case LVAL_SYM:
-      free(val->sym);
-      break;
+  long limit_steps;
+  long limit_mem;
+  long limit_ms;
+};
 
-    case LVAL_FUN:
-      if (!val->builtin) {
-        lenv_del(val->env);
-        lval_del(val->formals);
-        lval_del(val->body);
-      }
-      break;
+/**
+ * the tracer records what the evaluator does into a ring of `ltrace_event`s,
+ * which always holds the most recent ones. every S-Expression evaluated, with
+ * the symbol at its head, every builtin called, every lambda entered and
+ * left, and every error created is an event. a thread claims a slot with a
+ * single atomic increment of `head`, so threads never wait on each other,
+ * and marks the slot with its sequence number once it's written, which is how
+ * a dump tells a finished event from one still being written over. calls the
+ * jit makes from native code to itself aren't seen.
+ *
+ * `TRACE` is the ring of the context the current thread is running in, and
+ * `NULL` while tracing is off, which is all a disabled tracer ever costs.
+ * builtins and lambdas are recorded by address, and named in a dump by
+ * looking those up in the global environment.
+ */
+enum {
+  LTRACE_EVAL,
+  LTRACE_BUILTIN,
+  LTRACE_ENTER,
+  LTRACE_LEAVE,
+  LTRACE_ERROR
+};
 
-    case LVAL_SEXPR:
-    case LVAL_QEXPR:
-      for (int i = 0; i < val->count; i++) {
-        lval_del(val->cell[i]);
-      }
+#define LTRACE_TEXT 24
+#define LTRACE_MAGIC "LITHPTRC"
+#define LTRACE_VERSION 1
+
+typedef struct {
+  uint64_t seq;
+  uint64_t time;
+  uint64_t ref;
+  int64_t arg;
+  uint32_t depth;
+  uint8_t kind;
+  uint8_t thread;
+  uint16_t unused;
+  char text[LTRACE_TEXT];
+} ltrace_event;
+
+struct ltrace {
+  lithp_ctx* ctx;
+  ltrace_event* events;
+  unsigned long mask;
+  unsigned long head;
+  char* path;
+  int requests;
+  pthread_mutex_t lock;
+};
 
-      free(val->cell);
-      break;
+#define LTRACE(kind, ref, arg, text) \
+  if (TRACE) { \
+    ltrace_record(TRACE, kind, (uint64_t) (uintptr_t) (ref), arg, text); \
   }
 
-  free(val);
-}
+_Thread_local ltrace* TRACE = NULL;
+_Thread_local int TRACE_THREAD = 0;
 
-lenv* lenv_new() {
-  lenv* env = malloc(sizeof(lenv));
-  env->count = 0;
-  env->par = NULL;
-  env->syms = NULL;
-  env->vals = NULL;
-  return env;
+int TRACE_THREADS = 0;
+volatile sig_atomic_t TRACE_REQUESTS = 0;
+
+void ltrace_dump_requested(ltrace*);
+
+uint64_t ltrace_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
-void lenv_del(lenv* env) {
-  for (int i = 0; i < env->count; i++) {
-    free(env->syms[i]);
-    lval_del(env->vals[i]);
+uint64_t ltrace_record(
+  ltrace* trace, int kind, uint64_t ref, int64_t arg, const char* text
+) {
+  if (!TRACE_THREAD) {
+    TRACE_THREAD = __atomic_add_fetch(&TRACE_THREADS, 1, __ATOMIC_RELAXED);
   }
 
-  free(env->syms);
-  free(env->vals);
-  free(env);
-}
+  unsigned long seq = __atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED);
+  ltrace_event* event = &trace->events[seq & trace->mask];
+  uint64_t time = ltrace_now();
 
-/**
- * to get a value from the environment we loop over all the items in the
- * environment and check if the given symbol matches any of the stored strings.
- * if we find a match we can return a copy of the stored value. if no match is
- * found we should return an error.
- */
-lval* lenv_get(lenv* env, lval* label) {
-  for (int i = 0; i < env->count; i++) {
-    if (strcmp(env->syms[i], label->sym) == 0) {
-      return lval_copy(env->vals[i]);
-    }
+  __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  event->time = time;
+  event->ref = ref;
+  event->arg = arg;
+  event->depth = CALL_DEPTH;
+  event->kind = kind;
+  event->thread = TRACE_THREAD;
+  event->unused = 0;
+  memset(event->text, 0, LTRACE_TEXT);
+
+  if (text) {
+    strncpy(event->text, text, LTRACE_TEXT - 1);
   }
 
-  if (env->par) {
-    return lenv_get(env->par, label);
-  } else {
-    return lval_err("Unbound symbol '%s'!", label->sym);
+  __atomic_store_n(&event->seq, seq + 1, __ATOMIC_RELEASE);
+
+  if (TRACE_REQUESTS != trace->requests) {
+    ltrace_dump_requested(trace);
   }
+
+  return time;
+}
+
+char* ltrace_head(lval* expr) {
+  return expr->count && expr->cell[0]->type == LVAL_SYM
+    ? expr->cell[0]->sym : NULL;
 }
 
 /**
- * because we have a new `lval` type that has it own environment we need a
- * function for copying environments, to use for when we copy `lval` structs.
+ * a budget bounds how many steps an evaluation may take, every S-Expression
+ * evaluated, element added to a list and element taken from a sequence being
+ * one, how many more bytes of memory may be held while it runs,
+ * and until when it may run. `BUDGET` is the one the current thread is
+ * running under, if any. rather than settle every step with the budget, each
+ * thread is handed `FUEL`, at most `BUDGET_CHECK_STEPS` steps at a time, and
+ * only once that has been used up are the steps added to the budget and the
+ * clock and the memory looked at, so all a step costs is a decrement. without
+ * a budget the fuel never runs out.
+ *
+ * every thread counts in `HEAP` the bytes of the values and strings it has
+ * allocated, less those it has freed, and settling adds what that changed by
+ * to the budget the thread was running under, the same way it does with the
+ * steps. memory used by other threads, like those of another context or the
+ * readers of `lithp_prefetch`, is never charged to a budget, while the
+ * workers of a parallel builtin run under the budget of its caller. the
+ * arrays holding the elements of lists count as well, at a pointer for every
+ * element, as do environments and the frames of calls, with their bindings
+ * and the names they are bound to.
+ *
+ * once any limit is reached the budget stays exhausted, so every step after
+ * that fails straight away and the evaluation unwinds as quickly as errors
+ * can travel back up. whatever it returns is then replaced by the error
+ * saying which limit was reached. a budget inside another one gets no more
+ * than what is left of the outer one, and its steps count towards both. the
+ * jit is skipped while a budget is in place, since native code doesn't take
+ * steps.
  */
-lenv* lenv_copy(lenv* env) {
-  int count = env->count;
-  lenv* copy = malloc(sizeof(lenv));
+#define BUDGET_CHECK_STEPS 4096
 
-  copy->count = count;
-  copy->par = env->par;
-  copy->syms = malloc(sizeof(char*) * count);
-  copy->vals = malloc(sizeof(lval*) * count);
+enum {
+  LBUDGET_OK,
+  LBUDGET_STEPS,
+  LBUDGET_MEM,
+  LBUDGET_TIME
+};
 
-  for (int i = 0; i < count; i++) {
-    copy->vals[i] = lval_copy(env->vals[i]);
-    copy->syms[i] = malloc(strlen(env->syms[i]) + 1);
-    strcpy(copy->syms[i], env->syms[i]);
+typedef struct lbudget {
+  long steps;
+  long mem;
+  long ms;
+  uint64_t deadline;
+  long used;
+  long grown;
+  int exhausted;
+  struct lbudget* outer;
+} lbudget;
+
+_Thread_local lbudget* BUDGET = NULL;
+_Thread_local long FUEL = LONG_MAX;
+_Thread_local long FUEL_GRANTED = 0;
+_Thread_local long HEAP = 0;
+_Thread_local long HEAP_SETTLED = 0;
+
+/**
+ * adds the steps taken and the bytes allocated since the fuel was last
+ * handed out to the budget.
+ */
+void lbudget_settle(void) {
+  if (BUDGET) {
+    long taken = FUEL_GRANTED - FUEL;
+    __atomic_add_fetch(&BUDGET->used, taken, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&BUDGET->grown, HEAP - HEAP_SETTLED, __ATOMIC_RELAXED);
   }
 
-  return copy;
+  FUEL = 0;
+  FUEL_GRANTED = 0;
+  HEAP_SETTLED = HEAP;
 }
 
 /**
- * the function for putting new variables into the environment is a little bit
- * more complex. first we want to check if a variable with the same name
- * already exists. if this is the case we should replace its value with the new
- * one. to do this we loop over all the existing variables in the environment
- * and check their name. if a match is found we delete the value stored at that
- * location, and store there a copy of the input value. if no existing value is
- * found with that name, we need to allocate some more space to out it in. for
- * this we can use `realloc`, and store a copy of the `lval` and its name at
- * the newly allocated locations.
+ * called once `FUEL` runs out. returns whether the budget is exhausted, and
+ * otherwise hands out more fuel.
  */
-void lenv_put(lenv* env, lval* label, lval* value) {
-  for (int i = 0; i < env->count; i++) {
-    if (strcmp(env->syms[i], label->sym) == 0) {
-      lval_del(env->vals[i]);
-      env->vals[i] = lval_copy(value);
-      env->syms[i] = realloc(env->syms[i], strlen(label->sym) + 1);
-      strcpy(env->syms[i], label->sym);
-      return;
-    }
+int lbudget_refuel(void) {
+  lbudget* budget = BUDGET;
+
+  if (!budget) {
+    FUEL = LONG_MAX;
+    return 0;
   }
 
-  env->count++;
+  lbudget_settle();
+
+  long used = __atomic_load_n(&budget->used, __ATOMIC_RELAXED);
+  long grown = __atomic_load_n(&budget->grown, __ATOMIC_RELAXED);
+  int exhausted = __atomic_load_n(&budget->exhausted, __ATOMIC_RELAXED);
 
-  env->vals = realloc(env->vals, sizeof(lval*) * env->count);
-  env->syms = realloc(env->syms, sizeof(char*) * env->count);
+  if (!exhausted && budget->steps && used >= budget->steps) {
+    exhausted = LBUDGET_STEPS;
+  }
+
+  if (!exhausted && budget->deadline && ltrace_now() >= budget->deadline) {
+    exhausted = LBUDGET_TIME;
+  }
+
+  if (!exhausted && budget->mem && grown > budget->mem) {
+    exhausted = LBUDGET_MEM;
+  }
+
+  if (exhausted) {
+    __atomic_store_n(&budget->exhausted, exhausted, __ATOMIC_RELAXED);
+    return 1;
+  }
+
+  long grant = BUDGET_CHECK_STEPS;
 
-  env->vals[env->count - 1] = lval_copy(value);
-  env->syms[env->count - 1] = malloc(strlen(label->sym) + 1);
-  strcpy(env->syms[env->count - 1], label->sym);
+  if (budget->steps && budget->steps - used < grant) {
+    grant = budget->steps - used;
+  }
+
+  FUEL = FUEL_GRANTED = grant;
+  return 0;
 }
 
 /**
- * having parent environments also changes our concept of defining a variable.
- * there are two ways we could define a variable now. either we could define it
- * in local, innermost environment., or we could define it in the global,
- * outermost environment. we will add functions to do both. we'll leave the
- * `lenv_put` method the same. it can be used for definition in the local
- * environment. but we'll add a new function `lenv_def` for definition in the
- * global environment. this works by simply following the parent chain up
- * before using lval_put to define locally.
+ * makes `budget` the one the current thread runs under, which may be `NULL`.
  */
-void lenv_def(lenv* env, lval* label, lval* value) {
-  while (env->par) env = env->par;
-  lenv_put(env, label, value);
+void lbudget_switch(lbudget* budget) {
+  lbudget_settle();
+  BUDGET = budget;
 }
 
-lval* lval_read_num(mpc_ast_t* t) {
-  errno = 0;
-  long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ?
-    lval_num(x) : lval_err("bad number");
+/**
+ * zero means no limit.
+ */
+void lbudget_init(lbudget* budget, long steps, long mem, long ms) {
+  budget->steps = steps;
+  budget->mem = mem;
+  budget->ms = ms;
+  budget->deadline = ms ? ltrace_now() + (uint64_t) ms * 1000000 : 0;
+  budget->used = 0;
+  budget->grown = 0;
+  budget->exhausted = LBUDGET_OK;
+  budget->outer = NULL;
 }
 
-lval* lval_read_str(mpc_ast_t* t) {
-  t->contents[strlen(t->contents) - 1] = '\0';
+void lbudget_enter(lbudget* budget) {
+  lbudget_settle();
+  lbudget* outer = BUDGET;
 
-  char* unescaped = malloc(strlen(t->contents + 1) + 1);
-  strcpy(unescaped, t->contents + 1);
+  if (outer) {
+    long used = __atomic_load_n(&outer->used, __ATOMIC_RELAXED);
+    long left = outer->steps ? outer->steps - used : 0;
 
-  unescaped = mpcf_unescape(unescaped);
-  lval* str = lval_str(unescaped);
+    if (outer->steps && (!budget->steps || left < budget->steps)) {
+      budget->steps = left > 0 ? left : 1;
+      budget->exhausted = left > 0 ? LBUDGET_OK : LBUDGET_STEPS;
+    }
 
-  free(unescaped);
-  return str;
-}
+    if (outer->deadline && (!budget->deadline || outer->deadline < budget->deadline)) {
+      budget->deadline = outer->deadline;
+    }
 
-lval* lval_add(lval* val, lval* child) {
-  val->count++;
-  val->cell = realloc(val->cell, sizeof(lval*) * val->count);
-  val->cell[val->count - 1] = child;
-  return val;
-}
+    if (outer->mem) {
+      long grown = __atomic_load_n(&outer->grown, __ATOMIC_RELAXED);
+      long room = outer->mem - (grown > 0 ? grown : 0);
 
-lval* lval_join(lval* holder, lval* drained) {
-  while (drained->count) {
-    holder = lval_add(holder, lval_pop(drained, 0));
+      if (!budget->mem || room < budget->mem) {
+        budget->mem = room > 0 ? room : 1;
+      }
+    }
+
+    budget->outer = outer;
   }
 
-  lval_del(drained);
+  BUDGET = budget;
+}
 
-  return holder;
+/**
+ * hands the steps taken and the bytes allocated back to the outer budget,
+ * which is exhausted as well if it was what the inner one ran out of.
+ */
+void lbudget_leave(lbudget* budget) {
+  lbudget_settle();
+  lbudget* outer = budget->outer;
+  BUDGET = outer;
+
+  if (outer) {
+    __atomic_add_fetch(&outer->used, budget->used, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&outer->grown, budget->grown, __ATOMIC_RELAXED);
+
+    lbudget_refuel();
+  }
 }
 
-lval* lval_read(mpc_ast_t* t) {
-  if (strstr(t->tag, "number"))
-    return lval_read_num(t);
-  if (strstr(t->tag, "symbol"))
-    return lval_sym(t->contents);
-  if (strstr(t->tag, "string"))
-    return lval_read_str(t);
+/**
+ * returns `result`, unless the budget ran out while it was being evaluated.
+ */
+lval* lbudget_result(lbudget* budget, lval* result) {
+  if (budget->outer && budget->outer->exhausted) {
+    return lbudget_result(budget->outer, result);
+  }
 
-  lval* val = NULL;
+  switch (budget->exhausted) {
+    case LBUDGET_STEPS:
+      lval_del(result);
+      return lval_err("Evaluation exceeded its limit of %li steps.", budget->steps);
 
-  if (strcmp(t->tag, ">") == 0)
-    val = lval_sexpr();
-  if (strstr(t->tag, "sexpr"))
-    val = lval_sexpr();
-  if (strstr(t->tag, "qexpr"))
-    val = lval_qexpr();
+    case LBUDGET_MEM:
+      lval_del(result);
+      return lval_err("Evaluation exceeded its limit of %li bytes.", budget->mem);
 
-  for (int i = 0; i < t->children_num; i++) {
-    if (strcmp(t->children[i]->contents, "(") == 0)
-      continue;
-    if (strcmp(t->children[i]->contents, ")") == 0)
-      continue;
-    if (strcmp(t->children[i]->contents, "{") == 0)
-      continue;
-    if (strcmp(t->children[i]->contents, "}") == 0)
-      continue;
-    if (strcmp(t->children[i]->tag, "regex") == 0)
-      continue;
-    if (strstr(t->children[i]->tag, "comment"))
-      continue;
+    case LBUDGET_TIME:
+      lval_del(result);
+      return lval_err("Evaluation exceeded its limit of %li ms.", budget->ms);
 
-    val = lval_add(val, lval_read(t->children[i]));
+    default:
+      return result;
   }
+}
 
-  return val;
+lval* lbudget_err(void) {
+  return lbudget_result(BUDGET, lval_sexpr());
 }
 
-void lval_expr_print(lval* val, char open, char close) {
-  putchar(open);
+/**
+ * returns `result` of an evaluation under the current budget, if any.
+ */
+lval* lbudget_check(lval* result) {
+  return BUDGET ? lbudget_result(BUDGET, result) : result;
+}
 
-  for (int i = 0; i < val->count; i++) {
-    lval_print(val->cell[i]);
+lval* lval_eval_ref(lenv*, lval*);
+lval* lval_eval_body(lenv*, lval*);
+lenv* lenv_frame(lenv*, int);
+void lenv_frame_del(lenv*);
+lval* lval_optimize(lenv*, lval*);
+int lval_is_guard(lval*);
+lval* lval_guard_eval(lenv*, lval*);
+void lswitch_del(lswitch*);
+lenv* lenv_new(lithp_ctx*);
+void lenv_del(lenv* env);
+void lenv_release(lenv* env);
+lenv* lenv_copy(lenv*);
+ljit* jit_new(void);
+void jit_del(ljit*);
+void lpool_del(lpool*);
+void lchan_release(lchan*);
+void lseq_release(lseq*);
+lval* lseq_realize_args(lenv*, lval*);
+int ldefer_force(lithp_ctx*, char*);
+int ltrace_write(ltrace*, const char*);
+lval* lmodule_read(lenv*, char*);
+void ldefer_force_all(lithp_ctx*);
+lval* lprefetch_take(lithp_ctx*, const char*);
 
-    if (i != (val->count - 1)) {
-      putchar(' ');
-    }
+/**
+ * builtins that work on Q-Expressions start with this, so that they can be
+ * given a lazy sequence as well.
+ */
+#define LREALIZE(env, args) { \
+    lval* err = lseq_realize_args(env, args); \
+    if (err) { \
+      return err; \
+    } \
   }
 
-  putchar(close);
-}
-
-void lval_print_str(lval* val) {
-  char* escaped = malloc(sizeof(val->str) + 1);
-  strcpy(escaped, val->str);
+lval* builtin_op(lenv*, lval*, char*);
+lval* builtin_comp(lenv*, lval*, char*);
+lval* builtin_jit_stats(lenv*, lval*);
+lval* builtin_intern_stats(lenv*, lval*);
+lval* builtin_pmap(lenv*, lval*);
+lval* builtin_pfilter(lenv*, lval*);
+lval* builtin_preduce(lenv*, lval*);
+lval* builtin_pipeline(lenv*, lval*);
+lval* builtin_pipeline_stats(lenv*, lval*);
+lval* builtin_spawn(lenv*, lval*);
+lval* builtin_yield(lenv*, lval*);
+lval* builtin_chan(lenv*, lval*);
+lval* builtin_send(lenv*, lval*);
+lval* builtin_recv(lenv*, lval*);
+lval* builtin_range(lenv*, lval*);
+lval* builtin_iterate(lenv*, lval*);
+lval* builtin_lazy_map(lenv*, lval*);
+lval* builtin_lazy_filter(lenv*, lval*);
+lval* builtin_take_while(lenv*, lval*);
+lval* builtin_realize(lenv*, lval*);
+lval* builtin_fold(lenv*, lval*);
+lval* builtin_while(lenv*, lval*);
+lval* builtin_dotimes(lenv*, lval*);
+lval* builtin_for_each(lenv*, lval*);
+lval* builtin_loop(lenv*, lval*);
+lval* builtin_recur(lenv*, lval*);
+lval* special_while(lenv*, lval*);
+lval* special_dotimes(lenv*, lval*);
+lval* special_for_each(lenv*, lval*);
+lval* special_loop(lenv*, lval*);
+lval* builtin_open_lines(lenv*, lval*);
+lval* builtin_next_line(lenv*, lval*);
+lval* builtin_fold_lines(lenv*, lval*);
+lval* builtin_dump(lenv*, lval*);
+lval* builtin_undump(lenv*, lval*);
+lval* builtin_trace_dump(lenv*, lval*);
+void lsched_drain(lithp_ctx*);
+lval* lval_sym_of(char*);
+lval* lval_str_of(char*);
+lval* lval_call1(lenv*, lval*, lval*);
+lval* lval_intern(lithp_ctx*, lval*);
+
+unsigned long lhash(const char* data, size_t len) {
+  unsigned long hash = 14695981039346656037UL;
+
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char) data[i]) * 1099511628211UL;
+  }
 
-  escaped = mpcf_escape(escaped);
-  printf("\"%s\"", escaped);
-  free(escaped);
+  return hash;
 }
 
-char* ltype_name(lval_type type) {
-  switch (type) {
-    case LVAL_FUN: return "Function";
-    case LVAL_SYM: return "Symbol";
-    case LVAL_SEXPR: return "S-Expression";
-    case LVAL_QEXPR: return "Q-Expression";
-    case LVAL_NUM: return "Number";
-    case LVAL_STR: return "String";
-    case LVAL_ERR: return "Error";
-    default: return "Unknown type";
-  }
+lstr* lstr_of(char* data) {
+  return (lstr*) (data - offsetof(lstr, data));
 }
 
-void lval_print(lval* val) {
-  switch (val->type) {
-    case LVAL_FUN:
-      if (val->builtin) {
-        printf("<builtin>");
-      } else {
-        printf("(\\ ");
-        lval_print(val->formals);
-        putchar(' ');
-        lval_print(val->body);
-        putchar(')');
-      }
-      break;
-
-    case LVAL_SYM:
-      printf("%s", val->sym);
-      break;
-
-    case LVAL_SEXPR:
-      lval_expr_print(val, '(', ')');
-      break;
+char* lstr_new(const char* data, size_t len) {
+  lstr* str = malloc(sizeof(lstr) + len + 1);
+  HEAP += sizeof(lstr) + len + 1;
+  str->refs = 1;
+  str->len = len;
+  str->hash = 0;
+  str->tab = NULL;
+  str->next = NULL;
 
-    case LVAL_QEXPR:
-      lval_expr_print(val, '{', '}');
-      break;
+  memcpy(str->data, data, len);
+  str->data[len] = '\0';
 
-    case LVAL_STR:
-      lval_print_str(val);
-      break;
+  return str->data;
+}
 
-    case LVAL_NUM:
-      printf("%li", val->num);
-      break;
+/**
+ * starts `buf` with room for the header of a `lstr` in front, so whatever is
+ * written to it can be handed over as a string by `lstr_adopt` without
+ * copying the characters.
+ */
+void lstr_buf(lbuf* buf) {
+  buf->cap = offsetof(lstr, data) + 64;
+  buf->data = malloc(buf->cap);
+  buf->len = offsetof(lstr, data);
+}
 
-    case LVAL_ERR:
-      printf("Error: %s", val->err);
-      break;
-  }
+char* lstr_adopt(lbuf* buf) {
+  size_t len = buf->len - offsetof(lstr, data);
+  lstr* str = realloc(buf->data, buf->len + 1);
+  HEAP += sizeof(lstr) + len + 1;
+  str->refs = 1;
+  str->len = len;
+  str->hash = 0;
+  str->tab = NULL;
+  str->next = NULL;
+  str->data[len] = '\0';
+
+  buf->data = NULL;
+  buf->len = 0;
+  buf->cap = 0;
+
+  return str->data;
 }
 
-void lval_println(lval* val) {
-  lval_print(val);
-  putchar('\n');
+char* lstr_share(char* data) {
+  LREF_INC(lstr_of(data)->refs);
+  return data;
 }
 
-char* read(char* filename) {
-  char* buffer = 0;
-  long length;
+/**
+ * once the last reference to an interned `lstr` is gone it stays in the table
+ * until it's taken out here, but `lstr_intern` never hands it out again, so
+ * whoever dropped that reference is the only one left to free it.
+ */
+void lstr_release(char* data) {
+  lstr* str = lstr_of(data);
+
+  if (LREF_DEC(str->refs) != 0) {
+    return;
+  }
+
+  lstrtab* tab = str->tab;
 
-  FILE* file = fopen(filename, "r");
+  if (tab) {
+    pthread_mutex_lock(&tab->lock);
 
-  if (file) {
-    fseek(file, 0, SEEK_END);
-    length = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    buffer = malloc(length);
+    lstr** link = &tab->buckets[str->hash & (tab->cap - 1)];
 
-    if (buffer) {
-      fread(buffer, 1, length, file);
+    while (*link != str) {
+      link = &(*link)->next;
     }
 
-    fclose(file);
+    *link = str->next;
+    tab->count--;
+    pthread_mutex_unlock(&tab->lock);
   }
 
-  return buffer;
+  HEAP -= sizeof(lstr) + str->len + 1;
+  free(str);
 }
 
-/**
- * useful when we put things into, and take things out of, the
- * environment. for number and function s we can just copy the relevant
- * fields directly. for strings we need to copy using `malloc` and
- * `strcpy`. to copy lists we need to allocate the correct amount of
- * space and then copy each element individually.
- */
-lval* lval_copy(lval* source) {
-  lval* target = malloc(sizeof(lval));
-  target->type = source->type;
-
-  switch (source->type) {
-    case LVAL_FUN:
-      if (source->builtin) {
-        target->builtin = source->builtin;
-      } else {
-        target->builtin = NULL;
-        target->env = lenv_copy(source->env);
-        target->formals = lval_copy(source->formals);
-        target->body = lval_copy(source->body);
-      }
-      break;
-
-    case LVAL_STR:
-      target->str = malloc(strlen(source->str) + 1);
-      strcpy(target->str, source->str);
-      break;
+int lstr_eq(char* left, char* right) {
+  if (left == right) {
+    return 1;
+  }
 
-    case LVAL_NUM:
-      target->num = source->num;
-      break;
+  lstr* l = lstr_of(left);
+  lstr* r = lstr_of(right);
 
-    case LVAL_ERR:
-      target->err = malloc(strlen(source->err) + 1);
-      strcpy(target->err, source->err);
-      break;
+  if (l->len != r->len || (l->tab && l->tab == r->tab)) {
+    return 0;
+  }
 
-    case LVAL_SYM:
-      target->sym = malloc(strlen(source->sym) + 1);
-      strcpy(target->sym, source->sym);
-      break;
+  return memcmp(left, right, l->len) == 0;
+}
 
-    case LVAL_SEXPR:
-    case LVAL_QEXPR:
-      target->count = source->count;
-      target->cell = malloc(sizeof(lval*) * target->count);
+void lstrtab_grow(lstrtab* tab) {
+  size_t cap = tab->cap ? tab->cap * 2 : 1024;
+  lstr** buckets = calloc(cap, sizeof(lstr*));
 
-      for (int i = 0; i < target->count; i++) {
-        target->cell[i] = lval_copy(source->cell[i]);
-      }
+  for (size_t i = 0; i < tab->cap; i++) {
+    lstr* str = tab->buckets[i];
 
-      break;
+    while (str) {
+      lstr* next = str->next;
+      str->next = buckets[str->hash & (cap - 1)];
+      buckets[str->hash & (cap - 1)] = str;
+      str = next;
+    }
   }
 
-  return target;
+  free(tab->buckets);
+  tab->buckets = buckets;
+  tab->cap = cap;
 }
 
 /**
- * extracts a single element from an S-Expression at the index i and shifts the
- * rest of the list backward so that it no longer contains that `lval*`. It
- * then returns the extracted value. Notice that it doesn't delete the input
- * list. It is like taking an element from a list and popping it out, leaving
- * what remains. This means that both the element popped and the old list need
- * to be deleted at some ppoint with `lval_del`.
+ * takes a reference to an interned `lstr` or `lcells`, unless its last one has
+ * already been dropped and it's on its way out of the table.
  */
-lval* lval_pop(lval* val, int i) {
-  lval* child = val->cell[i];
+int lref_acquire(int* count) {
+  int refs = __atomic_load_n(count, __ATOMIC_RELAXED);
 
-  memmove(&val->cell[i], &val->cell[i + 1],
-    sizeof(lval*) * (val->count - 1));
-
-  val->count--;
-  val->cell = realloc(val->cell, sizeof(lval*) * val->count);
+  while (refs > 0) {
+    if (__atomic_compare_exchange_n(count, &refs, refs + 1, 1,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      return 1;
+    }
+  }
 
-  return child;
+  return 0;
 }
 
 /**
- * similar to `lval_pop` but it deletes the list it has extracted the element
- * from. This is like taking an element from the list and deleting the rest. It
- * is a slight variation on `lval_pop` but it makes our code easier to read in
- * some places. Unlike `lval_pop`, only the expression you take from the list
- * needs to be deleted by `lval_del`.
+ * returns the characters of a string or symbol, shared with every other equal
+ * one if hash-consing is on.
  */
-lval* lval_take(lval* val, int i) {
-  lval* child = lval_pop(val, i);
-  lval_del(val);
-  return child;
-}
+char* lstr_intern(lithp_ctx* ctx, const char* data, size_t len) {
+  if (!ctx->hashcons) {
+    return lstr_new(data, len);
+  }
 
-int lval_eq(lval* left, lval* right) {
-  if (left->type != right->type) {
-    return 0;
-  } else {
-    switch (left->type) {
-      case LVAL_FUN:
-        if (left->builtin || right->builtin) {
-          return left->builtin == right->builtin;
-        } else {
-          return lval_eq(left->formals, right->formals)
-            && lval_eq(left->body, right->body);
-        }
+  lstrtab* tab = &ctx->strings;
+  unsigned long hash = lhash(data, len);
 
-        break;
+  pthread_mutex_lock(&tab->lock);
+  tab->lookups++;
 
-      case LVAL_SYM:
-        return strcmp(left->sym, right->sym) == 0;
-        break;
+  if (tab->count >= tab->cap) {
+    lstrtab_grow(tab);
+  }
 
-      case LVAL_SEXPR:
-      case LVAL_QEXPR:
-        if (left->count != right->count) {
-          return 0;
-        }
+  lstr** bucket = &tab->buckets[hash & (tab->cap - 1)];
 
-        for (int i = 0; i < left->count; i++) {
-          if (!lval_eq(left->cell[i], right->cell[i])) {
-            return 0;
-          }
-        }
+  for (lstr* str = *bucket; str; str = str->next) {
+    if (
+      str->hash == hash && str->len == len &&
+      !memcmp(str->data, data, len) && lref_acquire(&str->refs)
+    ) {
+      tab->hits++;
+      tab->saved += sizeof(lstr) + len + 1;
+      pthread_mutex_unlock(&tab->lock);
 
-        return 1;
-        break;
+      return str->data;
+    }
+  }
 
-      case LVAL_STR:
-        return strcmp(left->str, right->str) == 0;
-        break;
+  lstr* str = lstr_of(lstr_new(data, len));
+  str->hash = hash;
+  str->tab = tab;
+  str->next = *bucket;
+  *bucket = str;
+  tab->count++;
 
-      case LVAL_NUM:
-        return left->num == right->num;
-        break;
+  pthread_mutex_unlock(&tab->lock);
+  return str->data;
+}
 
-      case LVAL_ERR:
-        return strcmp(left->err, right->err) == 0;
-        break;
+/**
+ * strings can outlive their context, so whatever is still interned when it
+ * goes away is simply left to be freed by its last reference.
+ */
+void lstrtab_del(lstrtab* tab) {
+  for (size_t i = 0; i < tab->cap; i++) {
+    for (lstr* str = tab->buckets[i]; str; str = str->next) {
+      str->tab = NULL;
     }
   }
+
+  free(tab->buckets);
+  pthread_mutex_destroy(&tab->lock);
 }
 
-lval* builtin_arity(lenv* env, lval* func) {
-  UNUSED(env);
+/**
+ * takes interned cells whose last reference is gone out of their table.
+ */
+void lcells_unlink(lcells* cells) {
+  lcellstab* tab = cells->tab;
 
-  LASSERT_ARG_COUNT(func, "arity", 1);
-  LASSERT_ARG_TYPE_AT(func, "arity", LVAL_FUN, 0);
+  if (!tab) {
+    return;
+  }
 
-  int count;
+  pthread_mutex_lock(&tab->lock);
 
-  if (func->cell[0]->builtin) {
-    count = -1;
-  } else {
-    count = func->cell[0]->formals->count;
-  }
+  lcells** link = &tab->buckets[cells->hash & (tab->cap - 1)];
 
-  lval_del(func);
+  while (*link != cells) {
+    link = &(*link)->next;
+  }
 
-  return lval_num(count);
+  *link = cells->next;
+  tab->count--;
+  pthread_mutex_unlock(&tab->lock);
 }
 
-lval* builtin_load(lenv* env, lval* args) {
-  UNUSED(env);
-
-  LASSERT_ARG_COUNT(args, "load", 1);
-  LASSERT_ARG_TYPE_AT(args, "load", LVAL_STR, 0);
+/**
+ * drops a reference to `cells`, and returns whether it was the last one, in
+ * which case the elements are left for the caller to delete before it frees
+ * `cells` with `lcells_free`.
+ */
+int lcells_release(lcells* cells) {
+  if (LREF_DEC(cells->refs) != 0) {
+    return 0;
+  }
 
-  mpc_result_t r;
+  lcells_unlink(cells);
+  return 1;
+}
 
-  if (mpc_parse_contents(args->cell[0]->str, Lithp, &r)) {
-    lval* expr = lval_read(r.output);
-    mpc_ast_delete(r.output);
+void lcells_free(lcells* cells) {
+  HEAP -= sizeof(lcells) + sizeof(lval*) * cells->count;
+  free(cells);
+}
 
-    while (expr->count) {
-      lval* x = lval_eval(env, lval_pop(expr, 0));
+void lcellstab_grow(lcellstab* tab) {
+  size_t cap = tab->cap ? tab->cap * 2 : 1024;
+  lcells** buckets = calloc(cap, sizeof(lcells*));
 
-      if (x->type == LVAL_ERR) {
-        lval_println(x);
-      }
+  for (size_t i = 0; i < tab->cap; i++) {
+    lcells* cells = tab->buckets[i];
 
-      lval_del(x);
+    while (cells) {
+      lcells* next = cells->next;
+      cells->next = buckets[cells->hash & (cap - 1)];
+      buckets[cells->hash & (cap - 1)] = cells;
+      cells = next;
     }
-
-    lval_del(expr);
-    lval_del(args);
-
-    return lval_sexpr();
-  } else {
-    char* err_msg = mpc_err_string(r.error);
-    mpc_err_delete(r.error);
-
-    lval* err = lval_err("Could not load file: %s", err_msg);
-    free(err_msg);
-    lval_del(args);
-
-    return err;
   }
-}
 
-lval* builtin_print(lenv* env, lval* args) {
-  UNUSED(env);
+  free(tab->buckets);
+  tab->buckets = buckets;
+  tab->cap = cap;
+}
 
-  for (int i = 0; i < args->count; i++) {
-    lval_print(args->cell[i]);
-    putchar(' ');
+/**
+ * like strings, lists can outlive their context.
+ */
+void lcellstab_del(lcellstab* tab) {
+  for (size_t i = 0; i < tab->cap; i++) {
+    for (lcells* cells = tab->buckets[i]; cells; cells = cells->next) {
+      cells->tab = NULL;
+    }
   }
 
-  putchar('\n');
-  lval_del(args);
-  return lval_sexpr();
+  free(tab->buckets);
+  pthread_mutex_destroy(&tab->lock);
 }
 
-lval* builtin_error(lenv* env, lval* args) {
-  UNUSED(env);
+/**
+ * an open addressing hash table from symbol names to their index in `syms`.
+ * `slots` hold the index plus one, so that 0 means empty.
+ */
+typedef struct {
+  char** syms;
+  int count;
+  int* slots;
+  int cap;
+} lsymtab;
 
-  LASSERT_ARG_COUNT(args, "error", 1);
-  LASSERT_ARG_TYPE_AT(args, "error", LVAL_STR, 0);
+int lsymtab_intern(lsymtab* tab, char* sym) {
+  if ((tab->count + 1) * 2 > tab->cap) {
+    int cap = tab->cap ? tab->cap * 2 : 64;
+    int* slots = calloc(cap, sizeof(int));
 
-  lval* err = lval_err(args->cell[0]->str);
-  lval_del(args);
+    for (int i = 0; i < tab->count; i++) {
+      unsigned long slot = lhash(tab->syms[i], strlen(tab->syms[i])) & (cap - 1);
 
-  return err;
-}
+      while (slots[slot]) {
+        slot = (slot + 1) & (cap - 1);
+      }
 
-lval* builtin_head(lenv* env, lval* args) {
-  UNUSED(env);
+      slots[slot] = i + 1;
+    }
 
-  LASSERT_ARG_COUNT(args, "head", 1);
-  LASSERT_ARG_TYPE_AT(args, "head", LVAL_QEXPR, 0);
-  LASSERT(args, args->cell[0]->count != 0,
-    "Function 'head' passed an empty Q-Expression.");
+    free(tab->slots);
+    tab->slots = slots;
+    tab->cap = cap;
+    tab->syms = realloc(tab->syms, sizeof(char*) * cap / 2);
+  }
 
-  // get the first argument then pop all elements from it until we have just
-  // one and return that
-  lval* arg = lval_take(args, 0);
+  unsigned long slot = lhash(sym, strlen(sym)) & (tab->cap - 1);
 
-  while (arg->count > 1) {
-    lval_del(lval_pop(arg, 1));
+  while (tab->slots[slot]) {
+    if (strcmp(tab->syms[tab->slots[slot] - 1], sym) == 0) {
+      return tab->slots[slot] - 1;
+    }
+
+    slot = (slot + 1) & (tab->cap - 1);
   }
 
-  return arg;
+  tab->syms[tab->count] = sym;
+  tab->slots[slot] = ++tab->count;
+
+  return tab->count - 1;
 }
 
-lval* builtin_tail(lenv* env, lval* args) {
-  UNUSED(env);
+lval* lval_alloc(void) {
+  HEAP += sizeof(lval);
+  return malloc(sizeof(lval));
+}
+
+lval* lval_qexpr(void) {
+  lval* val = lval_alloc();
+  val->type = LVAL_QEXPR;
+  val->cell = NULL;
+  val->count = 0;
+  val->shared = NULL;
+  return val;
+}
+
+lval* lval_builtin(lbuiltin func) {
+  lval* val = lval_alloc();
+  val->type = LVAL_FUN;
+  val->builtin = func;
+  val->special = NULL;
+  val->nullary = 0;
+  val->fun = NULL;
+  val->env = NULL;
+  return val;
+}
+
+lval* lval_sexpr(void) {
+  lval* val = lval_alloc();
+  val->type = LVAL_SEXPR;
+  val->cell = NULL;
+  val->count = 0;
+  val->shared = NULL;
+  return val;
+}
+
+lval* lval_sym(char* sym) {
+  return lval_sym_of(lstr_new(sym, strlen(sym)));
+}
+
+/**
+ * `lval_sym_of` and `lval_str_of` take over the `lstr` whose characters are
+ * `data`.
+ */
+lval* lval_sym_of(char* data) {
+  lval* val = lval_alloc();
+  val->type = LVAL_SYM;
+  val->sym = data;
+
+  val->cache = malloc(sizeof(lcache));
+  val->cache->refs = 1;
+  val->cache->local = 0;
+  val->cache->epoch = -1;
+  val->cache->val = NULL;
+
+  return val;
+}
+
+lval* lval_num(long num) {
+  lval* val = lval_alloc();
+  val->type = LVAL_NUM;
+  val->num = num;
+  return val;
+}
+
+lval* lval_err(char* fmt, ...) {
+  lval* val = lval_alloc();
+  val->type = LVAL_ERR;
+
+  va_list args;
+  va_start(args, fmt);
+
+  val->err = malloc(512);
+  vsnprintf(val->err, 511, fmt, args);
+  val->err = realloc(val->err, strlen(val->err) + 1);
+
+  va_end(args);
+  LTRACE(LTRACE_ERROR, 0, 0, val->err);
+
+  return val;
+}
+
+/**
+ * `recur` hands its `loop` an error whose message is this very array, which
+ * is never freed and tells it apart from every other error. the arguments
+ * wait in `RECUR`. anywhere but in tail position of a loop body the marker
+ * goes through `lrecur_escape`, which makes it an ordinary error.
+ */
+char RECUR_ERR[] = "Function 'recur' can only be used in tail position of loop.";
+
+_Thread_local lval* RECUR = NULL;
+
+int lval_is_recur(lval* val) {
+  return val->type == LVAL_ERR && val->err == RECUR_ERR;
+}
+
+lval* lrecur_escape(lval* val) {
+  if (!lval_is_recur(val)) {
+    return val;
+  }
+
+  val->err = malloc(sizeof(RECUR_ERR));
+  memcpy(val->err, RECUR_ERR, sizeof(RECUR_ERR));
+
+  if (RECUR) {
+    lval_del(RECUR);
+    RECUR = NULL;
+  }
+
+  return val;
+}
+
+lval* lval_str(char* str) {
+  return lval_str_of(lstr_new(str, strlen(str)));
+}
+
+lval* lval_str_of(char* data) {
+  lval* val = lval_alloc();
+  val->type = LVAL_STR;
+  val->str = data;
+
+  return val;
+}
+
+lval* lval_lambda(lval* formals, lval* body) {
+  lval* val = lval_alloc();
+
+  val->type = LVAL_FUN;
+  val->builtin = NULL;
+  val->special = NULL;
+  val->nullary = 0;
+  val->env = NULL;
+
+  val->fun = malloc(sizeof(lfunc));
+  val->fun->refs = 1;
+  val->fun->formals = formals;
+  val->fun->body = body;
+  val->fun->code = NULL;
+  val->fun->jit = jit_new();
+  val->fun->table = NULL;
+
+  return val;
+}
+
+void lfunc_release(lfunc* fun) {
+  if (LREF_DEC(fun->refs) == 0) {
+    lval_del(fun->formals);
+    lval_del(fun->body);
+    if (fun->code) {
+      lval_del(fun->code);
+    }
+    if (fun->jit) {
+      jit_del(fun->jit);
+    }
+    if (fun->table) {
+      lswitch_del(fun->table);
+    }
+    free(fun);
+  }
+}
+
+/**
+ * deletes everything but the cells of an expression, which `lval_del` takes
+ * care of.
+ */
+void lval_del_value(lval* val) {
+  switch (val->type) {
+    case LVAL_NUM: break;
+
+    case LVAL_STR:
+      lstr_release(val->str);
+      break;
+
+    case LVAL_ERR:
+      if (val->err != RECUR_ERR) {
+        free(val->err);
+      }
+      break;
+
+    case LVAL_SYM:
+      lstr_release(val->sym);
+
+      if (LREF_DEC(val->cache->refs) == 0) {
+        free(val->cache);
+      }
+
+      break;
+
+    case LVAL_FUN:
+      if (val->fun) {
+        lfunc_release(val->fun);
+      }
+
+      if (val->env) {
+        lenv_release(val->env);
+      }
+      break;
+
+    case LVAL_CHAN:
+      lchan_release(val->chan);
+      break;
+
+    case LVAL_SEQ:
+      lseq_release(val->seq);
+      break;
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      if (!val->shared) {
+        HEAP -= sizeof(lval*) * val->count;
+      }
+
+      free(val->cell);
+      break;
+  }
+
+  HEAP -= sizeof(lval);
+  free(val);
+}
+
+int lval_is_expr(lval* val) {
+  return val->type == LVAL_SEXPR || val->type == LVAL_QEXPR;
+}
+
+/**
+ * nested expressions are deleted from a stack of pending cells on the heap
+ * rather than by recursion, so even a list nested millions of levels deep
+ * can't overflow the C stack on its way out. the stack starts out in a small
+ * array of its own, and only spills to the heap for large or deep values.
+ * the elements of shared cells are only deleted along with their last
+ * reference.
+ */
+#define DEL_STACK_SIZE 64
+
+void lval_del(lval* val) {
+  if (!lval_is_expr(val)) {
+    lval_del_value(val);
+    return;
+  }
+
+  lval* local[DEL_STACK_SIZE];
+  lval** stack = local;
+  int cap = DEL_STACK_SIZE;
+  int count = 0;
+
+  stack[count++] = val;
+
+  while (count) {
+    val = stack[--count];
+
+    lcells* shared = lval_is_expr(val) ? val->shared : NULL;
+    lval** cell = val->cell;
+    int cells = lval_is_expr(val) ? val->count : 0;
+
+    if (shared) {
+      val->cell = NULL;
+      cells = lcells_release(shared) ? cells : 0;
+    }
+
+    if (cells) {
+      if (count + cells > cap) {
+        while (count + cells > cap) {
+          cap *= 2;
+        }
+
+        if (stack == local) {
+          stack = malloc(sizeof(lval*) * cap);
+          memcpy(stack, local, sizeof(lval*) * count);
+        } else {
+          stack = realloc(stack, sizeof(lval*) * cap);
+        }
+      }
+
+      memcpy(stack + count, cell, sizeof(lval*) * cells);
+      count += cells;
+    }
+
+    if (shared && cells) {
+      lcells_free(shared);
+    }
+
+    lval_del_value(val);
+  }
+
+  if (stack != local) {
+    free(stack);
+  }
+}
+
+/**
+ * copying, comparing and writing nested expressions walk them the same way,
+ * with a stack of the expressions they are in the middle of, each with the
+ * index of the next cell to visit, and `other`, the copy being filled in or
+ * the expression being compared against. like in `lval_del` the stack starts
+ * out in an array of its own and only moves to the heap for deep values.
+ */
+typedef struct {
+  lval* val;
+  lval* other;
+  int next;
+} lwalk_frame;
+
+typedef struct {
+  lwalk_frame local[DEL_STACK_SIZE];
+  lwalk_frame* frames;
+  int count;
+  int cap;
+} lwalk;
+
+void lwalk_init(lwalk* walk) {
+  walk->frames = walk->local;
+  walk->count = 0;
+  walk->cap = DEL_STACK_SIZE;
+}
+
+void lwalk_push(lwalk* walk, lval* val, lval* other) {
+  if (walk->count == walk->cap) {
+    walk->cap *= 2;
+
+    if (walk->frames == walk->local) {
+      walk->frames = malloc(sizeof(lwalk_frame) * walk->cap);
+      memcpy(walk->frames, walk->local, sizeof(lwalk_frame) * walk->count);
+    } else {
+      walk->frames = realloc(walk->frames, sizeof(lwalk_frame) * walk->cap);
+    }
+  }
+
+  lwalk_frame* frame = &walk->frames[walk->count++];
+  frame->val = val;
+  frame->other = other;
+  frame->next = 0;
+}
+
+void lwalk_free(lwalk* walk) {
+  if (walk->frames != walk->local) {
+    free(walk->frames);
+  }
+}
+
+lithp_ctx* lenv_ctx(lenv* env) {
+  return env->ctx;
+}
+
+/**
+ * an environment counts towards `HEAP` along with its arrays, at a value and
+ * a name for every binding there is room for, and the names themselves, so
+ * those are only ever allocated and freed through these.
+ */
+void lenv_grow(lenv* env, int cap) {
+  HEAP += (long) (sizeof(lval*) + sizeof(char*)) * (cap - env->cap);
+  env->cap = cap;
+  env->vals = realloc(env->vals, sizeof(lval*) * cap);
+  env->syms = realloc(env->syms, sizeof(char*) * cap);
+}
+
+char* lenv_name(char* sym) {
+  size_t size = strlen(sym) + 1;
+  HEAP += size;
+  return memcpy(malloc(size), sym, size);
+}
+
+void lenv_name_free(char* name) {
+  HEAP -= strlen(name) + 1;
+  free(name);
+}
+
+lenv* lenv_new(lithp_ctx* ctx) {
+  HEAP += sizeof(lenv);
+  lenv* env = malloc(sizeof(lenv));
+  env->refs = 1;
+  env->count = 0;
+  env->cap = 0;
+  env->borrowed = 0;
+  env->ctx = ctx;
+  env->par = NULL;
+  env->syms = NULL;
+  env->vals = NULL;
+  return env;
+}
+
+void lenv_del(lenv* env) {
+  for (int i = 0; i < env->count; i++) {
+    lenv_name_free(env->syms[i]);
+
+    if (i >= env->borrowed) {
+      lval_del(env->vals[i]);
+    }
+  }
+
+  HEAP -= sizeof(lenv) + (sizeof(lval*) + sizeof(char*)) * env->cap;
+  free(env->syms);
+  free(env->vals);
+  free(env);
+}
+
+void lenv_release(lenv* env) {
+  if (LREF_DEC(env->refs) == 0) {
+    lenv_del(env);
+  }
+}
+
+/**
+ * a frame can start out with values that are borrowed from the shared
+ * environment of a partially applied function instead of copies of them. the
+ * first `borrowed` values belong to someone else, and if any of them is about
+ * to be overwritten the frame takes copies of all of them first.
+ */
+void lenv_unshare(lenv* env) {
+  for (int i = 0; i < env->borrowed; i++) {
+    env->vals[i] = lval_copy(env->vals[i]);
+  }
+
+  env->borrowed = 0;
+}
+
+/**
+ * since the scope of a function is whatever environment it was called from, a
+ * global can be shadowed by any frame on the way up. to know when it is safe
+ * to skip the walk up the environment chain we keep a set of every name that
+ * has ever been bound outside of the global environment. symbols with these
+ * names are never cached. adding a new name bumps the epoch of the context
+ * because caches filled before that point could have skipped over the new
+ * binding.
+ */
+
+unsigned long lsym_hash(char* sym) {
+  unsigned long hash = 5381;
+
+  while (*sym) {
+    hash = hash * 33 + (unsigned char) *sym++;
+  }
+
+  return hash;
+}
+
+int lenv_is_local(lithp_ctx* ctx, char* sym) {
+  lname* name = __atomic_load_n(&ctx->locals[lsym_hash(sym) % LOCALS_SIZE],
+    __ATOMIC_ACQUIRE);
+
+  for (; name; name = name->next) {
+    if (strcmp(name->sym, sym) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+void lenv_mark_local(lithp_ctx* ctx, lval* label) {
+  if (__atomic_load_n(&label->cache->local, __ATOMIC_RELAXED)) {
+    return;
+  }
+
+  __atomic_store_n(&label->cache->local, 1, __ATOMIC_RELAXED);
+
+  if (lenv_is_local(ctx, label->sym)) {
+    return;
+  }
+
+  // readers never take the lock, so a new name is only published once it is
+  // fully linked in
+  pthread_mutex_lock(&ctx->locals_lock);
+
+  if (!lenv_is_local(ctx, label->sym)) {
+    lname* name = malloc(sizeof(lname));
+    unsigned long slot = lsym_hash(label->sym) % LOCALS_SIZE;
+
+    name->sym = malloc(strlen(label->sym) + 1);
+    strcpy(name->sym, label->sym);
+    name->next = ctx->locals[slot];
+    __atomic_store_n(&ctx->locals[slot], name, __ATOMIC_RELEASE);
+
+    LREF_INC(ctx->epoch);
+  }
+
+  pthread_mutex_unlock(&ctx->locals_lock);
+}
+
+/**
+ * finds the value bound to `label` without copying it. the value still belongs
+ * to the environment, so it is only good until the next definition. when the
+ * symbol resolves to a global that can't be shadowed we remember it in the
+ * symbol's inline cache, and the next lookup through the same call site costs
+ * a single compare. caches can be filled from several threads at once while
+ * the global environment is frozen, so the value is always published before
+ * the epoch that makes it valid.
+ */
+lval* lenv_lookup(lenv* env, lval* label) {
+  lithp_ctx* ctx = env->ctx;
+  lcache* cache = label->cache;
+  long epoch = __atomic_load_n(&ctx->epoch, __ATOMIC_RELAXED);
+
+  if (__atomic_load_n(&cache->epoch, __ATOMIC_ACQUIRE) == epoch) {
+    return __atomic_load_n(&cache->val, __ATOMIC_RELAXED);
+  }
+
+  for (; env; env = env->par) {
+    for (int i = 0; i < env->count; i++) {
+      if (strcmp(env->syms[i], label->sym) == 0) {
+        if (!env->par && !lenv_is_local(ctx, label->sym)) {
+          __atomic_store_n(&cache->val, env->vals[i], __ATOMIC_RELAXED);
+          __atomic_store_n(&cache->epoch, epoch, __ATOMIC_RELEASE);
+        }
+
+        return env->vals[i];
+      }
+    }
+  }
+
+  if (ldefer_force(ctx, label->sym)) {
+    return lenv_lookup(ctx->env, label);
+  }
+
+  return NULL;
+}
+
+/**
+ * to get a value from the environment we look it up and return a copy of the
+ * stored value. if no match is found we should return an error.
+ */
+lval* lenv_get(lenv* env, lval* label) {
+  lval* val = lenv_lookup(env, label);
+
+  if (val) {
+    return lval_copy(val);
+  } else {
+    return lval_err("Unbound symbol '%s'!", label->sym);
+  }
+}
+
+/**
+ * because we have a new `lval` type that has it own environment we need a
+ * function for copying environments, to use for when we copy `lval` structs.
+ */
+lenv* lenv_copy(lenv* env) {
+  int count = env->count;
+  lenv* copy = lenv_new(env->ctx);
+
+  copy->count = count;
+  copy->par = env->par;
+  lenv_grow(copy, count);
+
+  for (int i = 0; i < count; i++) {
+    copy->vals[i] = lval_copy(env->vals[i]);
+    copy->syms[i] = lenv_name(env->syms[i]);
+  }
+
+  return copy;
+}
+
+/**
+ * appends a new binding without looking for an existing one, taking ownership
+ * of `value`. this is what function calls use to fill in a fresh frame, where
+ * we already know the formals aren't bound yet. there is room for at least
+ * `cap` bindings before the arrays need to grow.
+ */
+void lenv_bind(lenv* env, lval* label, lval* value) {
+  if (env->count == env->cap) {
+    lenv_grow(env, env->cap ? env->cap * 2 : 4);
+  }
+
+  if (env->par) {
+    lenv_mark_local(env->ctx, label);
+  }
+
+  env->vals[env->count] = value;
+  env->syms[env->count] = lenv_name(label->sym);
+  env->count++;
+}
+
+/**
+ * the function for putting new variables into the environment is a little bit
+ * more complex. first we want to check if a variable with the same name
+ * already exists. if this is the case we should replace its value with the new
+ * one. to do this we loop over all the existing variables in the environment
+ * and check their name. if a match is found we delete the value stored at that
+ * location, and store there a copy of the input value. if no existing value is
+ * found with that name, we need to allocate some more space to out it in. for
+ * this we can use `realloc`, and store a copy of the `lval` and its name at
+ * the newly allocated locations. any change to the global environment
+ * invalidates every inline cache.
+ */
+void lenv_put(lenv* env, lval* label, lval* value) {
+  if (env->par) {
+    lenv_mark_local(env->ctx, label);
+  } else {
+    LREF_INC(env->ctx->epoch);
+  }
+
+  for (int i = 0; i < env->count; i++) {
+    if (strcmp(env->syms[i], label->sym) == 0) {
+      if (i < env->borrowed) {
+        lenv_unshare(env);
+      }
+
+      lval_del(env->vals[i]);
+      env->vals[i] = lval_copy(value);
+      env->syms[i] = realloc(env->syms[i], strlen(label->sym) + 1);
+      strcpy(env->syms[i], label->sym);
+      return;
+    }
+  }
+
+  lenv_bind(env, label, lval_copy(value));
+}
+
+/**
+ * having parent environments also changes our concept of defining a variable.
+ * there are two ways we could define a variable now. either we could define it
+ * in local, innermost environment., or we could define it in the global,
+ * outermost environment. we will add functions to do both. we'll leave the
+ * `lenv_put` method the same. it can be used for definition in the local
+ * environment. but we'll add a new function `lenv_def` for definition in the
+ * global environment. this works by simply following the parent chain up
+ * before using lval_put to define locally.
+ */
+void lenv_def(lenv* env, lval* label, lval* value) {
+  while (env->par) env = env->par;
+  lenv_put(env, label, value);
+}
+
+lval* lval_read_num(mpc_ast_t* t) {
+  errno = 0;
+  long x = strtol(t->contents, NULL, 10);
+  return errno != ERANGE ?
+    lval_num(x) : lval_err("bad number");
+}
+
+lval* lval_read_str(lithp_ctx* ctx, mpc_ast_t* t) {
+  t->contents[strlen(t->contents) - 1] = '\0';
+
+  char* unescaped = malloc(strlen(t->contents + 1) + 1);
+  strcpy(unescaped, t->contents + 1);
+
+  unescaped = mpcf_unescape(unescaped);
+  lval* str = lval_str_of(lstr_intern(ctx, unescaped, strlen(unescaped)));
+
+  free(unescaped);
+  return str;
+}
+
+/**
+ * gives the unshared cells of `val` room for exactly `count` elements. the
+ * cells of every list count towards `HEAP`, so the number of them only ever
+ * changes through here.
+ */
+void lval_resize(lval* val, int count) {
+  HEAP += (long) sizeof(lval*) * (count - val->count);
+  val->cell = realloc(val->cell, sizeof(lval*) * count);
+  val->count = count;
+}
+
+lval* lval_add(lval* val, lval* child) {
+  FUEL--;
+  lval_unshare(val);
+  lval_resize(val, val->count + 1);
+  val->cell[val->count - 1] = child;
+  return val;
+}
+
+lval* lval_join(lval* holder, lval* drained) {
+  while (drained->count) {
+    holder = lval_add(holder, lval_pop(drained, 0));
+  }
+
+  lval_del(drained);
+
+  return holder;
+}
+
+lval* lval_read(lithp_ctx* ctx, mpc_ast_t* t) {
+  if (strstr(t->tag, "number"))
+    return lval_read_num(t);
+  if (strstr(t->tag, "symbol"))
+    return lval_sym_of(lstr_intern(ctx, t->contents, strlen(t->contents)));
+  if (strstr(t->tag, "string"))
+    return lval_read_str(ctx, t);
+
+  lval* val = NULL;
+
+  if (strcmp(t->tag, ">") == 0)
+    val = lval_sexpr();
+  if (strstr(t->tag, "sexpr"))
+    val = lval_sexpr();
+  if (strstr(t->tag, "qexpr"))
+    val = lval_qexpr();
+
+  for (int i = 0; i < t->children_num; i++) {
+    if (strcmp(t->children[i]->contents, "(") == 0)
+      continue;
+    if (strcmp(t->children[i]->contents, ")") == 0)
+      continue;
+    if (strcmp(t->children[i]->contents, "{") == 0)
+      continue;
+    if (strcmp(t->children[i]->contents, "}") == 0)
+      continue;
+    if (strcmp(t->children[i]->tag, "regex") == 0)
+      continue;
+    if (strstr(t->children[i]->tag, "comment"))
+      continue;
+
+    val = lval_add(val, lval_read(ctx, t->children[i]));
+  }
+
+  return lval_intern(ctx, val);
+}
+
+char* ltype_name(lval_type type) {
+  switch (type) {
+    case LVAL_FUN: return "Function";
+    case LVAL_SYM: return "Symbol";
+    case LVAL_SEXPR: return "S-Expression";
+    case LVAL_QEXPR: return "Q-Expression";
+    case LVAL_NUM: return "Number";
+    case LVAL_STR: return "String";
+    case LVAL_ERR: return "Error";
+    case LVAL_CHAN: return "Channel";
+    case LVAL_SEQ: return "Sequence";
+    default: return "Unknown type";
+  }
+}
+
+/**
+ * values are printed by rendering them into a growable buffer first, so that
+ * printing a large list takes a handful of writes rather than one call into
+ * stdio per element. `print` renders into the output buffer of its context,
+ * which is written out once it grows past `OUTPUT_FLUSH_SIZE`, and flushed
+ * after every file or REPL line, or by `(flush)`.
+ */
+#define OUTPUT_FLUSH_SIZE (64 * 1024)
+
+void lbuf_reserve(lbuf* buf, size_t extra) {
+  if (buf->len + extra <= buf->cap) {
+    return;
+  }
+
+  size_t cap = buf->cap ? buf->cap : 64;
+
+  while (cap < buf->len + extra) {
+    cap *= 2;
+  }
+
+  buf->data = realloc(buf->data, cap);
+  buf->cap = cap;
+}
+
+void lbuf_write(lbuf* buf, const char* str, size_t len) {
+  lbuf_reserve(buf, len);
+  memcpy(buf->data + buf->len, str, len);
+  buf->len += len;
+}
+
+void lbuf_puts(lbuf* buf, const char* str) {
+  lbuf_write(buf, str, strlen(str));
+}
+
+void lbuf_putc(lbuf* buf, char c) {
+  lbuf_reserve(buf, 1);
+  buf->data[buf->len++] = c;
+}
+
+void lbuf_num(lbuf* buf, long num) {
+  char digits[24];
+  int i = sizeof(digits);
+  unsigned long n = num < 0 ? -(unsigned long) num : (unsigned long) num;
+
+  do {
+    digits[--i] = '0' + n % 10;
+    n /= 10;
+  } while (n);
+
+  if (num < 0) {
+    digits[--i] = '-';
+  }
+
+  lbuf_write(buf, digits + i, sizeof(digits) - i);
+}
+
+/**
+ * escapes the same characters as `mpcf_escape`, straight into the buffer.
+ */
+void lbuf_str(lbuf* buf, char* str) {
+  lbuf_putc(buf, '"');
+
+  for (char* c = str; *c; c++) {
+    char* escape = NULL;
+
+    switch (*c) {
+      case '\a': escape = "\\a"; break;
+      case '\b': escape = "\\b"; break;
+      case '\f': escape = "\\f"; break;
+      case '\n': escape = "\\n"; break;
+      case '\r': escape = "\\r"; break;
+      case '\t': escape = "\\t"; break;
+      case '\v': escape = "\\v"; break;
+      case '\\': escape = "\\\\"; break;
+      case '\'': escape = "\\'"; break;
+      case '"': escape = "\\\""; break;
+    }
+
+    if (escape) {
+      lbuf_write(buf, escape, 2);
+    } else {
+      lbuf_putc(buf, *c);
+    }
+  }
+
+  lbuf_putc(buf, '"');
+}
+
+void lval_write(lbuf* buf, lval* val);
+
+void lval_write_open(lbuf* buf, lval* val) {
+  lbuf_putc(buf, val->type == LVAL_SEXPR ? '(' : '{');
+}
+
+void lval_write_close(lbuf* buf, lval* val) {
+  lbuf_putc(buf, val->type == LVAL_SEXPR ? ')' : '}');
+}
+
+/**
+ * writes nested expressions with an `lwalk`, so there is no limit to how deep
+ * they can be.
+ */
+void lval_write_expr(lbuf* buf, lval* val) {
+  lwalk walk;
+  lwalk_init(&walk);
+
+  lval_write_open(buf, val);
+  lwalk_push(&walk, val, NULL);
+
+  while (walk.count) {
+    lwalk_frame* frame = &walk.frames[walk.count - 1];
+
+    if (frame->next == frame->val->count) {
+      lval_write_close(buf, frame->val);
+      walk.count--;
+      continue;
+    }
+
+    if (frame->next) {
+      lbuf_putc(buf, ' ');
+    }
+
+    lval* child = frame->val->cell[frame->next++];
+
+    if (lval_is_expr(child)) {
+      lval_write_open(buf, child);
+      lwalk_push(&walk, child, NULL);
+    } else {
+      lval_write(buf, child);
+    }
+  }
+
+  lwalk_free(&walk);
+}
+
+/**
+ * partially applied functions only print the formals that are still unbound.
+ */
+void lval_write_formals(lbuf* buf, lval* func) {
+  lval* formals = func->fun->formals;
+  int bound = func->env ? func->env->count : 0;
+
+  lbuf_putc(buf, '{');
+
+  for (int i = bound; i < formals->count; i++) {
+    lval_write(buf, formals->cell[i]);
+
+    if (i != (formals->count - 1)) {
+      lbuf_putc(buf, ' ');
+    }
+  }
+
+  lbuf_putc(buf, '}');
+}
+
+void lval_write(lbuf* buf, lval* val) {
+  switch (val->type) {
+    case LVAL_FUN:
+      if (val->builtin) {
+        lbuf_puts(buf, "<builtin>");
+      } else {
+        lbuf_puts(buf, "(\\ ");
+        lval_write_formals(buf, val);
+        lbuf_putc(buf, ' ');
+        lval_write(buf, val->fun->body);
+        lbuf_putc(buf, ')');
+      }
+      break;
+
+    case LVAL_SYM:
+      lbuf_puts(buf, val->sym);
+      break;
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      lval_write_expr(buf, val);
+      break;
+
+    case LVAL_STR:
+      lbuf_str(buf, val->str);
+      break;
+
+    case LVAL_NUM:
+      lbuf_num(buf, val->num);
+      break;
+
+    case LVAL_ERR:
+      lbuf_puts(buf, "Error: ");
+      lbuf_puts(buf, val->err);
+      break;
+
+    case LVAL_CHAN:
+      lbuf_puts(buf, "<channel>");
+      break;
+
+    case LVAL_SEQ:
+      lbuf_puts(buf, "<sequence>");
+      break;
+  }
+}
+
+/**
+ * prints straight to stdout, without going through the output buffer of any
+ * context.
+ */
+void lval_print(lval* val) {
+  lbuf buf = { NULL, 0, 0 };
+
+  lval_write(&buf, val);
+  fwrite(buf.data, 1, buf.len, stdout);
+  free(buf.data);
+}
+
+void lval_println(lval* val) {
+  lval_print(val);
+  putchar('\n');
+}
+
+/**
+ * has to be called with `out_lock` held.
+ */
+void lout_write(lithp_ctx* ctx) {
+  if (ctx->out.len) {
+    fwrite(ctx->out.data, 1, ctx->out.len, stdout);
+    ctx->out.len = 0;
+  }
+}
+
+void lithp_print(lithp_ctx* ctx, lval* val) {
+  pthread_mutex_lock(&ctx->out_lock);
+
+  lval_write(&ctx->out, val);
+  lbuf_putc(&ctx->out, '\n');
+
+  if (ctx->out.len >= OUTPUT_FLUSH_SIZE) {
+    lout_write(ctx);
+  }
+
+  pthread_mutex_unlock(&ctx->out_lock);
+}
+
+void lithp_flush(lithp_ctx* ctx) {
+  pthread_mutex_lock(&ctx->out_lock);
+
+  lout_write(ctx);
+  fflush(stdout);
+
+  pthread_mutex_unlock(&ctx->out_lock);
+}
+
+/**
+ * copies everything but the cells of an expression, which `lval_copy` fills
+ * in.
+ */
+lval* lval_copy_value(lval* source) {
+  lval* target = lval_alloc();
+  target->type = source->type;
+
+  switch (source->type) {
+    case LVAL_FUN:
+      target->nullary = source->nullary;
+
+      target->builtin = source->builtin;
+      target->special = source->special;
+      target->fun = source->fun;
+      target->env = source->env;
+
+      if (target->env) {
+        LREF_INC(target->env->refs);
+      }
+
+      if (target->fun) {
+        LREF_INC(target->fun->refs);
+      }
+      break;
+
+    case LVAL_STR:
+      target->str = lstr_share(source->str);
+      break;
+
+    case LVAL_NUM:
+      target->num = source->num;
+      break;
+
+    case LVAL_ERR:
+      target->err = malloc(strlen(source->err) + 1);
+      strcpy(target->err, source->err);
+      break;
+
+    case LVAL_SYM:
+      target->sym = lstr_share(source->sym);
+      target->cache = source->cache;
+      LREF_INC(target->cache->refs);
+      break;
+
+    case LVAL_CHAN:
+      target->chan = source->chan;
+      LREF_INC(target->chan->refs);
+      break;
+
+    case LVAL_SEQ:
+      target->seq = source->seq;
+      target->offset = source->offset;
+      LREF_INC(target->seq->refs);
+      break;
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      target->count = source->count;
+      target->shared = source->shared;
+
+      if (source->shared) {
+        LREF_INC(source->shared->refs);
+        target->cell = source->cell;
+      } else {
+        HEAP += sizeof(lval*) * target->count;
+        target->cell = malloc(sizeof(lval*) * target->count);
+      }
+      break;
+  }
+
+  return target;
+}
+
+/**
+ * useful when we put things into, and take things out of, the
+ * environment. for number and function s we can just copy the relevant
+ * fields directly. for strings we need to copy using `malloc` and
+ * `strcpy`. to copy lists we need to allocate the correct amount of
+ * space and then copy each element individually, which walks them with an
+ * `lwalk` rather than recursing.
+ */
+lval* lval_copy(lval* source) {
+  lval* target = lval_copy_value(source);
+
+  if (!lval_is_expr(source) || !source->count || source->shared) {
+    return target;
+  }
+
+  lwalk walk;
+  lwalk_init(&walk);
+  lwalk_push(&walk, source, target);
+
+  while (walk.count) {
+    lwalk_frame* frame = &walk.frames[walk.count - 1];
+
+    if (frame->next == frame->val->count) {
+      walk.count--;
+      continue;
+    }
+
+    int i = frame->next++;
+    lval* child = frame->val->cell[i];
+    lval* copy = lval_copy_value(child);
+    frame->other->cell[i] = copy;
+
+    if (lval_is_expr(child) && child->count && !child->shared) {
+      lwalk_push(&walk, child, copy);
+    }
+  }
+
+  lwalk_free(&walk);
+
+  return target;
+}
+
+/**
+ * extracts a single element from an S-Expression at the index i and shifts the
+ * rest of the list backward so that it no longer contains that `lval*`. It
+ * then returns the extracted value. Notice that it doesn't delete the input
+ * list. It is like taking an element from a list and popping it out, leaving
+ * what remains. This means that both the element popped and the old list need
+ * to be deleted at some ppoint with `lval_del`.
+ */
+lval* lval_pop(lval* val, int i) {
+  lval_unshare(val);
+  lval* child = val->cell[i];
+
+  memmove(&val->cell[i], &val->cell[i + 1],
+    sizeof(lval*) * (val->count - i - 1));
+
+  lval_resize(val, val->count - 1);
+
+  return child;
+}
+
+/**
+ * similar to `lval_pop` but it deletes the list it has extracted the element
+ * from. This is like taking an element from the list and deleting the rest. It
+ * is a slight variation on `lval_pop` but it makes our code easier to read in
+ * some places. Unlike `lval_pop`, only the expression you take from the list
+ * needs to be deleted by `lval_del`.
+ */
+lval* lval_take(lval* val, int i) {
+  lval* child = val->shared ? lval_copy(val->cell[i]) : lval_pop(val, i);
+  lval_del(val);
+  return child;
+}
+
+int lval_eq(lval*, lval*);
+
+/**
+ * compares everything but the cells of an expression, which `lval_eq` walks
+ * with an `lwalk` rather than recursing.
+ */
+int lval_eq_value(lval* left, lval* right) {
+  if (left == right) {
+    return 1;
+  }
+
+  if (left->type != right->type) {
+    return 0;
+  } else {
+    switch (left->type) {
+      case LVAL_FUN:
+        if (left->builtin || right->builtin) {
+          return left->builtin == right->builtin;
+        } else {
+          return left->fun == right->fun
+            || (lval_eq(left->fun->formals, right->fun->formals)
+              && lval_eq(left->fun->body, right->fun->body));
+        }
+
+        break;
+
+      case LVAL_SYM:
+        return lstr_eq(left->sym, right->sym);
+        break;
+
+      case LVAL_SEXPR:
+      case LVAL_QEXPR:
+        if (left->shared && right->shared && left->shared->tab &&
+          left->shared->tab == right->shared->tab) {
+          return left->shared == right->shared;
+        }
+
+        return left->count == right->count;
+        break;
+
+      case LVAL_STR:
+        return lstr_eq(left->str, right->str);
+        break;
+
+      case LVAL_NUM:
+        return left->num == right->num;
+        break;
+
+      case LVAL_ERR:
+        return strcmp(left->err, right->err) == 0;
+        break;
+
+      case LVAL_CHAN:
+        return left->chan == right->chan;
+        break;
+
+      case LVAL_SEQ:
+        return left->seq == right->seq && left->offset == right->offset;
+        break;
+    }
+  }
+
+  return 0;
+}
+
+int lval_eq(lval* left, lval* right) {
+  if (left == right) {
+    return 1;
+  }
+
+  int eq = lval_eq_value(left, right);
+
+  if (
+    !eq || !lval_is_expr(left) || !left->count ||
+    (left->shared && left->shared == right->shared)
+  ) {
+    return eq;
+  }
+
+  lwalk walk;
+  lwalk_init(&walk);
+  lwalk_push(&walk, left, right);
+
+  while (walk.count && eq) {
+    lwalk_frame* frame = &walk.frames[walk.count - 1];
+
+    if (frame->next == frame->val->count) {
+      walk.count--;
+      continue;
+    }
+
+    int i = frame->next++;
+    lval* a = frame->val->cell[i];
+    lval* b = frame->other->cell[i];
+
+    if (a == b) {
+      continue;
+    }
+
+    eq = lval_eq_value(a, b);
+
+    if (
+      eq && lval_is_expr(a) && a->count &&
+      !(a->shared && a->shared == b->shared)
+    ) {
+      lwalk_push(&walk, a, b);
+    }
+  }
+
+  lwalk_free(&walk);
+
+  return eq;
+}
+
+unsigned long lval_hash(lval*);
+
+/**
+ * gives `val` cells of its own that can be changed in place, either by taking
+ * over the shared ones if it held the last reference to them, or by copying
+ * their elements.
+ */
+void lval_unshare(lval* val) {
+  lcells* shared = val->shared;
+
+  if (!shared) {
+    return;
+  }
+
+  int last = 1;
+
+  val->shared = NULL;
+  HEAP += sizeof(lval*) * val->count;
+  val->cell = malloc(sizeof(lval*) * val->count);
+
+  if (__atomic_compare_exchange_n(&shared->refs, &last, 0, 0,
+      __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+    lcells_unlink(shared);
+    memcpy(val->cell, shared->cell, sizeof(lval*) * val->count);
+    lcells_free(shared);
+    return;
+  }
+
+  for (int i = 0; i < val->count; i++) {
+    val->cell[i] = lval_copy(shared->cell[i]);
+  }
+
+  if (lcells_release(shared)) {
+    for (int i = 0; i < shared->count; i++) {
+      lval_del(shared->cell[i]);
+    }
+
+    lcells_free(shared);
+  }
+}
+
+/**
+ * only lists of plain data are interned, since `==` doesn't look at
+ * everything that tells two functions apart, like the arguments a partially
+ * applied one already has, and channels and sequences change as they're used.
+ */
+int lval_is_data(lval* val) {
+  lwalk walk;
+  lwalk_init(&walk);
+  lwalk_push(&walk, val, NULL);
+
+  int data = 1;
+
+  while (walk.count && data) {
+    lwalk_frame* frame = &walk.frames[walk.count - 1];
+
+    if (frame->next == frame->val->count) {
+      walk.count--;
+      continue;
+    }
+
+    lval* child = frame->val->cell[frame->next++];
+
+    if (lval_is_expr(child)) {
+      if (!child->shared) {
+        lwalk_push(&walk, child, NULL);
+      }
+    } else {
+      data = child->type == LVAL_NUM || child->type == LVAL_STR ||
+        child->type == LVAL_SYM;
+    }
+  }
+
+  lwalk_free(&walk);
+
+  return data;
+}
+
+/**
+ * returns `val`, with its cells shared with every other equal Q-Expression if
+ * hash-consing is on. the elements of `val` are compared as they are, so
+ * lists of interned lists are cheap to look up, which is why lists are
+ * interned from the inside out.
+ */
+lval* lval_intern(lithp_ctx* ctx, lval* val) {
+  if (
+    !ctx->hashcons || val->type != LVAL_QEXPR || !val->count ||
+    val->shared || !lval_is_data(val)
+  ) {
+    return val;
+  }
+
+  lcellstab* tab = &ctx->lists;
+  unsigned long hash = lval_hash(val);
+  size_t size = sizeof(lcells) + sizeof(lval*) * val->count;
+
+  pthread_mutex_lock(&tab->lock);
+  tab->lookups++;
+
+  if (tab->count >= tab->cap) {
+    lcellstab_grow(tab);
+  }
+
+  lcells** bucket = &tab->buckets[hash & (tab->cap - 1)];
+  lcells* shared = NULL;
+
+  for (lcells* cells = *bucket; cells && !shared; cells = cells->next) {
+    if (cells->hash != hash || cells->count != val->count) {
+      continue;
+    }
+
+    int eq = 1;
+
+    for (int i = 0; i < val->count && eq; i++) {
+      eq = lval_eq(cells->cell[i], val->cell[i]);
+    }
+
+    if (eq && lref_acquire(&cells->refs)) {
+      shared = cells;
+    }
+  }
+
+  int hit = shared != NULL;
+
+  if (hit) {
+    tab->hits++;
+    tab->saved += size + sizeof(lval) * val->count;
+  } else {
+    shared = malloc(size);
+    HEAP += size;
+    shared->refs = 1;
+    shared->count = val->count;
+    shared->hash = hash;
+    shared->tab = tab;
+    shared->next = *bucket;
+    memcpy(shared->cell, val->cell, sizeof(lval*) * val->count);
+    *bucket = shared;
+    tab->count++;
+  }
+
+  pthread_mutex_unlock(&tab->lock);
+
+  for (int i = 0; i < val->count && hit; i++) {
+    lval_del(val->cell[i]);
+  }
+
+  HEAP -= sizeof(lval*) * val->count;
+  free(val->cell);
+  val->cell = shared->cell;
+  val->shared = shared;
+
+  return val;
+}
+
+lval* builtin_arity(lenv* env, lval* func) {
+  UNUSED(env);
+
+  LASSERT_ARG_COUNT(func, "arity", 1);
+  LASSERT_ARG_TYPE_AT(func, "arity", LVAL_FUN, 0);
+
+  int count;
+
+  if (func->cell[0]->builtin) {
+    count = -1;
+  } else {
+    lval* fn = func->cell[0];
+    count = fn->fun->formals->count - (fn->env ? fn->env->count : 0);
+  }
+
+  lval_del(func);
+
+  return lval_num(count);
+}
+
+/**
+ * prints an expression of a file that ended in an error, and dumps the trace
+ * if there is somewhere to dump it to.
+ */
+void lerror_report(lithp_ctx* ctx, lval* err) {
+  lithp_print(ctx, err);
+  ctx->errors++;
+
+  if (ctx->trace && ctx->trace->path) {
+    ltrace_write(ctx->trace, ctx->trace->path);
+  }
+}
+
+/**
+ * with lazy loading turned on, the top-level forms of a file that only
+ * define a single global, and can't have any side effects while doing so,
+ * are put aside instead of evaluated. those are `(fun {name ...} {...})`, and
+ * `(def {name} value)` where the value is a literal or a lambda. the first
+ * lookup of that name which would otherwise fail evaluates the form, which
+ * in turn resolves whatever it depends on the same way, so a script only
+ * ever pays for the parts of a library it uses. every other form runs right
+ * away, in order. a form is kept eager if its name is already bound, or
+ * defined more than once in the same file, so the order of redefinitions
+ * stays the same. a later deferred definition of the same name replaces an
+ * earlier one. errors in a deferred form show up when it is first used.
+ * threads can't define globals, so every deferred form is evaluated before a
+ * parallel job starts.
+ */
+char* ldefer_name(lval* form) {
+  if (
+    form->type != LVAL_SEXPR || form->count != 3 ||
+    form->cell[0]->type != LVAL_SYM || form->cell[1]->type != LVAL_QEXPR ||
+    form->cell[1]->count == 0 || form->cell[1]->cell[0]->type != LVAL_SYM
+  ) {
+    return NULL;
+  }
+
+  char* head = form->cell[0]->sym;
+  lval* value = form->cell[2];
+
+  if (strcmp(head, "fun") == 0) {
+    return value->type == LVAL_QEXPR ? form->cell[1]->cell[0]->sym : NULL;
+  }
+
+  if (strcmp(head, "def") != 0 || form->cell[1]->count != 1) {
+    return NULL;
+  }
+
+  int literal = value->type == LVAL_NUM || value->type == LVAL_STR ||
+    value->type == LVAL_QEXPR;
+  int lambda = value->type == LVAL_SEXPR && value->count == 3 &&
+    value->cell[0]->type == LVAL_SYM && strcmp(value->cell[0]->sym, "\\") == 0;
+
+  return literal || lambda ? form->cell[1]->cell[0]->sym : NULL;
+}
+
+/**
+ * returns whether each of the top-level `forms` is the only one in the file
+ * to define the name it defines, if any.
+ */
+int* ldefer_scan(lval* forms) {
+  lsymtab tab = { NULL, 0, NULL, 0 };
+  int* ids = malloc(sizeof(int) * (forms->count + 1));
+  int* counts = calloc(forms->count + 1, sizeof(int));
+
+  for (int i = 0; i < forms->count; i++) {
+    lval* form = forms->cell[i];
+    ids[i] = -1;
+
+    if (
+      form->type != LVAL_SEXPR || form->count < 2 ||
+      form->cell[0]->type != LVAL_SYM || form->cell[1]->type != LVAL_QEXPR
+    ) {
+      continue;
+    }
+
+    char* head = form->cell[0]->sym;
+    lval* names = form->cell[1];
+    int fun = strcmp(head, "fun") == 0;
+
+    if (!fun && strcmp(head, "def") != 0 && strcmp(head, "=") != 0) {
+      continue;
+    }
+
+    for (int j = 0; j < (fun ? 1 : names->count) && j < names->count; j++) {
+      if (names->cell[j]->type == LVAL_SYM) {
+        int id = lsymtab_intern(&tab, names->cell[j]->sym);
+        counts[id]++;
+
+        if (j == 0) {
+          ids[i] = id;
+        }
+      }
+    }
+  }
+
+  for (int i = 0; i < forms->count; i++) {
+    ids[i] = ids[i] >= 0 && counts[ids[i]] == 1;
+  }
+
+  free(counts);
+  free(tab.syms);
+  free(tab.slots);
+
+  return ids;
+}
+
+int lenv_bound(lenv* env, char* sym) {
+  for (int i = 0; i < env->count; i++) {
+    if (strcmp(env->syms[i], sym) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * puts `form` aside if it can be, taking it over, and returns whether it did.
+ */
+int ldefer(lenv* env, lval* form) {
+  lithp_ctx* ctx = env->ctx;
+  char* sym = ldefer_name(form);
+
+  if (!sym || lenv_bound(ctx->env, sym)) {
+    return 0;
+  }
+
+  unsigned long slot = lsym_hash(sym) % LOCALS_SIZE;
+  ldeferred* entry = ctx->deferred[slot];
+
+  while (entry && strcmp(entry->sym, sym) != 0) {
+    entry = entry->next;
+  }
+
+  if (entry) {
+    lval_del(entry->form);
+  } else {
+    entry = malloc(sizeof(ldeferred));
+    entry->sym = sym;
+    entry->next = ctx->deferred[slot];
+    ctx->deferred[slot] = entry;
+    ctx->deferred_count++;
+  }
+
+  entry->sym = sym;
+  entry->form = form;
+
+  return 1;
+}
+
+void ldefer_run(lithp_ctx* ctx, ldeferred* entry) {
+  lval* x = lval_eval(ctx->env, lval_optimize(ctx->env, entry->form));
+
+  if (x->type == LVAL_ERR) {
+    lerror_report(ctx, x);
+  }
+
+  lval_del(x);
+  free(entry);
+}
+
+/**
+ * evaluates the deferred definition of `sym`, if there is one, and returns
+ * whether there was.
+ */
+int ldefer_force(lithp_ctx* ctx, char* sym) {
+  if (!ctx->deferred_count || PARALLEL_DEPTH) {
+    return 0;
+  }
+
+  ldeferred** link = &ctx->deferred[lsym_hash(sym) % LOCALS_SIZE];
+
+  while (*link && strcmp((*link)->sym, sym) != 0) {
+    link = &(*link)->next;
+  }
+
+  ldeferred* entry = *link;
+
+  if (!entry) {
+    return 0;
+  }
+
+  // taken out first, so a form that refers to its own name can't loop
+  *link = entry->next;
+  ctx->deferred_count--;
+  ldefer_run(ctx, entry);
+
+  return 1;
+}
+
+void ldefer_force_all(lithp_ctx* ctx) {
+  for (int i = 0; i < LOCALS_SIZE; i++) {
+    // forcing a form can force others, so each one is taken out first
+    while (ctx->deferred[i]) {
+      ldeferred* entry = ctx->deferred[i];
+      ctx->deferred[i] = entry->next;
+      ctx->deferred_count--;
+      ldefer_run(ctx, entry);
+    }
+  }
+}
+
+/**
+ * evaluates every expression of a parsed file, or string, one after another.
+ * errors are printed, and counted, but don't stop the rest from running.
+ */
+lval* lenv_run_forms(lenv* env, lval* expr) {
+  int* once = env->ctx->lazy ? ldefer_scan(expr) : NULL;
+
+  for (int i = 0; expr->count; i++) {
+    // once the budget runs out, the rest of the file is left alone
+    if (BUDGET && BUDGET->exhausted) {
+      break;
+    }
+
+    lval* form = lval_pop(expr, 0);
+
+    if (once && once[i] && ldefer(env, form)) {
+      continue;
+    }
+
+    lval* x = lbudget_check(lval_eval(env, lval_optimize(env, form)));
+
+    if (x->type == LVAL_ERR) {
+      lerror_report(env->ctx, x);
+    }
+
+    lval_del(x);
+  }
+
+  lsched_drain(env->ctx);
+  lithp_flush(env->ctx);
+  lval_del(expr);
+  free(once);
+
+  return lval_sexpr();
+}
+
+lval* lenv_run(lenv* env, mpc_ast_t* ast) {
+  lval* expr = lval_read(env->ctx, ast);
+  mpc_ast_delete(ast);
+
+  return lenv_run_forms(env, expr);
+}
+
+/**
+ * returns the forms of a file, from the cache if there is one, or the error
+ * reading it ended in. doesn't evaluate anything, so this can run on any
+ * thread, see `lprefetch`.
+ */
+lval* lload_read(lithp_ctx* ctx, char* filename) {
+  lval* forms = ctx->cache ? lmodule_read(ctx->env, filename) : NULL;
+
+  if (forms) {
+    return forms;
+  }
+
+  mpc_result_t r;
+
+  if (mpc_parse_contents(filename, ctx->lithp, &r)) {
+    forms = lval_read(ctx, r.output);
+    mpc_ast_delete(r.output);
+
+    return forms;
+  }
+
+  char* err_msg = mpc_err_string(r.error);
+  mpc_err_delete(r.error);
+
+  lval* err = lval_err("Could not load file: %s", err_msg);
+  free(err_msg);
+
+  return err;
+}
+
+lval* builtin_load(lenv* env, lval* args) {
+  LASSERT_ARG_COUNT(args, "load", 1);
+  LASSERT_ARG_TYPE_AT(args, "load", LVAL_STR, 0);
+
+  char* filename = args->cell[0]->str;
+  lval* forms = lprefetch_take(env->ctx, filename);
+
+  if (!forms) {
+    forms = lload_read(env->ctx, filename);
+  }
+
+  lval_del(args);
+  return forms->type == LVAL_ERR ? forms : lenv_run_forms(env, forms);
+}
+
+lval* builtin_print(lenv* env, lval* args) {
+  lithp_ctx* ctx = env->ctx;
+  pthread_mutex_lock(&ctx->out_lock);
+
+  for (int i = 0; i < args->count; i++) {
+    lval_write(&ctx->out, args->cell[i]);
+    lbuf_putc(&ctx->out, ' ');
+  }
+
+  lbuf_putc(&ctx->out, '\n');
+
+  if (ctx->out.len >= OUTPUT_FLUSH_SIZE) {
+    lout_write(ctx);
+  }
+
+  pthread_mutex_unlock(&ctx->out_lock);
+  lval_del(args);
+  return lval_sexpr();
+}
+
+lval* builtin_flush(lenv* env, lval* args) {
+  LASSERT_ARG_COUNT(args, "flush", 0);
+
+  lithp_flush(env->ctx);
+  lval_del(args);
+
+  return lval_sexpr();
+}
+
+/**
+ * renders any value the way `print` would show it, into a single string.
+ */
+lval* builtin_to_string(lenv* env, lval* args) {
+  UNUSED(env);
+
+  LASSERT_ARG_COUNT(args, "to-string", 1);
+
+  lbuf buf;
+  lstr_buf(&buf);
+  lval_write(&buf, args->cell[0]);
+
+  lval* val = lval_alloc();
+  val->type = LVAL_STR;
+  val->str = lstr_adopt(&buf);
+
+  lval_del(args);
+  return val;
+}
+
+lval* builtin_error(lenv* env, lval* args) {
+  UNUSED(env);
+
+  LASSERT_ARG_COUNT(args, "error", 1);
+  LASSERT_ARG_TYPE_AT(args, "error", LVAL_STR, 0);
+
+  lval* err = lval_err(args->cell[0]->str);
+  lval_del(args);
+
+  return err;
+}
+
+lval* builtin_head(lenv* env, lval* args) {
+  LREALIZE(env, args);
+
+  LASSERT_ARG_COUNT(args, "head", 1);
+  LASSERT_ARG_TYPE_AT(args, "head", LVAL_QEXPR, 0);
+  LASSERT(args, args->cell[0]->count != 0,
+    "Function 'head' passed an empty Q-Expression.");
+
+  // get the first argument then pop all elements from it until we have just
+  // one and return that
+  lval* arg = lval_take(args, 0);
+
+  while (arg->count > 1) {
+    lval_del(lval_pop(arg, 1));
+  }
+
+  return lval_intern(env->ctx, arg);
+}
+
+lval* builtin_tail(lenv* env, lval* args) {
+  LREALIZE(env, args);
+
+  LASSERT_ARG_COUNT(args, "tail", 1);
+  LASSERT_ARG_TYPE_AT(args, "tail", LVAL_QEXPR, 0);
+  LASSERT(args, args->cell[0]->count != 0,
+    "Function 'tail' passed an empty Q-Expression.");
+
+  // take the first argument, delete the first child and return it
+  lval* arg = lval_take(args, 0);
+  lval_del(lval_pop(arg, 0));
+
+  return lval_intern(env->ctx, arg);
+}
+
+lval* builtin_list(lenv* env, lval* args) {
+  args->type = LVAL_QEXPR;
+  return lval_intern(env->ctx, args);
+}
+
+lval* builtin_eval(lenv* env, lval* args) {
+  LREALIZE(env, args);
+  LASSERT_ARG_COUNT(args, "eval", 1);
+  LASSERT_ARG_TYPE_AT(args, "eval", LVAL_QEXPR, 0);
+
+  lval* arg = lval_take(args, 0);
+  arg->type = LVAL_SEXPR;
+
+  return lval_eval(env, arg);
+}
+
+/**
+ * `(with-limits {steps mem ms} {expr})` evaluates `expr` the way `eval` does,
+ * within a budget of that many steps, bytes and milliseconds, zero meaning no
+ * limit, see `lbudget`.
+ */
+lval* builtin_with_limits(lenv* env, lval* args) {
+  LASSERT_ARG_COUNT(args, "with-limits", 2);
+  LASSERT_ARG_TYPE_AT(args, "with-limits", LVAL_QEXPR, 0);
+  LASSERT_ARG_TYPE_AT(args, "with-limits", LVAL_QEXPR, 1);
+
+  lval* limits = args->cell[0];
+
+  LASSERT(args, limits->count == 3,
+    "Function 'with-limits' expects {steps mem ms} but got %i limits.",
+    limits->count);
+
+  for (int i = 0; i < 3; i++) {
+    LASSERT(args,
+      limits->cell[i]->type == LVAL_NUM && limits->cell[i]->num >= 0,
+      "Function 'with-limits' expects limits to be Numbers of at least 0.");
+  }
+
+  lbudget budget;
+  lbudget_init(&budget,
+    limits->cell[0]->num, limits->cell[1]->num, limits->cell[2]->num);
+
+  lval* expr = lval_take(args, 1);
+  expr->type = LVAL_SEXPR;
+
+  lbudget_enter(&budget);
+  lval* result = lval_eval(env, expr);
+  lbudget_leave(&budget);
+
+  return lbudget_result(&budget, result);
+}
+
+lval* builtin_join(lenv* env, lval* args) {
+  LREALIZE(env, args);
+
+  for (int i = 0; i < args->count; i++) {
+    LASSERT_ARG_TYPE_AT(args, "join", LVAL_QEXPR, i);
+  }
+
+  lval* joined = lval_pop(args, 0);
+
+  while (args->count) {
+    joined = lval_join(joined, lval_pop(args, 0));
+  }
+
+  lval_del(args);
+
+  return lval_intern(env->ctx, joined);
+}
+
+lval* builtin_cons(lenv* env, lval* args) {
+  LREALIZE(env, args);
+
+  LASSERT_ARG_COUNT(args, "cons", 2);
+  LASSERT_ARG_TYPE_AT(args, "cons", LVAL_QEXPR, 1);
+
+  lval* list = lval_sexpr();
+  lval* head = lval_pop(args, 0);
+  lval* body = lval_pop(args, 0);
+
+  lval_add(list, head);
+  lval_join(list, body);
+  lval_del(args);
+
+  return list;
+}
+
+lval* builtin_len(lenv* env, lval* args) {
+  LREALIZE(env, args);
+
+  LASSERT_ARG_COUNT(args, "len", 1);
+  LASSERT_ARG_TYPE_AT(args, "len", LVAL_QEXPR, 0);
+
+  long len = args->cell[0]->count;
+  lval_del(args);
+
+  return lval_num(len);
+}
+
+/**
+ * `(sort list)` puts a list of Numbers, Strings or Symbols in ascending
+ * order, and `(sort-by f list)` any list in the order given by `f`, which is
+ * called with two elements and returns whether the first one goes before the
+ * second. both are stable. lists of numbers are sorted by an LSD radix sort
+ * of their bits, a byte at a time, which skips every byte the numbers all
+ * share, so small numbers only take a pass or two. everything else is merge
+ * sorted, moving the `cell` pointers around in place, with runs shorter than
+ * `SORT_RUN` sorted by insertion first.
+ */
+#define SORT_RUN 16
+#define SORT_RADIX_MIN 64
+
+typedef struct {
+  unsigned long key;
+  lval* val;
+} lsort_item;
+
+typedef struct {
+  lenv* env;
+  lval* func;
+  lval* err;
+} lsorter;
+
+int lstr_cmp(char* left, char* right) {
+  size_t l = lstr_of(left)->len;
+  size_t r = lstr_of(right)->len;
+  int cmp = memcmp(left, right, l < r ? l : r);
+
+  return cmp ? cmp : (l > r) - (l < r);
+}
+
+/**
+ * orders two values of the same type, which `sort` has already checked is
+ * one of the types it can sort.
+ */
+int lval_cmp(lval* left, lval* right) {
+  switch (left->type) {
+    case LVAL_NUM:
+      return (left->num > right->num) - (left->num < right->num);
+
+    case LVAL_STR:
+      return lstr_cmp(left->str, right->str);
+
+    default:
+      return lstr_cmp(left->sym, right->sym);
+  }
+}
+
+/**
+ * whether `left` goes before `right`. once the function of `sort-by` ends in
+ * an error, or returns anything but a number, every call after that returns
+ * zero straight away and the error is kept in `sorter`.
+ */
+int lsort_less(lsorter* sorter, lval* left, lval* right) {
+  if (!sorter->func) {
+    return lval_cmp(left, right) < 0;
+  }
+
+  if (sorter->err) {
+    return 0;
+  }
+
+  lval* args = lval_add(lval_add(lval_sexpr(), lval_copy(left)), lval_copy(right));
+  lval* result = lval_call(sorter->env, sorter->func, args);
+
+  if (result->type != LVAL_NUM) {
+    sorter->err = result->type == LVAL_ERR ? result : lval_err(
+      "Function 'sort-by' expects its function to return a %s but got (a/an) %s instead.",
+        ltype_name(LVAL_NUM), ltype_name(result->type));
+
+    if (sorter->err != result) {
+      lval_del(result);
+    }
+
+    return 0;
+  }
+
+  int less = result->num != 0;
+  lval_del(result);
+
+  return less;
+}
+
+void lsort_merge(lsorter* sorter, lval** cells, lval** tmp, int count) {
+  if (count <= SORT_RUN) {
+    for (int i = 1; i < count; i++) {
+      lval* val = cells[i];
+      int j = i;
+
+      while (j > 0 && lsort_less(sorter, val, cells[j - 1])) {
+        cells[j] = cells[j - 1];
+        j--;
+      }
+
+      cells[j] = val;
+    }
+
+    return;
+  }
+
+  int half = count / 2;
+
+  lsort_merge(sorter, cells, tmp, half);
+  lsort_merge(sorter, cells + half, tmp, count - half);
+
+  // both halves may already be in order with each other
+  if (!lsort_less(sorter, cells[half], cells[half - 1])) {
+    return;
+  }
+
+  memcpy(tmp, cells, sizeof(lval*) * half);
+
+  int left = 0;
+  int right = half;
+  int out = 0;
+
+  while (left < half && right < count) {
+    if (lsort_less(sorter, cells[right], tmp[left])) {
+      cells[out++] = cells[right++];
+    } else {
+      cells[out++] = tmp[left++];
+    }
+  }
+
+  while (left < half) {
+    cells[out++] = tmp[left++];
+  }
+}
+
+/**
+ * the sign bit of every key is flipped so negative numbers come first. the
+ * counts of every byte are taken in a single pass up front.
+ */
+void lsort_radix(lval** cells, int count) {
+  lsort_item* items = malloc(sizeof(lsort_item) * count * 2);
+  lsort_item* from = items;
+  lsort_item* to = items + count;
+  long (*counts)[256] = calloc(8, sizeof(long[256]));
+
+  for (int i = 0; i < count; i++) {
+    unsigned long key = (unsigned long) cells[i]->num ^ (1UL << 63);
+    from[i].key = key;
+    from[i].val = cells[i];
+
+    for (int byte = 0; byte < 8; byte++) {
+      counts[byte][(key >> (byte * 8)) & 0xff]++;
+    }
+  }
+
+  for (int byte = 0; byte < 8; byte++) {
+    int shift = byte * 8;
+    long* offsets = counts[byte];
+
+    if (offsets[(from[0].key >> shift) & 0xff] == count) {
+      continue;
+    }
+
+    long offset = 0;
+
+    for (int digit = 0; digit < 256; digit++) {
+      long n = offsets[digit];
+      offsets[digit] = offset;
+      offset += n;
+    }
+
+    for (int i = 0; i < count; i++) {
+      to[offsets[(from[i].key >> shift) & 0xff]++] = from[i];
+    }
+
+    lsort_item* swap = from;
+    from = to;
+    to = swap;
+  }
+
+  for (int i = 0; i < count; i++) {
+    cells[i] = from[i].val;
+  }
+
+  free(counts);
+  free(items);
+}
+
+/**
+ * sorts the cells of `list` in place, and returns it, or the error the
+ * function of `sorter` ended in.
+ */
+lval* lval_sort(lsorter* sorter, lval* list) {
+  if (list->count < 2) {
+    return list;
+  }
+
+  lval_unshare(list);
+
+  if (!sorter->func && list->cell[0]->type == LVAL_NUM &&
+    list->count >= SORT_RADIX_MIN) {
+    lsort_radix(list->cell, list->count);
+    return list;
+  }
+
+  lval** tmp = malloc(sizeof(lval*) * (list->count / 2));
+  lsort_merge(sorter, list->cell, tmp, list->count);
+  free(tmp);
+
+  if (sorter->err) {
+    lval_del(list);
+    return sorter->err;
+  }
+
+  return list;
+}
+
+lval* builtin_sort(lenv* env, lval* args) {
+  LREALIZE(env, args);
+  LASSERT_ARG_COUNT(args, "sort", 1);
+  LASSERT_ARG_TYPE_AT(args, "sort", LVAL_QEXPR, 0);
+
+  lval* list = args->cell[0];
+
+  if (list->count) {
+    lval_type type = list->cell[0]->type;
+
+    LASSERT(args, type == LVAL_NUM || type == LVAL_STR || type == LVAL_SYM,
+      "Function 'sort' expects a list of Numbers, Strings or Symbols but got (a/an) %s at index 0 instead.",
+        ltype_name(type));
+
+    for (int i = 1; i < list->count; i++) {
+      LASSERT(args, list->cell[i]->type == type,
+        "Function 'sort' expects every element to be a %s but got (a/an) %s at index %i instead.",
+          ltype_name(type), ltype_name(list->cell[i]->type), i);
+    }
+  }
+
+  lsorter sorter = { env, NULL, NULL };
+  return lval_sort(&sorter, lval_take(args, 0));
+}
+
+lval* builtin_sort_by(lenv* env, lval* args) {
+  LREALIZE(env, args);
+  LASSERT_ARG_COUNT(args, "sort-by", 2);
+  LASSERT_ARG_TYPE_AT(args, "sort-by", LVAL_FUN, 0);
+  LASSERT_ARG_TYPE_AT(args, "sort-by", LVAL_QEXPR, 1);
+
+  lsorter sorter = { env, lval_pop(args, 0), NULL };
+  lval* sorted = lval_sort(&sorter, lval_take(args, 0));
+
+  lval_del(sorter.func);
+  return sorted;
+}
+
+/**
+ * a hash of `val` that agrees with `lval_eq`, so lambdas are hashed by their
+ * formals and body rather than where they live. interned lists remember
+ * theirs.
+ */
+unsigned long lval_hash(lval* val) {
+  unsigned long hash = val->type;
+
+  if (val->type == LVAL_QEXPR && val->shared) {
+    return val->shared->hash;
+  }
+
+  switch (val->type) {
+    case LVAL_NUM:
+      return (unsigned long) val->num * 0x9e3779b97f4a7c15UL;
+
+    case LVAL_STR:
+      return lhash(val->str, lstr_of(val->str)->len);
+
+    case LVAL_SYM:
+      return ~lhash(val->sym, lstr_of(val->sym)->len);
+
+    case LVAL_ERR:
+      return lhash(val->err, strlen(val->err));
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      for (int i = 0; i < val->count; i++) {
+        hash = hash * 31 + lval_hash(val->cell[i]);
+      }
+
+      return hash;
+
+    case LVAL_FUN:
+      if (val->builtin) {
+        return (uintptr_t) val->builtin;
+      }
+
+      return lval_hash(val->fun->formals) * 31 + lval_hash(val->fun->body);
+
+    case LVAL_CHAN:
+      return (uintptr_t) val->chan;
+
+    case LVAL_SEQ:
+      return (uintptr_t) val->seq;
+  }
+
+  return hash;
+}
+
+/**
+ * `unique` and `group-by` find equal values with an open addressing table of
+ * indexes into an array of values, which is made big enough up front for
+ * every value that could go in.
+ */
+typedef struct {
+  unsigned long hash;
+  int index;
+} lvalslot;
+
+typedef struct {
+  lvalslot* slots;
+  unsigned long mask;
+} lvaltab;
+
+void lvaltab_init(lvaltab* tab, int count) {
+  unsigned long cap = 16;
+
+  while (cap < (unsigned long) count * 2) {
+    cap *= 2;
+  }
+
+  tab->slots = malloc(sizeof(lvalslot) * cap);
+  tab->mask = cap - 1;
+
+  for (unsigned long i = 0; i < cap; i++) {
+    tab->slots[i].index = -1;
+  }
+}
+
+/**
+ * returns the index of the value in `vals` equal to `val`, or adds `index`
+ * for it and returns -1 if there isn't one.
+ */
+int lvaltab_add(lvaltab* tab, lval** vals, lval* val, int index) {
+  unsigned long hash = lval_hash(val);
+
+  for (unsigned long i = hash & tab->mask; ; i = (i + 1) & tab->mask) {
+    lvalslot* slot = &tab->slots[i];
+
+    if (slot->index < 0) {
+      slot->hash = hash;
+      slot->index = index;
+      return -1;
+    }
+
+    if (slot->hash == hash && lval_eq(vals[slot->index], val)) {
+      return slot->index;
+    }
+  }
+}
+
+/**
+ * returns the index of the value in `vals` equal to `val`, or -1.
+ */
+int lvaltab_find(lvaltab* tab, lval** vals, lval* val) {
+  unsigned long hash = lval_hash(val);
+
+  for (unsigned long i = hash & tab->mask; ; i = (i + 1) & tab->mask) {
+    lvalslot* slot = &tab->slots[i];
+
+    if (slot->index < 0) {
+      return -1;
+    }
+
+    if (slot->hash == hash && lval_eq(vals[slot->index], val)) {
+      return slot->index;
+    }
+  }
+}
+
+/**
+ * keeps only the first of all the elements that are equal to each other, in
+ * the order they came in.
+ */
+lval* builtin_unique(lenv* env, lval* args) {
+  LREALIZE(env, args);
+  LASSERT_ARG_COUNT(args, "unique", 1);
+  LASSERT_ARG_TYPE_AT(args, "unique", LVAL_QEXPR, 0);
+
+  lval* list = lval_take(args, 0);
+  lvaltab tab;
+  int kept = 0;
+
+  lval_unshare(list);
+
+  lvaltab_init(&tab, list->count);
+
+  for (int i = 0; i < list->count; i++) {
+    lval* val = list->cell[i];
+
+    if (lvaltab_add(&tab, list->cell, val, kept) < 0) {
+      list->cell[kept++] = val;
+    } else {
+      lval_del(val);
+    }
+  }
+
+  lval_resize(list, kept);
+  free(tab.slots);
+
+  return list;
+}
+
+/**
+ * `(group-by f list)` returns a list of `{key {elements}}` pairs, one for
+ * every distinct key `f` returns for the elements of `list`, in the order the
+ * keys first came up. the elements of each group keep their order.
+ */
+lval* builtin_group_by(lenv* env, lval* args) {
+  LREALIZE(env, args);
+  LASSERT_ARG_COUNT(args, "group-by", 2);
+  LASSERT_ARG_TYPE_AT(args, "group-by", LVAL_FUN, 0);
+  LASSERT_ARG_TYPE_AT(args, "group-by", LVAL_QEXPR, 1);
+
+  lval* func = args->cell[0];
+  lval* list = args->cell[1];
+  lval** keys = malloc(sizeof(lval*) * list->count);
+
+  lval_unshare(list);
+  lval* groups = lval_qexpr();
+  lvaltab tab;
+
+  lvaltab_init(&tab, list->count);
+
+  for (int i = 0; i < list->count; i++) {
+    lval* key = lval_call1(env, func, lval_copy(list->cell[i]));
+
+    if (key->type == LVAL_ERR) {
+      for (int j = i; j < list->count; j++) {
+        lval_del(list->cell[j]);
+      }
+
+      lval_resize(list, 0);
+      free(tab.slots);
+      free(keys);
+      lval_del(groups);
+      lval_del(args);
+
+      return key;
+    }
+
+    int group = lvaltab_add(&tab, keys, key, groups->count);
+
+    if (group < 0) {
+      group = groups->count;
+      keys[group] = key;
+      lval_add(groups, lval_add(lval_add(lval_qexpr(), key), lval_qexpr()));
+    } else {
+      lval_del(key);
+    }
+
+    lval_add(groups->cell[group]->cell[1], list->cell[i]);
+  }
+
+  lval_resize(list, 0);
+  free(tab.slots);
+  free(keys);
+  lval_del(args);
+
+  return groups;
+}
+
+lval* builtin_add(lenv* env, lval* val) {
+  return builtin_op(env, val, "+");
+}
+
+lval* builtin_sub(lenv* env, lval* val) {
+  return builtin_op(env, val, "-");
+}
+
+lval* builtin_mul(lenv* env, lval* val) {
+  return builtin_op(env, val, "*");
+}
+
+lval* builtin_div(lenv* env, lval* val) {
+  return builtin_op(env, val, "/");
+}
+
+lval* builtin_op(lenv* env, lval* val, char* op) {
+  UNUSED(env);
+
+  for (int i = 0; i < val->count; i++) {
+    if (val->cell[i]->type != LVAL_NUM) {
+      lval* err = lval_err("Arithmetic operator '%s' expects a %s but got (a/an) %s instead on index %i.",
+        op, ltype_name(LVAL_NUM), ltype_name(val->cell[i]->type), i);
+
+      lval_del(val);
+      return err;
+    }
+  }
+
+  lval* head = lval_pop(val, 0);
+
+  // negatives
+  if ((strcmp(op, "-") == 0) && val->count == 0) {
+    val->num = -val->num;
+  }
+
+  while (val->count > 0) {
+    lval* next = lval_pop(val, 0);
+
+    if (strcmp(op, "+") == 0) {
+      head->num += next->num;
+    } else if (strcmp(op, "-") == 0) {
+      head->num -= next->num;
+    } else if (strcmp(op, "*") == 0) {
+      head->num *= next->num;
+    } else if (strcmp(op, "/") == 0) {
+      if (next->num == 0) {
+        lval_del(head);
+        lval_del(next);
+
+        head = lval_err("cannot devide by zero");
+        break;
+      }
+
+      head->num /= next->num;
+    }
+
+    lval_del(next);
+  }
+
+  lval_del(val);
+  return head;
+}
+
+lval* builtin_gt(lenv* env, lval* val) {
+  return builtin_comp(env, val, ">");
+}
+
+lval* builtin_ge(lenv* env, lval* val) {
+  return builtin_comp(env, val, ">=");
+}
+
+lval* builtin_lt(lenv* env, lval* val) {
+  return builtin_comp(env, val, "<");
+}
+
+lval* builtin_le(lenv* env, lval* val) {
+  return builtin_comp(env, val, "<=");
+}
+
+lval* builtin_comp(lenv* env, lval* val, char* comp) {
+  UNUSED(env);
+
+  for (int i = 0; i < val->count; i++) {
+    if (val->cell[i]->type != LVAL_NUM) {
+      lval* err = lval_err("Comparison operator '%s' expects a %s but got (a/an) %s instead on index %i.",
+        comp, ltype_name(LVAL_NUM), ltype_name(val->cell[i]->type), i);
+
+      lval_del(val);
+      return err;
+    }
+  }
+
+  lval* left = lval_pop(val, 0);
+  lval* right = lval_pop(val, 0);
+  int result;
+
+  if (strcmp(comp, ">") == 0) {
+    result = left->num > right->num;
+  } else if (strcmp(comp, "<") == 0) {
+    result = left->num < right->num;
+  } else if (strcmp(comp, ">=") == 0) {
+    result = left->num >= right->num;
+  } else if (strcmp(comp, "<=") == 0) {
+    result = left->num <= right->num;
+  } else if (strcmp(comp, "==") == 0) {
+    result = lval_eq(left, right);
+  } else if (strcmp(comp, "!=") == 0) {
+    result = lval_eq(left, right) ? 0 : 1;
+  } else {
+    lval_del(left);
+    lval_del(right);
+    return lval_err("Unknown comparison operator: %s", comp);
+  }
+
+  lval_del(left);
+  lval_del(right);
+  lval_del(val);
+
+  return lval_num(result);
+}
+
+lval* builtin_if(lenv* env, lval* expression) {
+  LASSERT_ARG_TYPE_AT(expression, "if", LVAL_NUM, 0);
+  LASSERT_ARG_TYPE_AT(expression, "if", LVAL_QEXPR, 1);
+  LASSERT_ARG_TYPE_AT(expression, "if", LVAL_QEXPR, 2);
+
+  lval* cond = lval_pop(expression, 0);
+  lval* pass = lval_pop(expression, 0);
+  lval* fail = lval_pop(expression, 0);
+  lval* resp;
+
+  pass->type = LVAL_SEXPR;
+  fail->type = LVAL_SEXPR;
+
+  if (cond->num) {
+    resp = lval_eval(env, pass);
+  } else {
+    resp = lval_eval(env, fail);
+  }
+
+  lval_del(expression);
+
+  return resp;
+}
+
+lval* builtin_not(lenv* env, lval* val) {
+  UNUSED(env);
+
+  LASSERT_ARG_COUNT(val, "not", 1);
+  LASSERT_ARG_TYPE_AT(val, "not", LVAL_NUM, 0);
+
+  int opposite = val->cell[0]->num ? 0 : 1;
+
+  lval_del(val);
+  return lval_num(opposite);
+}
+
+lval* builtin_logic(lval* val, char* name, int stop) {
+  for (int i = 0; i < val->count; i++) {
+    LASSERT_ARG_TYPE_AT(val, name, LVAL_NUM, i);
+  }
+
+  for (int i = 0; i < val->count; i++) {
+    if ((val->cell[i]->num != 0) == stop) {
+      lval_del(val);
+      return lval_num(stop);
+    }
+  }
+
+  lval_del(val);
+  return lval_num(!stop);
+}
+
+lval* builtin_or(lenv* env, lval* val) {
+  UNUSED(env);
+  return builtin_logic(val, "or", 1);
+}
+
+lval* builtin_and(lenv* env, lval* val) {
+  UNUSED(env);
+  return builtin_logic(val, "and", 0);
+}
+
+lval* builtin_do(lenv* env, lval* val) {
+  UNUSED(env);
+
+  if (val->count == 0) {
+    lval_del(val);
+    return lval_qexpr();
+  }
+
+  return lval_take(val, val->count - 1);
+}
+
+lval* builtin_let(lenv* env, lval* val) {
+  LASSERT_ARG_COUNT(val, "let", 1);
+  LASSERT_ARG_TYPE_AT(val, "let", LVAL_QEXPR, 0);
+
+  lenv* frame = lenv_frame(env, 0);
+  lval* result = lval_eval_body(frame, val->cell[0]);
+
+  lenv_frame_del(frame);
+  lval_del(val);
+
+  return result;
+}
+
+/**
+ * special forms are given the whole expression they appear in, with their
+ * operands still unevaluated, whenever they are called by name. that lets
+ * `if`, `and` and `or` skip the operands they don't need, and `do` stop at
+ * the first error. an operand that is a Q-Expression is code that gets
+ * evaluated in place, without being copied first, and anything else is
+ * evaluated like an argument would be. `expr` still belongs to the caller.
+ * called as values, for example through `unpack`, the builtins above get
+ * their arguments evaluated as usual.
+ */
+lval* lval_eval_operand(lenv* env, lval* operand) {
+  if (operand->type == LVAL_QEXPR) {
+    return lval_eval_body(env, operand);
+  }
+
+  return lval_eval_ref(env, operand);
+}
+
+/**
+ * returns `NULL` when `val` is a number, otherwise deletes it and returns the
+ * error to give back instead.
+ */
+lval* lval_expect_num(lval* val, char* name, int index) {
+  if (val->type == LVAL_NUM) {
+    return NULL;
+  }
+
+  if (val->type == LVAL_ERR) {
+    return lrecur_escape(val);
+  }
+
+  lval* err = lval_err(
+    "Function '%s' expects a %s but got (a/an) %s at index %i instead.",
+      name, ltype_name(LVAL_NUM), ltype_name(val->type), index);
+
+  lval_del(val);
+  return err;
+}
+
+lval* special_if(lenv* env, lval* expr) {
+  if (expr->count != 4) {
+    return lval_err("Function 'if' expects 3 argument but got %i.",
+      expr->count - 1);
+  }
+
+  lval* cond = lval_eval_ref(env, expr->cell[1]);
+  lval* err = lval_expect_num(cond, "if", 0);
+
+  if (err) {
+    return err;
+  }
+
+  int pass = cond->num != 0;
+  lval_del(cond);
+
+  return lval_eval_operand(env, expr->cell[pass ? 2 : 3]);
+}
+
+lval* special_logic(lenv* env, lval* expr, char* name, int stop) {
+  for (int i = 1; i < expr->count; i++) {
+    lval* val = lval_eval_operand(env, expr->cell[i]);
+    lval* err = lval_expect_num(val, name, i - 1);
+
+    if (err) {
+      return err;
+    }
+
+    int truth = val->num != 0;
+    lval_del(val);
+
+    if (truth == stop) {
+      return lval_num(stop);
+    }
+  }
+
+  return lval_num(!stop);
+}
+
+lval* special_or(lenv* env, lval* expr) {
+  return special_logic(env, expr, "or", 1);
+}
+
+lval* special_and(lenv* env, lval* expr) {
+  return special_logic(env, expr, "and", 0);
+}
+
+lval* special_do(lenv* env, lval* expr) {
+  lval* result = NULL;
+
+  for (int i = 1; i < expr->count; i++) {
+    if (result) {
+      lval_del(result);
+    }
+
+    result = lval_eval_ref(env, expr->cell[i]);
+
+    if (result->type == LVAL_ERR) {
+      return i < expr->count - 1 ? lrecur_escape(result) : result;
+    }
+  }
+
+  return result;
+}
+
+/**
+ * evaluates its operand in a scope of its own, so that anything defined in it
+ * with `=` is gone afterwards.
+ */
+lval* special_let(lenv* env, lval* expr) {
+  if (expr->count != 2) {
+    return lval_err("Function 'let' expects 1 argument but got %i.",
+      expr->count - 1);
+  }
+
+  lenv* frame = lenv_frame(env, 0);
+  lval* result = lval_eval_operand(frame, expr->cell[1]);
+  lenv_frame_del(frame);
+
+  return result;
+}
+
+/**
+ * `cond` and `case` take any number of clauses, each a Q-Expression holding a
+ * test or a key and the expression that gives the result. `cond` evaluates the
+ * tests in turn and `case` compares the keys against its value, until one of
+ * them matches, and nothing after it gets evaluated. the key `otherwise`
+ * matches anything, which it does for `cond` as well since it's `true`.
+ * called as values they behave the same way, only their first argument
+ * has already been evaluated.
+ */
+lval* lclause_check(lval* clause, char* name, int index) {
+  if (clause->type == LVAL_QEXPR && clause->count == 2) {
+    return NULL;
+  }
+
+  return lval_err(
+    "Function '%s' expects a %s of 2 elements at index %i instead.",
+      name, ltype_name(LVAL_QEXPR), index);
+}
+
+int lval_is_otherwise(lval* key) {
+  return key->type == LVAL_SYM && strcmp(key->sym, "otherwise") == 0;
+}
+
+lval* lcond_eval(lenv* env, lval** clauses, int count) {
+  for (int i = 0; i < count; i++) {
+    lval* err = lclause_check(clauses[i], "cond", i);
+
+    if (err) {
+      return err;
+    }
+
+    lval* test = lval_eval_ref(env, clauses[i]->cell[0]);
+    err = lval_expect_num(test, "cond", i);
+
+    if (err) {
+      return err;
+    }
+
+    int pass = test->num != 0;
+    lval_del(test);
+
+    if (pass) {
+      return lval_eval_ref(env, clauses[i]->cell[1]);
+    }
+  }
+
+  return lval_err("No selection found");
+}
+
+lval* lcase_eval(lenv* env, lval* val, lval** clauses, int count) {
+  for (int i = 0; i < count; i++) {
+    lval* err = lclause_check(clauses[i], "case", i + 1);
+
+    if (err) {
+      return err;
+    }
+
+    lval* key = clauses[i]->cell[0];
+    int match = 1;
+
+    if (!lval_is_otherwise(key)) {
+      key = lval_eval_ref(env, key);
+
+      if (key->type == LVAL_ERR) {
+        return lrecur_escape(key);
+      }
+
+      match = lval_eq(val, key);
+      lval_del(key);
+    }
+
+    if (match) {
+      return lval_eval_ref(env, clauses[i]->cell[1]);
+    }
+  }
+
+  return lval_err("No case found");
+}
+
+lval* special_cond(lenv* env, lval* expr) {
+  return lcond_eval(env, expr->cell + 1, expr->count - 1);
+}
+
+lval* special_case(lenv* env, lval* expr) {
+  lval* val = lval_eval_ref(env, expr->cell[1]);
+
+  if (val->type == LVAL_ERR) {
+    return lrecur_escape(val);
+  }
+
+  lval* result = lcase_eval(env, val, expr->cell + 2, expr->count - 2);
+  lval_del(val);
+
+  return result;
+}
+
+lval* builtin_cond(lenv* env, lval* args) {
+  lval* result = lcond_eval(env, args->cell, args->count);
+  lval_del(args);
+
+  return result;
+}
+
+lval* builtin_case(lenv* env, lval* args) {
+  LASSERT(args, args->count > 0,
+    "Function 'case' expects a value to match but got no arguments.");
+
+  lval* result = lcase_eval(env, args->cell[0], args->cell + 1,
+    args->count - 1);
+  lval_del(args);
+
+  return result;
+}
+
+lval* builtin_eq(lenv* env, lval* val) {
+  LREALIZE(env, val);
+  LASSERT_ARG_COUNT(val, "==", 2);
+
+  int eq = lval_eq(val->cell[0], val->cell[1]);
+  lval_del(val);
+
+  return lval_num(eq);
+}
+
+lval* builtin_ne(lenv* env, lval* val) {
+  lval* res = builtin_eq(env, val);
+
+  if (res->type == LVAL_NUM) {
+    res->num = res->num ? 0 : 1;
+  }
+
+  return res;
+}
+
+/**
+ * this function should act like any other builtin. it first checks for error
+ * conditions and then performs some command and returns a value. in this case
+ * it first checks that the input arguments are the correct types. it then
+ * iterates over each symbol and value and puts them into the environment. if
+ * there is an error we can return it, but on success we will return the empty
+ * expression `()`.
+ */
+lval* builtin_var(lenv* env, lval* args, char* func) {
+  LASSERT_ARG_TYPE_AT(args, func, LVAL_QEXPR, 0);
+
+  lval* syms = args->cell[0];
+
+  for (int i = 0; i < syms->count; i++) {
+    LASSERT(args, syms->cell[i]->type == LVAL_SYM,
+      "Function '%s' cannot define non-symbol. Got %s but expected %s.",
+        func, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+  }
+
+  LASSERT(args, syms->count == args->count - 1,
+    "Function 'def' cannot define incorrect number of values to symbols");
+
+  LASSERT(args, !(PARALLEL_DEPTH && strcmp(func, "def") == 0),
+    "Function 'def' cannot define globals from inside a parallel job.");
+
+  for (int i = 0; i < syms->count; i++) {
+    if (strcmp(func, "def") == 0) {
+      lenv_def(env, syms->cell[i], args->cell[i + 1]);
+    }
+
+    if (strcmp(func, "=") == 0) {
+      lenv_put(env, syms->cell[i], args->cell[i + 1]);
+    }
+  }
+
+  lval_del(args);
+  return lval_sexpr();
+}
+
+lval* builtin_def(lenv* env, lval* args) {
+  return builtin_var(env, args, "def");
+}
+
+lval* builtin_put(lenv* env, lval* args) {
+  return builtin_var(env, args, "=");
+}
+
+/**
+ * we can now add a builtin for our lambda function. we want it to take as
+ * input some list of symbols, and a list that represents the code. after that
+ * it should return a function lval. we've defined a few of builtins now, and
+ * this one will follow the same format. like in `def` we do some error
+ * checking to ensure that argument types and count are correct. then we just
+ * pop the first two arguments from the list and pass them to our previously
+ * defined function `lval_lambda`.
+ */
+lval* builtin_lambda(lenv* env, lval* args) {
+  LASSERT_ARG_COUNT(args, "\\", 2);
+  LASSERT_ARG_TYPE_AT(args, "\\", LVAL_QEXPR, 0);
+  LASSERT_ARG_TYPE_AT(args, "\\", LVAL_QEXPR, 1);
+
+  for (int i = 0; i < args->cell[0]->count; i++) {
+    LASSERT(args, args->cell[0]->cell[i]->type == LVAL_SYM,
+      "Cannot define non-symbol. Got %s but expected %s",
+        ltype_name(args->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+  }
+
+  lval* formals = lval_pop(args, 0);
+  lval* body = lval_pop(args, 0);
+  lval* lambda = lval_lambda(formals, body);
+
+  if (env->ctx->optimize) {
+    lambda->fun->code = lval_optimize(env, lval_copy(body));
+  }
+
+  lval_del(args);
+  return lambda;
+}
+
+/**
+ * the environment always takes or returns copies of a value, so we need to
+ * remember to delete these two `lval` after registration as we won't need them
+ * any more.
+ */
+void lenv_add_builtin(lenv* env, char* name, lbuiltin func) {
+  lval* label = lval_sym(name);
+  lval* value = lval_builtin(func);
+
+  lenv_put(env, label, value);
+  lval_del(label);
+  lval_del(value);
+}
+
+/**
+ * `special` is used instead of `func` when the builtin is called by name, see
+ * `lval_eval_operand`.
+ */
+void lenv_add_special(lenv* env, char* name, lbuiltin func, lbuiltin special) {
+  lval* label = lval_sym(name);
+  lval* value = lval_builtin(func);
+  value->special = special;
+
+  lenv_put(env, label, value);
+  lval_del(label);
+  lval_del(value);
+}
+
+/**
+ * builtins that take no arguments at all, like `(jit-stats)`, need to be
+ * marked as such. otherwise a single element expression just evaluates to
+ * the function itself.
+ */
+void lenv_add_nullary(lenv* env, char* name, lbuiltin func) {
+  lval* label = lval_sym(name);
+  lval* value = lval_builtin(func);
+  value->nullary = 1;
+
+  lenv_put(env, label, value);
+  lval_del(label);
+  lval_del(value);
+}
+
+void lenv_add_value(lenv * env, char* name, lval* value) {
+  lval* label = lval_sym(name);
+  lenv_put(env, label, value);
+  lval_del(label);
+  lval_del(value);
+}
+
+void lenv_add_builtins(lenv* env) {
+  lenv_add_builtin(env, "load",  builtin_load);
+  lenv_add_builtin(env, "\\",  builtin_lambda);
+  lenv_add_builtin(env, "def", builtin_def);
+  lenv_add_builtin(env, "=", builtin_put);
+
+  lenv_add_builtin(env, "print", builtin_print);
+  lenv_add_nullary(env, "flush", builtin_flush);
+  lenv_add_builtin(env, "to-string", builtin_to_string);
+  lenv_add_builtin(env, "error", builtin_error);
+
+  lenv_add_builtin(env, "list", builtin_list);
+  lenv_add_builtin(env, "head", builtin_head);
+  lenv_add_builtin(env, "tail", builtin_tail);
+  lenv_add_builtin(env, "eval", builtin_eval);
+  lenv_add_builtin(env, "with-limits", builtin_with_limits);
+  lenv_add_builtin(env, "join", builtin_join);
+  lenv_add_builtin(env, "cons", builtin_cons);
+  lenv_add_builtin(env, "len",  builtin_len);
+  lenv_add_builtin(env, "arity",  builtin_arity);
+  lenv_add_builtin(env, "sort", builtin_sort);
+  lenv_add_builtin(env, "sort-by", builtin_sort_by);
+  lenv_add_builtin(env, "unique", builtin_unique);
+  lenv_add_builtin(env, "group-by", builtin_group_by);
+
+  lenv_add_builtin(env, "+", builtin_add);
+  lenv_add_builtin(env, "-", builtin_sub);
+  lenv_add_builtin(env, "*", builtin_mul);
+  lenv_add_builtin(env, "/", builtin_div);
+
+  lenv_add_special(env, "if", builtin_if, special_if);
+  lenv_add_builtin(env, ">", builtin_gt);
+  lenv_add_builtin(env, ">=", builtin_ge);
+  lenv_add_builtin(env, "<", builtin_lt);
+  lenv_add_builtin(env, "<=", builtin_le);
+  lenv_add_builtin(env, "==", builtin_eq);
+  lenv_add_builtin(env, "!=", builtin_ne);
+
+  lenv_add_special(env, "and", builtin_and, special_and);
+  lenv_add_special(env, "&&", builtin_and, special_and);
+  lenv_add_special(env, "or", builtin_or, special_or);
+  lenv_add_special(env, "||", builtin_or, special_or);
+  lenv_add_special(env, "do", builtin_do, special_do);
+  lenv_add_special(env, "let", builtin_let, special_let);
+  lenv_add_special(env, "cond", builtin_cond, special_cond);
+  lenv_add_special(env, "case", builtin_case, special_case);
+  lenv_add_special(env, "while", builtin_while, special_while);
+  lenv_add_special(env, "dotimes", builtin_dotimes, special_dotimes);
+  lenv_add_special(env, "for-each", builtin_for_each, special_for_each);
+  lenv_add_special(env, "loop", builtin_loop, special_loop);
+  lenv_add_nullary(env, "recur", builtin_recur);
+
+  lenv_add_builtin(env, "not", builtin_not);
+  lenv_add_builtin(env, "!", builtin_not);
+
+  lenv_add_nullary(env, "jit-stats", builtin_jit_stats);
+  lenv_add_nullary(env, "intern-stats", builtin_intern_stats);
+
+  lenv_add_builtin(env, "pmap", builtin_pmap);
+  lenv_add_builtin(env, "pfilter", builtin_pfilter);
+  lenv_add_builtin(env, "preduce", builtin_preduce);
+  lenv_add_builtin(env, "pipeline", builtin_pipeline);
+  lenv_add_nullary(env, "pipeline-stats", builtin_pipeline_stats);
+
+  lenv_add_builtin(env, "spawn", builtin_spawn);
+  lenv_add_nullary(env, "yield", builtin_yield);
+  lenv_add_builtin(env, "chan", builtin_chan);
+  lenv_add_builtin(env, "send", builtin_send);
+  lenv_add_builtin(env, "recv", builtin_recv);
+
+  lenv_add_builtin(env, "range", builtin_range);
+  lenv_add_builtin(env, "iterate", builtin_iterate);
+  lenv_add_builtin(env, "lazy-map", builtin_lazy_map);
+  lenv_add_builtin(env, "lazy-filter", builtin_lazy_filter);
+  lenv_add_builtin(env, "take-while", builtin_take_while);
+  lenv_add_builtin(env, "realize", builtin_realize);
+  lenv_add_builtin(env, "fold", builtin_fold);
+
+  lenv_add_builtin(env, "open-lines", builtin_open_lines);
+  lenv_add_builtin(env, "next-line", builtin_next_line);
+  lenv_add_builtin(env, "fold-lines", builtin_fold_lines);
+
+  lenv_add_builtin(env, "dump", builtin_dump);
+  lenv_add_builtin(env, "undump", builtin_undump);
+  lenv_add_builtin(env, "trace-dump", builtin_trace_dump);
+
+  lenv_add_value(env, "true", lval_num(1));
+  lenv_add_value(env, "false", lval_num(0));
+  lenv_add_value(env, "nil", lval_qexpr());
+}
+
+/**
+ * the optimizer runs over every top level expression that gets loaded, and
+ * over the body of every lambda when it's created. calls to pure builtins
+ * whose arguments are all literals are folded into their result, and calls to
+ * small global lambdas are replaced with their body, with the arguments put in
+ * place of the formals. both depend on what a symbol was bound to when the
+ * optimizer ran, so the result is wrapped in a guard.
+ *
+ * every time the guard is evaluated it looks the symbols up again, and only
+ * evaluates the optimized expression when all of them are still bound to the
+ * same function, otherwise it falls back to the original call. that way
+ * redefining a function with `def` always takes effect. a guard is an
+ * S-Expression holding a single `<inline>` builtin, a builtin that is never
+ * bound to a name, so nothing else can look like one. the symbols with their
+ * values, the original and the optimized expression live in the `lfunc` of
+ * that builtin, where the formals, body and code of a lambda would be. this
+ * makes copying a guard as cheap as copying a function, which matters since
+ * the branches of `if` are copied every time they're passed to it. lambdas
+ * keep their original body for printing and for the jit.
+ */
+#define INLINE_MAX_NODES 10
+#define INLINE_MAX_DEPTH 4
+
+lval* builtin_inline(lenv* env, lval* args) {
+  UNUSED(env);
+
+  lval_del(args);
+  return lval_err("Inlined code can only be evaluated by the interpreter.");
+}
+
+int lval_is_guard(lval* val) {
+  return (val->type == LVAL_SEXPR || val->type == LVAL_QEXPR) &&
+    val->count == 1 &&
+    val->cell[0]->type == LVAL_FUN &&
+    val->cell[0]->builtin == builtin_inline;
+}
+
+/**
+ * returns the expression a guard has to evaluate, either the optimized or the
+ * original one.
+ */
+lval* lval_guard_pick(lenv* env, lval* guard) {
+  lfunc* fun = guard->cell[0]->fun;
+  lval* deps = fun->formals;
+
+  for (int i = 0; i < deps->count; i += 2) {
+    lval* now = lenv_lookup(env, deps->cell[i]);
+    lval* then = deps->cell[i + 1];
+
+    if (
+      !now || now->type != LVAL_FUN || now->env ||
+      now->builtin != then->builtin || now->fun != then->fun
+    ) {
+      return fun->body;
+    }
+  }
+
+  return fun->code;
+}
+
+lval* lval_guard(lval* deps, lval* original, lval* optimized) {
+  lval* marker = lval_builtin(builtin_inline);
+
+  marker->fun = malloc(sizeof(lfunc));
+  marker->fun->refs = 1;
+  marker->fun->formals = deps;
+  marker->fun->body = original;
+  marker->fun->code = optimized;
+  marker->fun->jit = NULL;
+  marker->fun->table = NULL;
+
+  return lval_add(lval_sexpr(), marker);
+}
+
+/**
+ * builtins that always give the same result for the same arguments and don't
+ * touch the environment. `arity` is the exact number of arguments, or -1 for
+ * any number, so a call that would fail is never folded.
+ */
+typedef struct {
+  lbuiltin func;
+  int arity;
+} lpure;
+
+lval* builtin_sub(lenv*, lval*);
+lval* builtin_mul(lenv*, lval*);
+lval* builtin_div(lenv*, lval*);
+lval* builtin_gt(lenv*, lval*);
+lval* builtin_ge(lenv*, lval*);
+lval* builtin_lt(lenv*, lval*);
+lval* builtin_le(lenv*, lval*);
+lval* builtin_eq(lenv*, lval*);
+lval* builtin_ne(lenv*, lval*);
+lval* builtin_not(lenv*, lval*);
+
+lpure PURE_BUILTINS[] = {
+  {builtin_add, -1}, {builtin_sub, -1}, {builtin_mul, -1}, {builtin_div, -1},
+  {builtin_gt, 2}, {builtin_ge, 2}, {builtin_lt, 2}, {builtin_le, 2},
+  {builtin_eq, 2}, {builtin_ne, 2}, {builtin_not, 1},
+  {builtin_head, 1}, {builtin_tail, 1}, {builtin_len, 1},
+  {builtin_list, -1}, {builtin_join, -1},
+};
+
+lpure* lpure_find(lval* func) {
+  if (!func || func->type != LVAL_FUN || !func->builtin) {
+    return NULL;
+  }
+
+  int count = sizeof(PURE_BUILTINS) / sizeof(PURE_BUILTINS[0]);
+
+  for (int i = 0; i < count; i++) {
+    if (PURE_BUILTINS[i].func == func->builtin) {
+      return &PURE_BUILTINS[i];
+    }
+  }
+
+  return NULL;
+}
+
+int lval_is_literal(lval* val) {
+  return val->type == LVAL_NUM || val->type == LVAL_STR ||
+    val->type == LVAL_QEXPR;
+}
+
+/**
+ * an expression is pure when evaluating it can't have any side effects, so it
+ * doesn't matter when it gets evaluated.
+ */
+int lval_is_pure(lenv* globals, lval* val) {
+  if (lval_is_literal(val) || val->type == LVAL_SYM) {
+    return 1;
+  }
+
+  if (val->type != LVAL_SEXPR) {
+    return 0;
+  }
+
+  if (lval_is_guard(val)) {
+    return lval_is_pure(globals, val->cell[0]->fun->body);
+  }
+
+  if (val->count < 2 || val->cell[0]->type != LVAL_SYM) {
+    return 0;
+  }
+
+  if (!lpure_find(lenv_lookup(globals, val->cell[0]))) {
+    return 0;
+  }
+
+  for (int i = 1; i < val->count; i++) {
+    if (!lval_is_pure(globals, val->cell[i])) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+int lval_nodes(lval* val) {
+  int nodes = 1;
+
+  if (val->type == LVAL_SEXPR || val->type == LVAL_QEXPR) {
+    for (int i = 0; i < val->count; i++) {
+      nodes += lval_nodes(val->cell[i]);
+    }
+  }
+
+  return nodes;
+}
+
+int lval_uses(lval* val, char* sym) {
+  if (val->type == LVAL_SYM) {
+    return strcmp(val->sym, sym) == 0;
+  }
+
+  int uses = 0;
+
+  if (val->type == LVAL_SEXPR || val->type == LVAL_QEXPR) {
+    for (int i = 0; i < val->count; i++) {
+      uses += lval_uses(val->cell[i], sym);
+    }
+  }
+
+  return uses;
+}
+
+int lval_has_qexpr(lval* val) {
+  for (int i = 0; i < val->count; i++) {
+    lval* cell = val->cell[i];
+
+    if (cell->type == LVAL_QEXPR) {
+      return 1;
+    }
+
+    if (cell->type == LVAL_SEXPR && lval_has_qexpr(cell)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * copies `val`, replacing each symbol in `formals` with the argument at the
+ * same position of `call`.
+ */
+lval* lval_substitute(lval* val, lval* formals, lval* call) {
+  if (val->type == LVAL_SYM) {
+    for (int i = 0; i < formals->count; i++) {
+      if (strcmp(val->sym, formals->cell[i]->sym) == 0) {
+        return lval_copy(call->cell[i + 1]);
+      }
+    }
+
+    return lval_copy(val);
+  }
+
+  if (val->type != LVAL_SEXPR && val->type != LVAL_QEXPR) {
+    return lval_copy(val);
+  }
+
+  lval* copy = lval_sexpr();
+
+  for (int i = 0; i < val->count; i++) {
+    lval_add(copy, lval_substitute(val->cell[i], formals, call));
+  }
+
+  return copy;
+}
+
+lval* lval_optimize_expr(lenv* globals, lval* expr, int depth);
+
+/**
+ * every argument has to be a literal, or a guard around one, so nested calls
+ * fold all the way up. the guard of the result depends on all of them.
+ */
+lval* lval_optimize_fold(lenv* globals, lval* expr, lval* func) {
+  lval* deps = lval_qexpr();
+  lval* args = lval_sexpr();
+
+  for (int i = 1; i < expr->count; i++) {
+    lval* arg = expr->cell[i];
+
+    if (lval_is_guard(arg) && lval_is_literal(arg->cell[0]->fun->code)) {
+      lval* inner = arg->cell[0]->fun->formals;
+
+      for (int j = 0; j < inner->count; j++) {
+        lval_add(deps, lval_copy(inner->cell[j]));
+      }
+
+      arg = arg->cell[0]->fun->code;
+    }
+
+    if (!lval_is_literal(arg)) {
+      lval_del(deps);
+      lval_del(args);
+      return expr;
+    }
+
+    lval_add(args, lval_copy(arg));
+  }
+
+  lval* result = func->builtin(globals, args);
+
+  if (result->type == LVAL_ERR) {
+    lval_del(deps);
+    lval_del(result);
+    return expr;
+  }
+
+  lval_add(deps, lval_copy(expr->cell[0]));
+  lval_add(deps, lval_copy(func));
+
+  return lval_guard(deps, expr, result);
+}
+
+/**
+ * a lambda is only inlined when that can't change what the program does. its
+ * body has no Q-Expressions, never refers to itself or to `=`, and uses each
+ * formal exactly once, and all the arguments are pure, so each of them is
+ * still evaluated once and the order doesn't matter. since the body of a
+ * function already sees the environment of its caller, it means the same
+ * thing in place of the call.
+ */
+lval* lval_optimize_inline(lenv* globals, lval* expr, lval* func, int depth) {
+  lval* formals = func->fun->formals;
+  lval* body = func->fun->body;
+
+  if (
+    func->env || depth >= INLINE_MAX_DEPTH ||
+    formals->count != expr->count - 1 ||
+    lval_nodes(body) > INLINE_MAX_NODES + 1 ||
+    lval_has_qexpr(body) ||
+    lval_uses(body, expr->cell[0]->sym) ||
+    lval_uses(body, "=")
+  ) {
+    return expr;
+  }
+
+  for (int i = 0; i < formals->count; i++) {
+    if (
+      strcmp(formals->cell[i]->sym, "&") == 0 ||
+      lval_uses(body, formals->cell[i]->sym) != 1 ||
+      !lval_is_pure(globals, expr->cell[i + 1])
+    ) {
+      return expr;
+    }
+  }
+
+  lval* inlined = lval_substitute(body, formals, expr);
+  inlined = lval_optimize_expr(globals, inlined, depth + 1);
+
+  lval* deps = lval_qexpr();
+  lval_add(deps, lval_copy(expr->cell[0]));
+  lval_add(deps, lval_copy(func));
+
+  return lval_guard(deps, expr, inlined);
+}
+
+/**
+ * `case` compares its value against one key after another. when every key is
+ * a number, a string or a Q-Expression, none of which need evaluating, the
+ * optimizer builds a jump table for it once, kept in the `lfunc` of the guard
+ * around it, and the clause to take is found with a single lookup no matter
+ * how many there are. numbers that lie close enough together index an array
+ * directly, anything else goes through a hash table. like the keys they come
+ * from, the first clause with a given key wins, and nothing after an
+ * `otherwise` clause can be reached. `keys` points into the guarded code.
+ */
+#define SWITCH_DENSITY 4
+
+struct lswitch {
+  lval** keys;
+  lvaltab tab;
+  int* dense;
+  long low;
+  unsigned long span;
+  int fallback;
+};
+
+lswitch* lswitch_new(lval** clauses, int count) {
+  lswitch* table = malloc(sizeof(lswitch));
+  table->keys = malloc(sizeof(lval*) * (count + 1));
+  table->tab.slots = NULL;
+  table->dense = NULL;
+  table->fallback = -1;
+
+  long low = LONG_MAX;
+  long high = LONG_MIN;
+  int numeric = 1;
+  int keys = 0;
+
+  for (; keys < count; keys++) {
+    lval* key = clauses[keys]->cell[0];
+
+    if (lval_is_otherwise(key)) {
+      table->fallback = keys;
+      break;
+    }
+
+    if (key->type == LVAL_NUM) {
+      low = key->num < low ? key->num : low;
+      high = key->num > high ? key->num : high;
+    } else {
+      numeric = 0;
+    }
+
+    table->keys[keys] = key;
+  }
+
+  if (keys == 0) {
+    return table;
+  }
+
+  unsigned long gap = (unsigned long) high - (unsigned long) low;
+
+  if (numeric && gap < (unsigned long) keys * SWITCH_DENSITY) {
+    table->low = low;
+    table->span = gap + 1;
+    table->dense = malloc(sizeof(int) * table->span);
+
+    for (unsigned long i = 0; i < table->span; i++) {
+      table->dense[i] = -1;
+    }
+
+    for (int i = keys - 1; i >= 0; i--) {
+      table->dense[table->keys[i]->num - low] = i;
+    }
+
+    return table;
+  }
+
+  lvaltab_init(&table->tab, keys);
+
+  for (int i = 0; i < keys; i++) {
+    lvaltab_add(&table->tab, table->keys, table->keys[i], i);
+  }
+
+  return table;
+}
+
+void lswitch_del(lswitch* table) {
+  free(table->keys);
+  free(table->tab.slots);
+  free(table->dense);
+  free(table);
+}
+
+/**
+ * returns the index of the clause `val` selects, or -1 if there is none.
+ */
+int lswitch_find(lswitch* table, lval* val) {
+  int index = -1;
+
+  if (table->dense) {
+    if (val->type == LVAL_NUM) {
+      unsigned long at = (unsigned long) val->num - (unsigned long) table->low;
+      index = at < table->span ? table->dense[at] : -1;
+    }
+  } else if (table->tab.slots) {
+    index = lvaltab_find(&table->tab, table->keys, val);
+  }
+
+  return index < 0 ? table->fallback : index;
+}
+
+/**
+ * evaluates a guard, through its jump table when it has one and it's still
+ * bound to the same `case`.
+ */
+lval* lval_guard_eval(lenv* env, lval* guard) {
+  lfunc* fun = guard->cell[0]->fun;
+  lval* code = lval_guard_pick(env, guard);
+
+  if (!fun->table || code != fun->code) {
+    return lval_eval_ref(env, code);
+  }
+
+  lval* val = lval_eval_ref(env, code->cell[1]);
+
+  if (val->type == LVAL_ERR) {
+    return lrecur_escape(val);
+  }
+
+  int index = lswitch_find(fun->table, val);
+  lval_del(val);
+
+  if (index < 0) {
+    return lval_err("No case found");
+  }
+
+  return lval_eval_ref(env, code->cell[index + 2]->cell[1]);
+}
+
+/**
+ * the clauses of `cond` and `case` are pairs rather than code, so it's their
+ * elements that get optimized. malformed clauses are left for evaluation to
+ * report.
+ */
+lval* lval_optimize_clauses(lenv* globals, lval* expr, lval* func, int depth) {
+  int first = func->special == special_case ? 2 : 1;
+  int literal = func->special == special_case;
+
+  for (int i = first; i < expr->count; i++) {
+    lval* clause = expr->cell[i];
+
+    if (clause->type != LVAL_QEXPR || clause->count != 2) {
+      return expr;
+    }
+
+    lval_unshare(clause);
+    clause->cell[0] = lval_optimize_expr(globals, clause->cell[0], depth);
+    clause->cell[1] = lval_optimize_expr(globals, clause->cell[1], depth);
+
+    lval* key = clause->cell[0];
+
+    if (!lval_is_literal(key) && !lval_is_otherwise(key)) {
+      literal = 0;
+    }
+  }
+
+  if (!literal) {
+    return expr;
+  }
+
+  lval* deps = lval_qexpr();
+  lval_add(deps, lval_copy(expr->cell[0]));
+  lval_add(deps, lval_copy(func));
+
+  lval* code = lval_copy(expr);
+  lval* guard = lval_guard(deps, expr, code);
+  guard->cell[0]->fun->table = lswitch_new(code->cell + 2, code->count - 2);
+
+  return guard;
+}
+
+/**
+ * the Q-Expressions given to special forms are code rather than data, so
+ * they get optimized too.
+ */
+lval* lval_optimize_branch(lenv* globals, lval* branch, int depth) {
+  branch->type = LVAL_SEXPR;
+  branch = lval_optimize_expr(globals, branch, depth);
+  branch->type = LVAL_QEXPR;
+
+  return branch;
+}
+
+/**
+ * `dotimes`, `for-each` and `loop` take their variables as pairs of a symbol
+ * and an expression, of which only the expressions are code.
+ */
+int lval_is_binder(lval* func) {
+  return func->special == special_dotimes ||
+    func->special == special_for_each || func->special == special_loop;
+}
+
+void lval_optimize_bindings(lenv* globals, lval* bindings, int depth) {
+  lval_unshare(bindings);
+
+  for (int i = 1; i < bindings->count; i += 2) {
+    bindings->cell[i] = lval_optimize_expr(globals, bindings->cell[i], depth);
+  }
+}
+
+lval* lval_optimize_expr(lenv* globals, lval* expr, int depth) {
+  if (expr->type != LVAL_SEXPR || lval_is_guard(expr)) {
+    return expr;
+  }
+
+  lval_unshare(expr);
+
+  for (int i = 0; i < expr->count; i++) {
+    expr->cell[i] = lval_optimize_expr(globals, expr->cell[i], depth);
+  }
+
+  if (expr->count < 2 || expr->cell[0]->type != LVAL_SYM) {
+    return expr;
+  }
+
+  lval* func = lenv_lookup(globals, expr->cell[0]);
+
+  if (!func || func->type != LVAL_FUN) {
+    return expr;
+  }
+
+  if (func->special == special_cond || func->special == special_case) {
+    return lval_optimize_clauses(globals, expr, func, depth);
+  }
+
+  if (func->special) {
+    for (int i = 1; i < expr->count && func->builtin != builtin_do; i++) {
+      if (expr->cell[i]->type != LVAL_QEXPR) {
+        continue;
+      }
+
+      if (i == 1 && lval_is_binder(func)) {
+        lval_optimize_bindings(globals, expr->cell[i], depth);
+      } else {
+        expr->cell[i] = lval_optimize_branch(globals, expr->cell[i], depth);
+      }
+    }
+
+    return expr;
+  }
+
+  lpure* pure = lpure_find(func);
+
+  if (pure) {
+    if (pure->arity < 0 || pure->arity == expr->count - 1) {
+      return lval_optimize_fold(globals, expr, func);
+    }
+
+    return expr;
+  }
+
+  if (!func->builtin) {
+    return lval_optimize_inline(globals, expr, func, depth);
+  }
+
+  return expr;
+}
+
+/**
+ * optimizes the expression `expr` that is about to be evaluated in `env`,
+ * resolving functions through the global environment.
+ */
+lval* lval_optimize(lenv* env, lval* expr) {
+  if (!env->ctx->optimize) {
+    return expr;
+  }
+
+  while (env->par) {
+    env = env->par;
+  }
+
+  if (expr->type == LVAL_QEXPR) {
+    return lval_optimize_branch(env, expr, 0);
+  }
+
+  return lval_optimize_expr(env, expr, 0);
+}
+
+/**
+ * when the head of an S-Expression is a symbol bound to a function we can call
+ * it without copying it out of the environment first. builtins only need their
+ * function pointer, and since lambdas are immutable, holding a reference to
+ * their shared `lfunc` keeps them alive even if evaluating the arguments ends
+ * up redefining them. fills in `head` and returns 1 when this is possible.
+ */
+int lval_eval_head(lenv* env, lval* expr, lval* head) {
+  if (expr->count < 2 || expr->cell[0]->type != LVAL_SYM) {
+    return 0;
+  }
+
+  lval* func = lenv_lookup(env, expr->cell[0]);
+
+  if (!func || func->type != LVAL_FUN || func->env) {
+    return 0;
+  }
+
+  head->type = LVAL_FUN;
+  head->builtin = func->builtin;
+  head->special = func->special;
+  head->nullary = func->nullary;
+  head->fun = func->fun;
+  head->env = NULL;
+
+  if (head->fun) {
+    LREF_INC(head->fun->refs);
+  }
+
+  return 1;
+}
+
+/**
+ * the second half of evaluating an S-Expression, once all of its elements have
+ * been evaluated. when `head` was resolved by `lval_eval_head` then `val` only
+ * holds the arguments.
+ */
+lval* lval_apply(lenv* env, lval* val, lval* head) {
+  for (int i = 0; i < val->count; i++) {
+    if (val->cell[i]->type == LVAL_ERR) {
+      if (head && head->fun) {
+        lfunc_release(head->fun);
+      }
+
+      return lrecur_escape(lval_take(val, i));
+    }
+  }
+
+  if (head) {
+    lval* result = lval_call(env, head, val);
+
+    if (head->fun) {
+      lfunc_release(head->fun);
+    }
+
+    return result;
+  }
+
+  if (val->count == 0) {
+    return val;
+  }
+
+  // LVAL_FUN to handle function calls with no arguments
+  // if (val->count == 1 && val->cell[0]->type != LVAL_FUN) {
+  // seg fault on `+` for some reason!
+  if (val->count == 1) {
+    if (val->cell[0]->type == LVAL_FUN && val->cell[0]->nullary) {
+      lval* head = lval_pop(val, 0);
+      lval* result = lval_call(env, head, val);
+      lval_del(head);
+
+      return result;
+    }
+
+    return lval_take(val, 0);
+  }
+
+  lval* func = lval_pop(val, 0);
+
+  if (func->type != LVAL_FUN) {
+    lval_del(func);
+    lval_del(val);
+    return lval_err("first element is not a function");
+  }
+
+  lval* result = lval_call(env, func, val);
+  lval_del(func);
+
+  return result;
+}
+
+lval* lval_eval_sexpr(lenv* env, lval* val) {
+  if (lval_is_guard(val)) {
+    lval* result = lval_guard_eval(env, val);
+    lval_del(val);
+    return result;
+  }
+
+  LTRACE(LTRACE_EVAL, 0, val->count - 1, ltrace_head(val));
+
+  if (--FUEL < 0 && lbudget_refuel()) {
+    lval_del(val);
+    return lbudget_err();
+  }
+
+  lval head;
+  int resolved = lval_eval_head(env, val, &head);
+
+  if (resolved && head.special) {
+    lval* result = head.special(env, val);
+    lval_del(val);
+    return result;
+  }
+
+  if (resolved) {
+    lval_del(lval_pop(val, 0));
+  }
+
+  lval_unshare(val);
+
+  for (int i = 0; i < val->count; i++) {
+    val->cell[i] = lval_eval(env, val->cell[i]);
+  }
+
+  return lval_apply(env, val, resolved ? &head : NULL);
+}
+
+lval* lval_eval(lenv* env, lval* val) {
+  if (val->type == LVAL_SYM) {
+    lval* ret = lenv_get(env, val);
+    lval_del(val);
+    return ret;
+  }
+
+  if (val->type == LVAL_SEXPR) {
+    return lval_eval_sexpr(env, val);
+  }
+
+  return val;
+}
+
+/**
+ * evaluates `val` without consuming it, so the result is always a fresh value.
+ * this is how function bodies get evaluated, which means a call never has to
+ * copy its body first. `val` is evaluated as an S-Expression even when it is
+ * a Q-Expression, the same way `eval` treats it.
+ */
+lval* lval_eval_body(lenv* env, lval* val) {
+  if (lval_is_guard(val)) {
+    return lval_guard_eval(env, val);
+  }
+
+  LTRACE(LTRACE_EVAL, 0, val->count - 1, ltrace_head(val));
+
+  if (--FUEL < 0 && lbudget_refuel()) {
+    return lbudget_err();
+  }
+
+  lval head;
+  int resolved = lval_eval_head(env, val, &head);
+
+  if (resolved && head.special) {
+    return head.special(env, val);
+  }
+
+  int skip = resolved ? 1 : 0;
+
+  lval* args = lval_sexpr();
+  lval_resize(args, val->count - skip);
+
+  for (int i = 0; i < args->count; i++) {
+    args->cell[i] = lval_eval_ref(env, val->cell[i + skip]);
+  }
+
+  return lval_apply(env, args, resolved ? &head : NULL);
+}
+
+lval* lval_eval_ref(lenv* env, lval* val) {
+  switch (val->type) {
+    case LVAL_SYM:
+      return lenv_get(env, val);
+
+    case LVAL_SEXPR:
+      return lval_eval_body(env, val);
+
+    default:
+      return lval_copy(val);
+  }
+}
+
+/**
+ * a small template jit for hot numeric lambdas. every user defined function
+ * carries a shared `ljit` record that counts how many times it has been called
+ * with a full set of arguments. once that count reaches `JIT_THRESHOLD` we try
+ * to translate the body straight into x86-64 machine code. only a very small
+ * subset of the language is accepted: number literals, the function's own
+ * formals, the arithmetic and comparison builtins, `if` with literal
+ * Q-Expression branches, and calls back into the function itself. anything
+ * else marks the function as rejected and it keeps running in the tree walker.
+ *
+ * the compiled code uses the native calling convention, so a function can
+ * take at most six arguments, all of them plain `long` values. before jumping
+ * into native code we check that every argument really is a number, and if
+ * the native code runs into something it can't handle, like a division by
+ * zero, it returns with its bail out flag set and every native frame above it
+ * unwinds. since compiled bodies can't have side effects we can then simply
+ * run the call again in the interpreter and let it produce the proper error.
+ *
+ * free symbols, like `+` or the function's own name, are resolved against the
+ * global environment when the function is compiled. a change to any global
+ * definition bumps the epoch of the context which throws the compiled code
+ * away. since any caller could shadow a free symbol with a binding of its
+ * own, a body using a name that has ever been bound outside of the global
+ * environment isn't compiled at all, see `lenv_is_local`. the first such
+ * binding bumps the epoch as well, so code compiled before it goes away and
+ * is rejected the next time round.
+ */
+#define JIT_THRESHOLD 16
+#define JIT_MAX_ARGS 6
+
+ljit* jit_new(void) {
+  ljit* jit = malloc(sizeof(ljit));
+  jit->state = JIT_COLD;
+  jit->calls = 0;
+  jit->epoch = 0;
+  jit->code = NULL;
+  jit->size = 0;
+  return jit;
+}
+
+void jit_reset(ljit* jit) {
+#ifdef LITHP_JIT
+  if (jit->code) {
+    munmap((void*) jit->code, jit->size);
+  }
+#endif
+
+  jit->state = JIT_COLD;
+  jit->calls = 0;
+  jit->code = NULL;
+  jit->size = 0;
+}
+
+void jit_del(ljit* jit) {
+  jit_reset(jit);
+  free(jit);
+}
+
+#ifdef LITHP_JIT
+typedef struct {
+  unsigned char* buf;
+  int len;
+  int cap;
+  int ok;
+
+  // offsets of every rel32 operand that should jump to the bail out block
+  int* bails;
+  int bail_count;
+
+  // offset of the first instruction after the prologue, for tail calls
+  int body;
+
+  // offsets of the blocks that return with the bail out flag in rdx as it is,
+  // and with it set to `JIT_BAIL_DEPTH`
+  int unwind;
+  int too_deep;
+
+  lval* self;
+  lenv* globals;
+} ljit_asm;
+
+void jit_byte(ljit_asm* a, int byte) {
+  if (a->len == a->cap) {
+    a->cap = a->cap ? a->cap * 2 : 256;
+    a->buf = realloc(a->buf, a->cap);
+  }
+
+  a->buf[a->len++] = (unsigned char) byte;
+}
+
+void jit_emit(ljit_asm* a, int count, ...) {
+  va_list bytes;
+  va_start(bytes, count);
+
+  for (int i = 0; i < count; i++) {
+    jit_byte(a, va_arg(bytes, int));
+  }
+
+  va_end(bytes);
+}
+
+void jit_imm64(ljit_asm* a, long imm) {
+  for (int i = 0; i < 8; i++) {
+    jit_byte(a, (imm >> (i * 8)) & 0xff);
+  }
+}
+
+/**
+ * emits a placeholder rel32 operand and returns its offset so it can be
+ * patched once the target is known.
+ */
+int jit_rel32(ljit_asm* a) {
+  int at = a->len;
+  jit_emit(a, 4, 0, 0, 0, 0);
+  return at;
+}
+
+void jit_patch(ljit_asm* a, int at, int target) {
+  int rel = target - (at + 4);
+  memcpy(a->buf + at, &rel, sizeof(int));
+}
+
+void jit_bail_at(ljit_asm* a, int at) {
+  a->bails = realloc(a->bails, sizeof(int) * (a->bail_count + 1));
+  a->bails[a->bail_count++] = at;
+}
+
+int jit_formal(ljit_asm* a, char* sym) {
+  lval* formals = a->self->fun->formals;
+
+  for (int i = 0; i < formals->count; i++) {
+    if (strcmp(formals->cell[i]->sym, sym) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+lval* jit_global(ljit_asm* a, char* sym) {
+  if (lenv_is_local(a->globals->ctx, sym)) {
+    return NULL;
+  }
+
+  for (int i = 0; i < a->globals->count; i++) {
+    if (strcmp(a->globals->syms[i], sym) == 0) {
+      return a->globals->vals[i];
+    }
+  }
+
+  return NULL;
+}
+
+int jit_is_self(ljit_asm* a, lval* func) {
+  return !func->builtin && !func->env && func->fun == a->self->fun;
+}
+
+void jit_compile_sexpr(ljit_asm*, lval*, int);
+
+void jit_compile_expr(ljit_asm* a, lval* expr, int tail) {
+  int index;
+
+  switch (expr->type) {
+    case LVAL_NUM:
+      // mov rax, imm64
+      jit_emit(a, 2, 0x48, 0xb8);
+      jit_imm64(a, expr->num);
+      break;
+
+    case LVAL_SYM:
+      index = jit_formal(a, expr->sym);
+
+      if (index < 0) {
+        a->ok = 0;
+        break;
+      }
+
+      // mov rax, [rbp - 8 * (index + 1)]
+      jit_emit(a, 4, 0x48, 0x8b, 0x45, -8 * (index + 1) & 0xff);
+      break;
+
+    case LVAL_SEXPR:
+      jit_compile_sexpr(a, expr, tail);
+      break;
+
+    default:
+      a->ok = 0;
+      break;
+  }
+}
+
+/**
+ * compiles every operand after the head, leaving the left hand side in `rax`
+ * and the right hand side in `rcx` right before `apply` is emitted for each
+ * pair.
+ */
+void jit_compile_fold(ljit_asm* a, lval* expr, char* op) {
+  jit_compile_expr(a, expr->cell[1], 0);
+
+  for (int i = 2; i < expr->count && a->ok; i++) {
+    jit_byte(a, 0x50);                          // push rax
+    jit_compile_expr(a, expr->cell[i], 0);
+    jit_emit(a, 3, 0x48, 0x89, 0xc1);           // mov rcx, rax
+    jit_byte(a, 0x58);                          // pop rax
+
+    if (strcmp(op, "+") == 0) {
+      jit_emit(a, 3, 0x48, 0x01, 0xc8);         // add rax, rcx
+    } else if (strcmp(op, "-") == 0) {
+      jit_emit(a, 3, 0x48, 0x29, 0xc8);         // sub rax, rcx
+    } else if (strcmp(op, "*") == 0) {
+      jit_emit(a, 4, 0x48, 0x0f, 0xaf, 0xc1);   // imul rax, rcx
+    } else if (strcmp(op, "/") == 0) {
+      jit_emit(a, 3, 0x48, 0x85, 0xc9);         // test rcx, rcx
+      jit_emit(a, 2, 0x0f, 0x84);               // jz bail
+      jit_bail_at(a, jit_rel32(a));
+      jit_emit(a, 4, 0x48, 0x83, 0xf9, 0xff);   // cmp rcx, -1
+      jit_emit(a, 2, 0x75, 0x05);               // jne div
+      jit_emit(a, 3, 0x48, 0xf7, 0xd8);         // neg rax
+      jit_emit(a, 2, 0xeb, 0x05);               // jmp done
+      jit_emit(a, 2, 0x48, 0x99);               // div: cqo
+      jit_emit(a, 3, 0x48, 0xf7, 0xf9);         // idiv rcx
+    }
+  }
+}
+
+void jit_compile_comp(ljit_asm* a, lval* expr, int setcc) {
+  if (expr->count != 3) {
+    a->ok = 0;
+    return;
+  }
+
+  jit_compile_fold(a, expr, "");
+  jit_emit(a, 3, 0x48, 0x39, 0xc8);             // cmp rax, rcx
+  jit_emit(a, 3, 0x0f, setcc, 0xc0);            // setcc al
+  jit_emit(a, 3, 0x0f, 0xb6, 0xc0);             // movzx eax, al
+}
+
+/**
+ * a branch of `if` is either code in a Q-Expression or a plain expression.
+ */
+void jit_compile_branch(ljit_asm* a, lval* branch, int tail) {
+  if (branch->type == LVAL_QEXPR) {
+    jit_compile_sexpr(a, branch, tail);
+  } else {
+    jit_compile_expr(a, branch, tail);
+  }
+}
+
+void jit_compile_if(ljit_asm* a, lval* expr, int tail) {
+  if (expr->count != 4) {
+    a->ok = 0;
+    return;
+  }
+
+  jit_compile_expr(a, expr->cell[1], 0);
+  jit_emit(a, 3, 0x48, 0x85, 0xc0);             // test rax, rax
+  jit_emit(a, 2, 0x0f, 0x84);                   // jz fail
+  int fail = jit_rel32(a);
+
+  jit_compile_branch(a, expr->cell[2], tail);
+  jit_byte(a, 0xe9);                            // jmp done
+  int done = jit_rel32(a);
+
+  jit_patch(a, fail, a->len);
+  jit_compile_branch(a, expr->cell[3], tail);
+  jit_patch(a, done, a->len);
+}
+
+/**
+ * calls in tail position overwrite the argument slots of the current frame and
+ * jump back to the top of the body, so counting loops run in constant stack.
+ * every other call goes through a real `call` and checks the bail out flag in
+ * rdx as soon as it returns. the stack limit, the address of `CALL_DEPTH` and
+ * `max_depth` arrive above the return address, at [rbp + 16], [rbp + 24] and
+ * [rbp + 32]. like `lval_call`, a call counts itself in `CALL_DEPTH` for as
+ * long as it runs, and a call that would go over `max_depth` or below the
+ * stack limit bails out with `JIT_BAIL_DEPTH`, which every native frame above
+ * passes on unchanged.
+ */
+void jit_compile_self(ljit_asm* a, lval* expr, int tail) {
+  // pop rdi, pop rsi, pop rdx, pop rcx, pop r8, pop r9
+  static const int pops[JIT_MAX_ARGS][2] = {
+    {0x5f, 0}, {0x5e, 0}, {0x5a, 0}, {0x59, 0}, {0x41, 0x58}, {0x41, 0x59}
+  };
+
+  int arity = a->self->fun->formals->count;
+
+  if (expr->count - 1 != arity) {
+    a->ok = 0;
+    return;
+  }
+
+  for (int i = 1; i < expr->count && a->ok; i++) {
+    jit_compile_expr(a, expr->cell[i], 0);
+    jit_byte(a, 0x50);                          // push rax
+  }
+
+  if (tail) {
+    for (int i = arity - 1; i >= 0; i--) {
+      jit_byte(a, 0x58);                        // pop rax
+      jit_emit(a, 4, 0x48, 0x89, 0x45, -8 * (i + 1) & 0xff);
+    }
+
+    jit_byte(a, 0xe9);                          // jmp body
+    jit_patch(a, jit_rel32(a), a->body);
+    return;
+  }
+
+  for (int i = arity - 1; i >= 0; i--) {
+    jit_byte(a, pops[i][0]);
+
+    if (pops[i][1]) {
+      jit_byte(a, pops[i][1]);
+    }
+  }
+
+  jit_emit(a, 4, 0x48, 0x8b, 0x45, 0x10);       // mov rax, [rbp + 16]
+  jit_emit(a, 3, 0x48, 0x39, 0xc4);             // cmp rsp, rax
+  jit_emit(a, 2, 0x0f, 0x82);                   // jb too_deep
+  jit_patch(a, jit_rel32(a), a->too_deep);
+
+  jit_emit(a, 4, 0x48, 0x8b, 0x45, 0x18);       // mov rax, [rbp + 24]
+  jit_emit(a, 3, 0x4c, 0x8b, 0x10);             // mov r10, [rax]
+  jit_emit(a, 4, 0x4c, 0x3b, 0x55, 0x20);       // cmp r10, [rbp + 32]
+  jit_emit(a, 2, 0x0f, 0x8d);                   // jge too_deep
+  jit_patch(a, jit_rel32(a), a->too_deep);
+  jit_emit(a, 3, 0x48, 0xff, 0x00);             // inc qword [rax]
+
+  jit_emit(a, 3, 0xff, 0x75, 0x20);             // push qword [rbp + 32]
+  jit_emit(a, 3, 0xff, 0x75, 0x18);             // push qword [rbp + 24]
+  jit_emit(a, 3, 0xff, 0x75, 0x10);             // push qword [rbp + 16]
+
+  jit_byte(a, 0xe8);                            // call self
+  jit_patch(a, jit_rel32(a), 0);
+  jit_emit(a, 4, 0x48, 0x83, 0xc4, 0x18);       // add rsp, 24
+  jit_emit(a, 4, 0x48, 0x8b, 0x4d, 0x18);       // mov rcx, [rbp + 24]
+  jit_emit(a, 3, 0x48, 0xff, 0x09);             // dec qword [rcx]
+
+  jit_emit(a, 3, 0x48, 0x85, 0xd2);             // test rdx, rdx
+  jit_emit(a, 2, 0x0f, 0x85);                   // jnz unwind
+  jit_patch(a, jit_rel32(a), a->unwind);
+}
+
+/**
+ * `expr` may also be one of the Q-Expression branches of an `if`, which the
+ * interpreter evaluates as an S-Expression as well.
+ */
+void jit_compile_sexpr(ljit_asm* a, lval* expr, int tail) {
+  if (expr->count == 0) {
+    a->ok = 0;
+    return;
+  }
+
+  if (expr->count == 1) {
+    jit_compile_expr(a, expr->cell[0], tail);
+    return;
+  }
+
+  lval* head = expr->cell[0];
+
+  if (head->type != LVAL_SYM || jit_formal(a, head->sym) >= 0) {
+    a->ok = 0;
+    return;
+  }
+
+  lval* func = jit_global(a, head->sym);
+
+  if (!func || func->type != LVAL_FUN) {
+    a->ok = 0;
+  } else if (func->builtin == builtin_add) {
+    jit_compile_fold(a, expr, "+");
+  } else if (func->builtin == builtin_sub) {
+    jit_compile_fold(a, expr, "-");
+  } else if (func->builtin == builtin_mul) {
+    jit_compile_fold(a, expr, "*");
+  } else if (func->builtin == builtin_div) {
+    jit_compile_fold(a, expr, "/");
+  } else if (func->builtin == builtin_gt) {
+    jit_compile_comp(a, expr, 0x9f);            // setg
+  } else if (func->builtin == builtin_ge) {
+    jit_compile_comp(a, expr, 0x9d);            // setge
+  } else if (func->builtin == builtin_lt) {
+    jit_compile_comp(a, expr, 0x9c);            // setl
+  } else if (func->builtin == builtin_le) {
+    jit_compile_comp(a, expr, 0x9e);            // setle
+  } else if (func->builtin == builtin_eq) {
+    jit_compile_comp(a, expr, 0x94);            // sete
+  } else if (func->builtin == builtin_ne) {
+    jit_compile_comp(a, expr, 0x95);            // setne
+  } else if (func->builtin == builtin_if) {
+    jit_compile_if(a, expr, tail);
+  } else if (jit_is_self(a, func)) {
+    jit_compile_self(a, expr, tail);
+  } else {
+    a->ok = 0;
+  }
+}
+
+/**
+ * the arguments arrive in rdi, rsi, rdx, rcx, r8 and r9 and get spilled into
+ * the frame right away, at [rbp - 8], [rbp - 16] and so on. every expression
+ * leaves its result in rax.
+ */
+void jit_compile(lenv* globals, lval* func) {
+  // mov [rbp - 8 * (i + 1)], reg for each of the argument registers
+  static const int spills[JIT_MAX_ARGS][2] = {
+    {0x48, 0x7d}, {0x48, 0x75}, {0x48, 0x55},
+    {0x48, 0x4d}, {0x4c, 0x45}, {0x4c, 0x4d}
+  };
+
+  ljit* jit = func->fun->jit;
+  lval* formals = func->fun->formals;
+  int arity = formals->count;
+
+  ljit_stats* stats = &globals->ctx->stats;
+  jit->epoch = globals->ctx->epoch;
+
+  for (int i = 0; i < arity; i++) {
+    if (strcmp(formals->cell[i]->sym, "&") == 0) {
+      arity = JIT_MAX_ARGS + 1;
+      break;
+    }
+  }
+
+  if (arity > JIT_MAX_ARGS) {
+    jit->state = JIT_REJECTED;
+    stats->rejected++;
+    return;
+  }
+
+  ljit_asm a = { NULL, 0, 0, 1, NULL, 0, 0, 0, 0, func, globals };
+
+  jit_byte(&a, 0x55);                           // push rbp
+  jit_emit(&a, 3, 0x48, 0x89, 0xe5);            // mov rbp, rsp
+  jit_emit(&a, 2, 0xeb, 0x09);                  // jmp over the two blocks
+
+  a.too_deep = a.len;
+  jit_emit(&a, 5, 0xba, JIT_BAIL_DEPTH, 0x00, 0x00, 0x00);  // mov edx, 2
+  jit_emit(&a, 2, 0xc9, 0xc3);                  // leave, ret
+
+  a.unwind = a.len;
+  jit_emit(&a, 2, 0xc9, 0xc3);                  // leave, ret
+
+  jit_emit(&a, 4, 0x48, 0x83, 0xec, 0x30);      // sub rsp, 48
+
+  for (int i = 0; i < arity; i++) {
+    jit_emit(&a, 4, spills[i][0], 0x89, spills[i][1], -8 * (i + 1) & 0xff);
+  }
+
+  a.body = a.len;
+  jit_compile_sexpr(&a, func->fun->body, 1);
+  jit_emit(&a, 2, 0x31, 0xd2);                  // xor edx, edx
+  jit_emit(&a, 2, 0xc9, 0xc3);                  // leave, ret
+
+  int bail = a.len;
+  jit_emit(&a, 5, 0xba, JIT_BAIL, 0x00, 0x00, 0x00);  // mov edx, 1
+  jit_emit(&a, 2, 0xc9, 0xc3);                  // leave, ret
+
+  for (int i = 0; i < a.bail_count; i++) {
+    jit_patch(&a, a.bails[i], bail);
+  }
+
+  void* mem = MAP_FAILED;
+
+  if (a.ok) {
+    jit->size = a.len;
+    mem = mmap(NULL, jit->size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+
+  if (mem != MAP_FAILED) {
+    memcpy(mem, a.buf, a.len);
+    mprotect(mem, jit->size, PROT_READ | PROT_EXEC);
+
+    jit->code = (ljit_code) mem;
+    jit->state = JIT_COMPILED;
+    stats->compiled++;
+  } else {
+    jit->size = 0;
+    jit->state = JIT_REJECTED;
+    stats->rejected++;
+  }
+
+  free(a.buf);
+  free(a.bails);
+}
+#else
+void jit_compile(lenv* globals, lval* func) {
+  func->fun->jit->state = JIT_REJECTED;
+  globals->ctx->stats.rejected++;
+}
+#endif
+
+/**
+ * tries to run a fully applied call to `func` as native code. returns `NULL`
+ * whenever the call has to go through the interpreter instead, in which case
+ * `args` is left untouched.
+ */
+lval* jit_call(lenv* env, lval* func, lval* args) {
+  lithp_ctx* ctx = env->ctx;
+  ljit* jit = func->fun->jit;
+
+  if (!ctx->jit || BUDGET) {
+    return NULL;
+  }
+
+  // partially applied functions already have some of their formals bound
+  if (func->env || args->count != func->fun->formals->count) {
+    return NULL;
+  }
+
+  // threads running parallel builtins only ever use code that is ready, the
+  // jit state itself is left alone until we are back on a single thread
+  if (PARALLEL_DEPTH) {
+    if (jit->state != JIT_COMPILED || jit->epoch != ctx->epoch) {
+      return NULL;
+    }
+  } else if (jit->state != JIT_COLD && jit->epoch != ctx->epoch) {
+    jit_reset(jit);
+  }
+
+  if (jit->state == JIT_REJECTED) {
+    return NULL;
+  }
+
+  if (jit->state == JIT_COLD) {
+    if (++jit->calls < JIT_THRESHOLD) {
+      return NULL;
+    }
+
+    while (env->par) env = env->par;
+    jit_compile(env, func);
+
+    if (jit->state != JIT_COMPILED) {
+      return NULL;
+    }
+  }
+
+  long nums[JIT_MAX_ARGS] = { 0 };
+
+  for (int i = 0; i < args->count; i++) {
+    if (args->cell[i]->type != LVAL_NUM) {
+      LREF_INC(ctx->stats.guards);
+      return NULL;
+    }
+
+    nums[i] = args->cell[i]->num;
+  }
+
+  ljit_result result = jit->code(nums[0], nums[1], nums[2], nums[3], nums[4],
+    nums[5], STACK_LIMIT, &CALL_DEPTH, ctx->max_depth);
+
+  if (result.bail == JIT_BAIL_DEPTH) {
+    lval_del(args);
+    return lval_err("Maximum recursion depth exceeded in native code.");
+  }
+
+  if (result.bail) {
+    LREF_INC(ctx->stats.bailouts);
+    return NULL;
+  }
+
+  LREF_INC(ctx->stats.native);
+  lval_del(args);
+
+  return lval_num(result.value);
+}
+
+lval* builtin_jit_stats(lenv* env, lval* args) {
+  LASSERT_ARG_COUNT(args, "jit-stats", 0);
+  lval_del(args);
+
+  lithp_ctx* ctx = env->ctx;
+  lval* stats = lval_qexpr();
+
+  lval_add(stats, lval_sym("enabled"));
+  lval_add(stats, lval_num(ctx->jit));
+  lval_add(stats, lval_sym("compiled"));
+  lval_add(stats, lval_num(ctx->stats.compiled));
+  lval_add(stats, lval_sym("rejected"));
+  lval_add(stats, lval_num(ctx->stats.rejected));
+  lval_add(stats, lval_sym("native-calls"));
+  lval_add(stats, lval_num(ctx->stats.native));
+  lval_add(stats, lval_sym("guard-failures"));
+  lval_add(stats, lval_num(ctx->stats.guards));
+  lval_add(stats, lval_sym("bailouts"));
+  lval_add(stats, lval_num(ctx->stats.bailouts));
+
+  return stats;
+}
+
+/**
+ * `dedup-percent` is how many of the strings and symbols looked up in the
+ * table were already in it, and `bytes-saved` how much memory they would
+ * have taken up otherwise. the `list-` ones are the same for Q-Expressions,
+ * where what's saved is their cells and the values in them.
+ */
+lval* builtin_intern_stats(lenv* env, lval* args) {
+  LASSERT_ARG_COUNT(args, "intern-stats", 0);
+  lval_del(args);
+
+  lstrtab* tab = &env->ctx->strings;
+  lval* stats = lval_qexpr();
+
+  pthread_mutex_lock(&tab->lock);
+
+  lval_add(stats, lval_sym("enabled"));
+  lval_add(stats, lval_num(env->ctx->hashcons));
+  lval_add(stats, lval_sym("lookups"));
+  lval_add(stats, lval_num(tab->lookups));
+  lval_add(stats, lval_sym("shared"));
+  lval_add(stats, lval_num(tab->hits));
+  lval_add(stats, lval_sym("unique"));
+  lval_add(stats, lval_num(tab->count));
+  lval_add(stats, lval_sym("dedup-percent"));
+  lval_add(stats, lval_num(tab->lookups ? tab->hits * 100 / tab->lookups : 0));
+  lval_add(stats, lval_sym("bytes-saved"));
+  lval_add(stats, lval_num(tab->saved));
+
+  pthread_mutex_unlock(&tab->lock);
+
+  lcellstab* lists = &env->ctx->lists;
+
+  pthread_mutex_lock(&lists->lock);
+
+  lval_add(stats, lval_sym("list-lookups"));
+  lval_add(stats, lval_num(lists->lookups));
+  lval_add(stats, lval_sym("list-shared"));
+  lval_add(stats, lval_num(lists->hits));
+  lval_add(stats, lval_sym("list-unique"));
+  lval_add(stats, lval_num(lists->count));
+  lval_add(stats, lval_sym("list-dedup-percent"));
+  lval_add(stats,
+    lval_num(lists->lookups ? lists->hits * 100 / lists->lookups : 0));
+  lval_add(stats, lval_sym("list-bytes-saved"));
+  lval_add(stats, lval_num(lists->saved));
+
+  pthread_mutex_unlock(&lists->lock);
+
+  return stats;
+}
+
+/**
+ * a call only lives for as long as the C call to `lval_call`, so instead of
+ * allocating a new environment every time, frames are taken from and handed
+ * back to a small stack of environments that have been used before and whose
+ * arrays already have room for the formals. every thread has its own stack.
+ */
+#define FRAME_POOL_SIZE 256
+
+_Thread_local lenv* FRAME_POOL[FRAME_POOL_SIZE];
+_Thread_local int FRAME_POOL_COUNT = 0;
+
+lenv* lenv_frame(lenv* par, int size) {
+  lenv* frame = FRAME_POOL_COUNT ? FRAME_POOL[--FRAME_POOL_COUNT]
+    : lenv_new(par->ctx);
+
+  if (frame->cap < size) {
+    lenv_grow(frame, size);
+  }
+
+  frame->ctx = par->ctx;
+  frame->par = par;
+  return frame;
+}
+
+void lenv_frame_del(lenv* frame) {
+  for (int i = 0; i < frame->count; i++) {
+    lenv_name_free(frame->syms[i]);
+
+    if (i >= frame->borrowed) {
+      lval_del(frame->vals[i]);
+    }
+  }
+
+  frame->count = 0;
+  frame->borrowed = 0;
+  frame->par = NULL;
+
+  if (FRAME_POOL_COUNT < FRAME_POOL_SIZE) {
+    FRAME_POOL[FRAME_POOL_COUNT++] = frame;
+  } else {
+    lenv_del(frame);
+  }
+}
+
+/**
+ * frees the frames the current thread kept for later, before it exits.
+ */
+void lenv_frame_drain(void) {
+  while (FRAME_POOL_COUNT) {
+    lenv_del(FRAME_POOL[--FRAME_POOL_COUNT]);
+  }
+}
+
+/**
+ * we need to write the code that runs when an expression gets evaluated and a
+ * function `lval` is called. when this function type is a builtin we can call
+ * it as before, using the function pointer, but we need to do something
+ * separate for our user defined functions. functions are never modified by a
+ * call. instead we take a new frame, whose parent is the calling environment,
+ * and bind any arguments from an earlier partial application followed by each
+ * of the arguments passed in to the symbols in `formals`. the earlier
+ * arguments are only borrowed from the function, which outlives the call.
+ * once every formal is bound we evaluate the `body` in that frame. if some are
+ * still missing the frame is kept as the environment of a new, partially
+ * applied, function.
+ */
+lval* lval_call_lambda(lenv* env, lval* func, lval* args) {
+  lval* compiled = jit_call(env, func, args);
+
+  if (compiled) {
+    return compiled;
+  }
+
+  lval* formals = func->fun->formals;
+  int bound = func->env ? func->env->count : 0;
+  int given = args->count;
+  int total = formals->count - bound;
+  int next = bound;
+
+  lenv* frame = lenv_frame(env, formals->count);
+
+  for (int i = 0; i < bound; i++) {
+    lenv_bind(frame, formals->cell[i], func->env->vals[i]);
+  }
+
+  frame->borrowed = bound;
+
+  while (args->count) {
+    // if we've ran out of formal arguments to bind
+    if (next == formals->count) {
+      lval_del(args);
+      lenv_frame_del(frame);
+
+      return lval_err("Function passed too many arguments. Got %i but expected %i",
+        given, total);
+    }
+
+    lval* sym = formals->cell[next++];
+
+    if (strcmp(sym->sym, "&") == 0) {
+      // ensure '&' is followed b another sybol
+      if (next != formals->count - 1) {
+        lval_del(args);
+        lenv_frame_del(frame);
+        return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
+      }
+
+      // next formal should be ound o remaning arguments
+      lenv_bind(frame, formals->cell[next++], builtin_list(env, args));
+      args = NULL;
+
+      break;
+    }
+
+    // the argument moves into the frame, no copy needed
+    lenv_bind(frame, sym, lval_pop(args, 0));
+  }
+
+  // arguments list is now bound so we can clean up
+  if (args) {
+    lval_del(args);
+  }
+
+  // if '&' remains in formal list bind to empty list
+  if (
+    next < formals->count &&
+    strcmp(formals->cell[next]->sym, "&") == 0
+  ) {
+    // check to ensure that '&' is not passed invalidly
+    if (next != formals->count - 2) {
+      lenv_frame_del(frame);
+      return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
+    }
+
+    lenv_bind(frame, formals->cell[next + 1], lval_qexpr());
+    next += 2;
+  }
+
+  if (next == formals->count) {
+    // if all formals have been bond, evaluate and return
+    lfunc* fun = func->fun;
+    lval* result = lval_eval_body(frame, fun->code ? fun->code : fun->body);
+    lenv_frame_del(frame);
+
+    return result;
+  }
+
+  // otherwise return partially evaluated function, which has to own every
+  // value in its environment
+  lenv_unshare(frame);
+  lval* partial = lval_alloc();
+
+  partial->type = LVAL_FUN;
+  partial->builtin = NULL;
+  partial->special = NULL;
+  partial->nullary = 0;
+  partial->fun = func->fun;
+  LREF_INC(partial->fun->refs);
+  partial->env = frame;
+  frame->par = NULL;
+
+  return partial;
+}
+
+/**
+ * records the time a call to a lambda took along with its end.
+ */
+lval* ltrace_call(lenv* env, lval* func, lval* args) {
+  uint64_t start = ltrace_record(TRACE, LTRACE_ENTER,
+    (uintptr_t) func->fun, args->count, NULL);
+
+  CALL_DEPTH++;
+  lval* result = lval_call_lambda(env, func, args);
+  CALL_DEPTH--;
+
+  LTRACE(LTRACE_LEAVE, func->fun, ltrace_now() - start, NULL);
+
+  return result;
+}
+
+/**
+ * builtins run straight away. a lambda is refused once the calls it would be
+ * nested in reach `max_depth`, or run out of stack, see `CALL_DEPTH`.
+ */
+lval* lval_call(lenv* env, lval* func, lval* args) {
+  if (func->builtin) {
+    LTRACE(LTRACE_BUILTIN, func->builtin, args->count, NULL);
+    lval* result = func->builtin(env, args);
+
+    return func->builtin == builtin_recur ? result : lrecur_escape(result);
+  }
+
+  char here;
+
+  if (
+    CALL_DEPTH >= env->ctx->max_depth ||
+    (uintptr_t) &here < (uintptr_t) STACK_LIMIT
+  ) {
+    lval_del(args);
+    return lval_err("Maximum recursion depth exceeded after %li nested calls.",
+      CALL_DEPTH);
+  }
+
+  if (TRACE) {
+    return lrecur_escape(ltrace_call(env, func, args));
+  }
+
+  CALL_DEPTH++;
+  lval* result = lval_call_lambda(env, func, args);
+  CALL_DEPTH--;
+
+  return lrecur_escape(result);
+}
+
+/**
+ * `pmap`, `pfilter` and `preduce` spread the elements of a Q-Expression over a
+ * pool of threads. the list is cut into at most `PARALLEL_CHUNKS` chunks, and
+ * how it is cut only depends on its length, never on the number of threads,
+ * so results always come out the same and in order. every thread starts with
+ * a contiguous run of chunks in its own deque, works through it from the
+ * bottom, and once it runs dry steals chunks from the top of the others. the
+ * calling thread takes part as worker number zero.
+ *
+ * while a job runs the calling thread is blocked, so the environment the
+ * builtin was called from, and everything above it up to the global
+ * environment, is frozen. each worker evaluates in its own environment whose
+ * parent is that frozen one, and defining globals from inside a job is an
+ * error. a parallel builtin used from inside another job simply runs on the
+ * current thread. every context has a pool of its own. workers get stacks
+ * of `POOL_STACK_SIZE` bytes, so they know where theirs ends.
+ */
+#define PARALLEL_CHUNKS 256
+#define POOL_STACK_SIZE (8 * 1024 * 1024)
+
+typedef struct ljob ljob;
+
+struct ljob {
+  void (*run)(ljob*, lenv*, int);
+  lenv* env;
+  lval* func;
+  lval* init;
+  lval** items;
+  lval** results;
+  int count;
+  int chunks;
+  lbudget* budget;
+};
+
+typedef struct {
+  pthread_mutex_t lock;
+  int chunks[PARALLEL_CHUNKS];
+  int top;
+  int bottom;
+} ldeque;
+
+typedef struct {
+  lpool* pool;
+  int id;
+  pthread_t thread;
+} lworker;
+
+struct lpool {
+  int size;
+  ldeque* deques;
+  lworker* workers;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  ljob* job;
+  long generation;
+  int active;
+  int stop;
+};
+
+int ldeque_pop(ldeque* deque) {
+  int chunk = -1;
+
+  pthread_mutex_lock(&deque->lock);
+
+  if (deque->bottom > deque->top) {
+    chunk = deque->chunks[--deque->bottom];
+  }
+
+  pthread_mutex_unlock(&deque->lock);
+  return chunk;
+}
+
+int ldeque_steal(ldeque* deque) {
+  int chunk = -1;
+
+  pthread_mutex_lock(&deque->lock);
+
+  if (deque->bottom > deque->top) {
+    chunk = deque->chunks[deque->top++];
+  }
+
+  pthread_mutex_unlock(&deque->lock);
+  return chunk;
+}
+
+void lpool_work(lpool* pool, ljob* job, int id) {
+  int size = pool ? pool->size : 1;
+  lenv* env = lenv_new(job->env->ctx);
+  env->par = job->env;
+
+  ltrace* outer = TRACE;
+  lbudget* budget = BUDGET;
+  TRACE = job->env->ctx->trace;
+  lbudget_switch(job->budget);
+  PARALLEL_DEPTH++;
+
+  if (!pool) {
+    for (int chunk = 0; chunk < job->chunks; chunk++) {
+      job->run(job, env, chunk);
+    }
+  }
+
+  while (pool) {
+    int chunk = ldeque_pop(&pool->deques[id]);
+
+    for (int i = 1; chunk < 0 && i < size; i++) {
+      chunk = ldeque_steal(&pool->deques[(id + i) % size]);
+    }
+
+    if (chunk < 0) {
+      break;
+    }
+
+    job->run(job, env, chunk);
+  }
+
+  PARALLEL_DEPTH--;
+  TRACE = outer;
+  lbudget_switch(budget);
+  lenv_del(env);
+}
+
+void* lpool_thread(void* arg) {
+  lworker* worker = arg;
+  lpool* pool = worker->pool;
+  long seen = 0;
+
+  char here;
+  STACK_LIMIT = (char*) ((uintptr_t) &here - POOL_STACK_SIZE + STACK_MARGIN);
+
+  pthread_mutex_lock(&pool->lock);
+
+  while (!pool->stop) {
+    if (pool->generation == seen) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+      continue;
+    }
+
+    seen = pool->generation;
+    ljob* job = pool->job;
+
+    // the job may already be over by the time we wake up
+    if (!job) {
+      continue;
+    }
+
+    pool->active++;
+    pthread_mutex_unlock(&pool->lock);
+
+    lpool_work(pool, job, worker->id);
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (--pool->active == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+  lenv_frame_drain();
+  return NULL;
+}
+
+/**
+ * the pool is only started the first time a parallel builtin is used. with a
+ * single thread there is no pool at all and jobs run inline.
+ */
+lpool* lpool_get(lithp_ctx* ctx) {
+  if (ctx->pool) {
+    return ctx->pool;
+  }
+
+  int size = ctx->threads ? ctx->threads : (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (size <= 1) {
+    return NULL;
+  }
+
+  lpool* pool = malloc(sizeof(lpool));
+  pool->size = size;
+  pool->deques = malloc(sizeof(ldeque) * size);
+  pool->workers = malloc(sizeof(lworker) * size);
+  pool->job = NULL;
+  pool->generation = 0;
+  pool->active = 0;
+  pool->stop = 0;
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  for (int i = 0; i < size; i++) {
+    pthread_mutex_init(&pool->deques[i].lock, NULL);
+    pool->deques[i].top = 0;
+    pool->deques[i].bottom = 0;
+  }
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, POOL_STACK_SIZE);
+
+  for (int i = 1; i < size; i++) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].id = i;
+    pthread_create(&pool->workers[i].thread, &attr, lpool_thread,
+      &pool->workers[i]);
+  }
+
+  pthread_attr_destroy(&attr);
+
+  ctx->pool = pool;
+  return pool;
+}
+
+void lpool_del(lpool* pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 1; i < pool->size; i++) {
+    pthread_join(pool->workers[i].thread, NULL);
+  }
+
+  for (int i = 0; i < pool->size; i++) {
+    pthread_mutex_destroy(&pool->deques[i].lock);
+  }
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->done);
+
+  free(pool->deques);
+  free(pool->workers);
+  free(pool);
+}
+
+void lpool_run(ljob* job) {
+  if (!PARALLEL_DEPTH) {
+    ldefer_force_all(job->env->ctx);
+  }
+
+  job->budget = BUDGET;
+
+  lpool* pool = PARALLEL_DEPTH ? NULL : lpool_get(job->env->ctx);
+
+  if (!pool) {
+    lpool_work(NULL, job, 0);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+
+  for (int i = 0; i < pool->size; i++) {
+    ldeque* deque = &pool->deques[i];
+
+    pthread_mutex_lock(&deque->lock);
+    deque->top = 0;
+    deque->bottom = 0;
+
+    for (int c = i * job->chunks / pool->size;
+      c < (i + 1) * job->chunks / pool->size; c++) {
+      deque->chunks[deque->bottom++] = c;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+  }
+
+  pool->job = job;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  lpool_work(pool, job, 0);
+
+  // every deque is empty by now, so all that's left are chunks that other
+  // workers are still busy with
+  pthread_mutex_lock(&pool->lock);
+
+  while (pool->active > 0) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+
+  pool->job = NULL;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+int ljob_start(ljob* job, int chunk) {
+  return (int) ((long) chunk * job->count / job->chunks);
+}
+
+void pmap_chunk(ljob* job, lenv* env, int chunk) {
+  for (int i = ljob_start(job, chunk); i < ljob_start(job, chunk + 1); i++) {
+    lval* args = lval_add(lval_sexpr(), job->items[i]);
+    job->items[i] = NULL;
+    job->results[i] = lval_call(env, job->func, args);
+  }
+}
+
+void pfilter_chunk(ljob* job, lenv* env, int chunk) {
+  for (int i = ljob_start(job, chunk); i < ljob_start(job, chunk + 1); i++) {
+    lval* args = lval_add(lval_sexpr(), lval_copy(job->items[i]));
+    job->results[i] = lval_call(env, job->func, args);
+  }
+}
+
+void preduce_chunk(ljob* job, lenv* env, int chunk) {
+  lval* acc = lval_copy(job->init);
+
+  for (int i = ljob_start(job, chunk); i < ljob_start(job, chunk + 1); i++) {
+    if (acc->type == LVAL_ERR) {
+      break;
+    }
+
+    lval* args = lval_add(lval_add(lval_sexpr(), acc), job->items[i]);
+    job->items[i] = NULL;
+    acc = lval_call(env, job->func, args);
+  }
+
+  job->results[chunk] = acc;
+}
+
+/**
+ * runs `run` over the elements of `list`, which has to be the last argument in
+ * `args`. the elements are handed over to the job, and any it didn't use up
+ * are deleted afterwards. returns the array of results, one for each element
+ * or each chunk, which the caller has to free.
+ */
+lval** parallel_run(lenv* env, lval* args, void (*run)(ljob*, lenv*, int)) {
+  lval* list = args->cell[args->count - 1];
+  int chunks = list->count < PARALLEL_CHUNKS ? list->count : PARALLEL_CHUNKS;
+
+  lval_unshare(list);
+
+  ljob job = {
+    run, env, args->cell[0], args->count > 2 ? args->cell[1] : NULL,
+    list->cell, malloc(sizeof(lval*) * (list->count + 1)), list->count, chunks,
+    NULL
+  };
+
+  lpool_run(&job);
+
+  for (int i = 0; i < list->count; i++) {
+    if (run != pfilter_chunk && job.items[i]) {
+      lval_del(job.items[i]);
+    }
+  }
+
+  if (run != pfilter_chunk) {
+    lval_resize(list, 0);
+  }
+
+  return job.results;
+}
+
+/**
+ * the first error in a list of results, in order, wins. everything else gets
+ * deleted.
+ */
+lval* parallel_error(lval** results, int count) {
+  lval* err = NULL;
+
+  for (int i = 0; i < count; i++) {
+    if (!err && results[i]->type == LVAL_ERR) {
+      err = results[i];
+    } else {
+      lval_del(results[i]);
+    }
+  }
+
+  free(results);
+  return err;
+}
+
+int parallel_has_error(lval** results, int count) {
+  for (int i = 0; i < count; i++) {
+    if (results[i]->type == LVAL_ERR) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+lval* builtin_pmap(lenv* env, lval* args) {
+  LREALIZE(env, args);
+  LASSERT_ARG_COUNT(args, "pmap", 2);
+  LASSERT_ARG_TYPE_AT(args, "pmap", LVAL_FUN, 0);
+  LASSERT_ARG_TYPE_AT(args, "pmap", LVAL_QEXPR, 1);
+
+  int count = args->cell[1]->count;
+  lval** results = parallel_run(env, args, pmap_chunk);
+  lval_del(args);
+
+  if (parallel_has_error(results, count)) {
+    return parallel_error(results, count);
+  }
+
+  lval* mapped = lval_qexpr();
+  HEAP += sizeof(lval*) * count;
+  mapped->count = count;
+  mapped->cell = results;
+
+  return mapped;
+}
+
+lval* builtin_pfilter(lenv* env, lval* args) {
+  LREALIZE(env, args);
+  LASSERT_ARG_COUNT(args, "pfilter", 2);
+  LASSERT_ARG_TYPE_AT(args, "pfilter", LVAL_FUN, 0);
+  LASSERT_ARG_TYPE_AT(args, "pfilter", LVAL_QEXPR, 1);
+
+  lval* list = args->cell[1];
+  lval** results = parallel_run(env, args, pfilter_chunk);
+
+  for (int i = 0; i < list->count; i++) {
+    if (results[i]->type != LVAL_ERR && results[i]->type != LVAL_NUM) {
+      lval* err = lval_err("Function 'pfilter' expects its predicate to return a %s but got (a/an) %s at index %i instead.",
+        ltype_name(LVAL_NUM), ltype_name(results[i]->type), i);
+
+      parallel_error(results, list->count);
+      lval_del(args);
+      return err;
+    }
+  }
+
+  if (parallel_has_error(results, list->count)) {
+    lval* err = parallel_error(results, list->count);
+    lval_del(args);
+    return err;
+  }
+
+  lval* kept = lval_qexpr();
+
+  for (int i = 0; i < list->count; i++) {
+    if (results[i]->num) {
+      lval_add(kept, list->cell[i]);
+      list->cell[i] = NULL;
+    }
+  }
+
+  for (int i = 0; i < list->count; i++) {
+    if (list->cell[i]) {
+      lval_del(list->cell[i]);
+    }
+
+    lval_del(results[i]);
+  }
+
+  lval_resize(list, 0);
+  free(results);
+  lval_del(args);
+
+  return kept;
+}
+
+/**
+ * every chunk is folded, starting from `z`, on its own, and the results of the
+ * chunks are then combined pairwise, level by level, like a balanced tree. so
+ * `f` needs to be associative and `z` an identity of it for the result to
+ * match `foldl`.
+ */
+lval* builtin_preduce(lenv* env, lval* args) {
+  LREALIZE(env, args);
+  LASSERT_ARG_COUNT(args, "preduce", 3);
+  LASSERT_ARG_TYPE_AT(args, "preduce", LVAL_FUN, 0);
+  LASSERT_ARG_TYPE_AT(args, "preduce", LVAL_QEXPR, 2);
+
+  int count = args->cell[2]->count;
+  int chunks = count < PARALLEL_CHUNKS ? count : PARALLEL_CHUNKS;
+
+  if (chunks == 0) {
+    return lval_take(args, 1);
+  }
+
+  lval** results = parallel_run(env, args, preduce_chunk);
+
+  if (parallel_has_error(results, chunks)) {
+    lval_del(args);
+    return parallel_error(results, chunks);
+  }
+
+  while (chunks > 1) {
+    int half = 0;
+
+    for (int i = 0; i < chunks; i += 2) {
+      if (i + 1 == chunks) {
+        results[half++] = results[i];
+        continue;
+      }
+
+      lval* pair = lval_add(lval_add(lval_sexpr(), results[i]), results[i + 1]);
+      results[half++] = lval_call(env, args->cell[0], pair);
+    }
+
+    chunks = half;
+
+    if (parallel_has_error(results, chunks)) {
+      lval_del(args);
+      return parallel_error(results, chunks);
+    }
+  }
+
+  lval* result = results[0];
+  free(results);
+  lval_del(args);
+
+  return result;
+}
+
+/**
+ * `spawn`, `yield`, `chan`, `send` and `recv` give every context cooperative
+ * coroutines. `(spawn f)` queues a call to `f`, with no arguments, which runs
+ * on a stack of its own. coroutines switch whenever one of them yields, or
+ * has to wait on a channel, and they always switch through the root. when the
+ * root yields every queued coroutine gets to run once, when it has to wait on
+ * a channel they run until it can carry on, and once a file has been
+ * loaded, or a line of the REPL evaluated, they run until none of them can
+ * make any more progress.
+ *
+ * a coroutine can outlive the expression that spawned it, and with it every
+ * frame above it, so coroutines are always called from the global
+ * environment. none of this can be used from inside a parallel job.
+ */
+void lqueue_push(lqueue* queue, ltask* task) {
+  task->next = NULL;
+
+  if (queue->tail) {
+    queue->tail->next = task;
+  } else {
+    queue->head = task;
+  }
+
+  queue->tail = task;
+}
+
+ltask* lqueue_pop(lqueue* queue) {
+  ltask* task = queue->head;
+
+  if (task) {
+    queue->head = task->next;
+
+    if (!queue->head) {
+      queue->tail = NULL;
+    }
+  }
+
+  return task;
+}
+
+void lqueue_remove(lqueue* queue, ltask* task) {
+  ltask* prev = NULL;
+
+  for (ltask* it = queue->head; it; prev = it, it = it->next) {
+    if (it == task) {
+      if (prev) {
+        prev->next = it->next;
+      } else {
+        queue->head = it->next;
+      }
+
+      if (queue->tail == it) {
+        queue->tail = prev;
+      }
+
+      return;
+    }
+  }
+}
+
+/**
+ * stacks are only reserved, so a coroutine costs as much memory as it has
+ * actually touched. the lowest page is a guard page, which turns running off
+ * the end of the stack into a crash instead of silent corruption.
+ */
+void* lsched_stack(lsched* sched) {
+  if (sched->stack_count) {
+    return sched->stacks[--sched->stack_count];
+  }
+
+  void* stack = mmap(NULL, COROUTINE_STACK_SIZE, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (stack == MAP_FAILED) {
+    return NULL;
+  }
+
+  mprotect(stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+  return stack;
+}
+
+void lsched_free(lsched* sched, ltask* task) {
+  if (sched->stack_count < COROUTINE_STACK_POOL) {
+    sched->stacks[sched->stack_count++] = task->stack;
+  } else {
+    munmap(task->stack, COROUTINE_STACK_SIZE);
+  }
+
+  lval_del(task->func);
+  free(task);
+}
+
+void ltask_main(unsigned int hi, unsigned int lo) {
+  ltask* task = (ltask*) (((uintptr_t) hi << 32) | lo);
+  lval* result = lval_call(task->ctx->env, task->func, lval_sexpr());
+
+  if (result->type == LVAL_ERR) {
+    lithp_print(task->ctx, result);
+  }
+
+  lval_del(result);
+
+  // returning switches back to the root through `uc_link`, which then frees
+  // the task
+  task->blocked = -1;
+}
+
+int lsched_in_root(lsched* sched) {
+  return !sched->current || sched->current == &sched->root;
+}
+
+void lsched_switch(lsched* sched, ltask* task) {
+  ltask* root = &sched->root;
+
+  root->depth = CALL_DEPTH;
+  root->limit = STACK_LIMIT;
+  root->budget = BUDGET;
+  CALL_DEPTH = task->depth;
+  STACK_LIMIT = task->limit;
+  lbudget_switch(task->budget ? task->budget : root->budget);
+
+  sched->current = task;
+  swapcontext(&root->context, &task->context);
+  sched->current = root;
+
+  task->depth = CALL_DEPTH;
+  task->budget = BUDGET != root->budget ? BUDGET : NULL;
+  CALL_DEPTH = root->depth;
+  STACK_LIMIT = root->limit;
+  lbudget_switch(root->budget);
+
+  if (task->blocked < 0) {
+    lsched_free(sched, task);
+  }
+}
+
+/**
+ * runs every coroutine that is ready right now exactly once, or with `drain`
+ * set, keeps going until the run queue is empty.
+ */
+void lsched_run(lsched* sched, int drain) {
+  ltask* last = sched->ready.tail;
+  ltask* task;
+
+  while ((task = lqueue_pop(&sched->ready))) {
+    lsched_switch(sched, task);
+
+    if (task == last && !drain) {
+      break;
+    }
+  }
+}
+
+void lsched_drain(lithp_ctx* ctx) {
+  if (!PARALLEL_DEPTH && lsched_in_root(&ctx->sched)) {
+    lsched_run(&ctx->sched, 1);
+  }
+}
+
+void lsched_yield(lsched* sched) {
+  if (lsched_in_root(sched)) {
+    lsched_run(sched, 0);
+    return;
+  }
+
+  ltask* task = sched->current;
+  lqueue_push(&sched->ready, task);
+  swapcontext(&task->context, &sched->root.context);
+}
+
+/**
+ * parks the current coroutine on `wait` until `lsched_wake` picks it. returns
+ * 0 when the root would have to wait while nothing else is left to run, which
+ * means nothing ever could wake it.
+ */
+int lsched_block(lsched* sched, lqueue* wait) {
+  if (!lsched_in_root(sched)) {
+    ltask* task = sched->current;
+    task->blocked = 1;
+    lqueue_push(wait, task);
+    swapcontext(&task->context, &sched->root.context);
+    return 1;
+  }
+
+  ltask* root = &sched->root;
+  ltask* task;
+
+  root->blocked = 1;
+  lqueue_push(wait, root);
+
+  while (root->blocked && (task = lqueue_pop(&sched->ready))) {
+    lsched_switch(sched, task);
+  }
+
+  if (root->blocked) {
+    root->blocked = 0;
+    lqueue_remove(wait, root);
+    return 0;
+  }
+
+  return 1;
+}
+
+void lsched_wake(lsched* sched, lqueue* wait) {
+  ltask* task = lqueue_pop(wait);
+
+  if (!task) {
+    return;
+  }
+
+  task->blocked = 0;
+
+  if (task != &sched->root) {
+    lqueue_push(&sched->ready, task);
+  }
+}
+
+/**
+ * coroutines that are still waiting on a channel when their context goes away
+ * are never resumed, so their stacks, and whatever they held on to, leak.
+ */
+void lsched_del(lsched* sched) {
+  ltask* task;
+
+  while ((task = lqueue_pop(&sched->ready))) {
+    lsched_free(sched, task);
+  }
+
+  while (sched->stack_count) {
+    munmap(sched->stacks[--sched->stack_count], COROUTINE_STACK_SIZE);
+  }
+}
+
+void lchan_release(lchan* chan) {
+  if (LREF_DEC(chan->refs) == 0) {
+    for (int i = 0; i < chan->count; i++) {
+      lval_del(chan->items[(chan->head + i) % chan->cap]);
+    }
+
+    free(chan->items);
+    free(chan);
+  }
+}
+
+lval* builtin_spawn(lenv* env, lval* args) {
+  LASSERT_ARG_COUNT(args, "spawn", 1);
+  LASSERT_ARG_TYPE_AT(args, "spawn", LVAL_FUN, 0);
+  LASSERT(args, !PARALLEL_DEPTH,
+    "Function 'spawn' cannot be used from inside a parallel job.");
+  LASSERT(args, !args->cell[0]->builtin || args->cell[0]->nullary,
+    "Function 'spawn' cannot call a builtin without any arguments.");
+
+  lsched* sched = &env->ctx->sched;
+  void* stack = lsched_stack(sched);
+
+  LASSERT(args, stack, "Function 'spawn' could not allocate a stack.");
+
+  ltask* task = malloc(sizeof(ltask));
+  uintptr_t self = (uintptr_t) task;
+
+  task->ctx = env->ctx;
+  task->func = lval_pop(args, 0);
+  task->stack = stack;
+  task->blocked = 0;
+  task->depth = 0;
+  task->limit = (char*) stack + STACK_MARGIN;
+  task->budget = NULL;
+
+  getcontext(&task->context);
+  task->context.uc_stack.ss_sp = stack;
+  task->context.uc_stack.ss_size = COROUTINE_STACK_SIZE;
+  task->context.uc_link = &sched->root.context;
+  makecontext(&task->context, (void (*)(void)) ltask_main, 2,
+    (unsigned int) (self >> 32), (unsigned int) self);
+
+  lqueue_push(&sched->ready, task);
+  lval_del(args);
+
+  return lval_num(++sched->spawned);
+}
+
+lval* builtin_yield(lenv* env, lval* args) {
+  LASSERT_ARG_COUNT(args, "yield", 0);
+  LASSERT(args, !PARALLEL_DEPTH,
+    "Function 'yield' cannot be used from inside a parallel job.");
+
+  lsched_yield(&env->ctx->sched);
+  lval_del(args);
+
+  return lval_sexpr();
+}
+
+lval* builtin_chan(lenv* env, lval* args) {
+  UNUSED(env);
+
+  LASSERT_ARG_COUNT(args, "chan", 1);
+  LASSERT_ARG_TYPE_AT(args, "chan", LVAL_NUM, 0);
+  LASSERT(args, args->cell[0]->num > 0,
+    "Function 'chan' expects a capacity of at least 1 but got %li.",
+      args->cell[0]->num);
+
+  lchan* chan = calloc(1, sizeof(lchan));
+  chan->refs = 1;
+  chan->cap = args->cell[0]->num;
+  chan->items = malloc(sizeof(lval*) * chan->cap);
+
+  lval* val = lval_alloc();
+  val->type = LVAL_CHAN;
+  val->chan = chan;
+
+  lval_del(args);
+  return val;
+}
+
+lval* builtin_send(lenv* env, lval* args) {
+  LASSERT_ARG_COUNT(args, "send", 2);
+  LASSERT_ARG_TYPE_AT(args, "send", LVAL_CHAN, 0);
+  LASSERT(args, !PARALLEL_DEPTH,
+    "Function 'send' cannot be used from inside a parallel job.");
+
+  lsched* sched = &env->ctx->sched;
+  lchan* chan = args->cell[0]->chan;
+
+  while (chan->count == chan->cap) {
+    LASSERT(args, lsched_block(sched, &chan->senders),
+      "Function 'send' would block forever, every coroutine is waiting.");
+  }
+
+  chan->items[(chan->head + chan->count++) % chan->cap] = lval_pop(args, 1);
+  lsched_wake(sched, &chan->receivers);
+  lval_del(args);
+
+  return lval_sexpr();
+}
+
+lval* builtin_recv(lenv* env, lval* args) {
+  LASSERT_ARG_COUNT(args, "recv", 1);
+  LASSERT_ARG_TYPE_AT(args, "recv", LVAL_CHAN, 0);
+  LASSERT(args, !PARALLEL_DEPTH,
+    "Function 'recv' cannot be used from inside a parallel job.");
+
+  lsched* sched = &env->ctx->sched;
+  lchan* chan = args->cell[0]->chan;
+
+  while (chan->count == 0) {
+    LASSERT(args, lsched_block(sched, &chan->receivers),
+      "Function 'recv' would block forever, every coroutine is waiting.");
+  }
+
+  lval* val = chan->items[chan->head];
+  chan->head = (chan->head + 1) % chan->cap;
+  chan->count--;
+
+  lsched_wake(sched, &chan->senders);
+  lval_del(args);
+
+  return val;
+}
+
+/**
+ * lazy sequences are built by `range`, `iterate`, `lazy-map`, `lazy-filter`
+ * and `take-while`, and nothing gets computed until they are consumed by
+ * `fold` or `realize`. a chain of them keeps only one element alive at a
+ * time, so `(fold + 0 (range 10000000))` runs in constant memory. builtins
+ * that expect a Q-Expression realize a sequence passed to them first, which
+ * is refused for sequences that never end.
+ */
+lval* lval_seq(lseq_kind kind, lval* func, lval* source) {
+  lseq* seq = calloc(1, sizeof(lseq));
+  seq->refs = 1;
+  seq->kind = kind;
+  seq->func = func;
+  seq->source = source;
+  seq->infinite = kind == LSEQ_ITERATE || (
+    kind != LSEQ_TAKE_WHILE && source &&
+    source->type == LVAL_SEQ && source->seq->infinite
+  );
+
+  lval* val = lval_alloc();
+  val->type = LVAL_SEQ;
+  val->seq = seq;
+  val->offset = 0;
+
+  return val;
+}
+
+void lseq_release(lseq* seq) {
+  if (LREF_DEC(seq->refs) == 0) {
+    if (seq->func) {
+      lval_del(seq->func);
+    }
+
+    if (seq->source) {
+      lval_del(seq->source);
+    }
+
+    if (seq->data) {
+      munmap(seq->data, seq->end);
+    }
+
+    free(seq);
+  }
+}
+
+/**
+ * `val` is either a Q-Expression or a sequence, and has to outlive the
+ * cursor.
+ */
+lcursor* lcursor_new(lval* val) {
+  lcursor* cursor = calloc(1, sizeof(lcursor));
+
+  if (val->type != LVAL_SEQ) {
+    cursor->list = val;
+    return cursor;
+  }
+
+  cursor->seq = val->seq;
+  cursor->next = val->seq->kind == LSEQ_LINES ? val->offset : val->seq->start;
+
+  if (
+    val->seq->kind != LSEQ_RANGE && val->seq->kind != LSEQ_ITERATE &&
+    val->seq->kind != LSEQ_LINES
+  ) {
+    cursor->source = lcursor_new(val->seq->source);
+  }
+
+  return cursor;
+}
+
+void lcursor_del(lcursor* cursor) {
+  if (cursor->source) {
+    lcursor_del(cursor->source);
+  }
+
+  if (cursor->val) {
+    lval_del(cursor->val);
+  }
+
+  free(cursor);
+}
+
+lval* lcursor_next(lenv*, lcursor*);
+
+lval* lval_call1(lenv* env, lval* func, lval* arg) {
+  return lval_call(env, func, lval_add(lval_sexpr(), arg));
+}
+
+/**
+ * elements of a Q-Expression are evaluated the same way `fst` does it, so
+ * walking a list with a cursor gives the same values as recursing over it.
+ */
+lval* lcursor_list_next(lenv* env, lcursor* cursor) {
+  if (cursor->next == cursor->list->count) {
+    return NULL;
+  }
+
+  return lval_eval(env, lval_copy(cursor->list->cell[cursor->next++]));
+}
+
+lval* lcursor_iterate_next(lenv* env, lcursor* cursor) {
+  if (!cursor->val) {
+    cursor->val = lval_copy(cursor->seq->source);
+  } else {
+    cursor->val = lval_call1(env, cursor->seq->func, cursor->val);
+  }
+
+  if (cursor->val->type == LVAL_ERR) {
+    lval* err = cursor->val;
+    cursor->val = NULL;
+    return err;
+  }
+
+  return lval_copy(cursor->val);
+}
+
+/**
+ * returns the line starting at `*offset` without its newline, and moves
+ * `*offset` past it.
+ */
+lval* lseq_line(lithp_ctx* ctx, lseq* seq, long* offset) {
+  if (*offset >= seq->end) {
+    return NULL;
+  }
+
+  char* line = seq->data + *offset;
+  char* newline = memchr(line, '\n', seq->end - *offset);
+  long len = newline ? newline - line : seq->end - *offset;
+
+  *offset += newline ? len + 1 : len;
+
+  return lval_str_of(lstr_intern(ctx, line, len));
+}
+
+/**
+ * returns the next element of `lazy-filter` or `take-while`. a predicate
+ * passes when it returns a number other than 0, the same as for `if`.
+ */
+lval* lcursor_test_next(lenv* env, lcursor* cursor) {
+  lseq* seq = cursor->seq;
+  lval* val;
+
+  while ((val = lcursor_next(env, cursor->source))) {
+    if (val->type == LVAL_ERR) {
+      return val;
+    }
+
+    lval* pass = lval_call1(env, seq->func, lval_copy(val));
+
+    if (pass->type != LVAL_NUM) {
+      lval_del(val);
+
+      if (pass->type == LVAL_ERR) {
+        return pass;
+      }
+
+      lval* err = lval_err(
+        "Function '%s' expects its predicate to return a %s but got (a/an) %s instead.",
+          seq->kind == LSEQ_FILTER ? "lazy-filter" : "take-while",
+          ltype_name(LVAL_NUM), ltype_name(pass->type));
+
+      lval_del(pass);
+      return err;
+    }
+
+    int keep = pass->num != 0;
+    lval_del(pass);
+
+    if (keep) {
+      return val;
+    }
+
+    lval_del(val);
+
+    if (seq->kind == LSEQ_TAKE_WHILE) {
+      return NULL;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * returns the next element, `NULL` once there are none left, or an error
+ * after which the cursor is finished as well.
+ */
+lval* lcursor_next(lenv* env, lcursor* cursor) {
+  if (cursor->done) {
+    return NULL;
+  }
+
+  lseq* seq = cursor->seq;
+  lval* val = NULL;
+
+  if (--FUEL < 0 && lbudget_refuel()) {
+    cursor->done = 1;
+    return lbudget_err();
+  }
+
+  if (cursor->list) {
+    val = lcursor_list_next(env, cursor);
+  } else if (seq->kind == LSEQ_RANGE) {
+    if (seq->step > 0 ? cursor->next < seq->end : cursor->next > seq->end) {
+      val = lval_num(cursor->next);
+      cursor->next += seq->step;
+    }
+  } else if (seq->kind == LSEQ_ITERATE) {
+    val = lcursor_iterate_next(env, cursor);
+  } else if (seq->kind == LSEQ_LINES) {
+    val = lseq_line(env->ctx, seq, &cursor->next);
+  } else if (seq->kind == LSEQ_MAP) {
+    val = lcursor_next(env, cursor->source);
+
+    if (val && val->type != LVAL_ERR) {
+      val = lval_call1(env, seq->func, val);
+    }
+  } else {
+    val = lcursor_test_next(env, cursor);
+  }
+
+  if (!val || val->type == LVAL_ERR) {
+    cursor->done = 1;
+  }
+
+  return val;
+}
+
+/**
+ * turns the sequence `val` into a Q-Expression, deleting it.
+ */
+lval* lseq_realize(lenv* env, lval* val) {
+  if (val->seq->infinite) {
+    lval_del(val);
+    return lval_err("Cannot realize a Sequence that never ends.");
+  }
+
+  lcursor* cursor = lcursor_new(val);
+  lval* list = lval_qexpr();
+  lval* x;
+
+  while ((x = lcursor_next(env, cursor))) {
+    if (x->type == LVAL_ERR) {
+      lval_del(list);
+      list = x;
+      break;
+    }
+
+    lval_add(list, x);
+  }
+
+  lcursor_del(cursor);
+  lval_del(val);
+
+  return list;
+}
+
+/**
+ * realizes every sequence among `args`. on failure `args` is deleted and the
+ * error returned, otherwise returns `NULL`.
+ */
+lval* lseq_realize_args(lenv* env, lval* args) {
+  for (int i = 0; i < args->count; i++) {
+    if (args->cell[i]->type == LVAL_SEQ) {
+      args->cell[i] = lseq_realize(env, args->cell[i]);
+
+      if (args->cell[i]->type == LVAL_ERR) {
+        lval* err = lval_pop(args, i);
+        lval_del(args);
+        return err;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+#define LASSERT_SEQUENCE_AT(args, func, index) \
+  LASSERT(args, args->cell[index]->type == LVAL_QEXPR || \
+    args->cell[index]->type == LVAL_SEQ, \
+    "Function '%s' expects a %s or %s but got (a/an) %s at index %i instead.", \
+      func, ltype_name(LVAL_QEXPR), ltype_name(LVAL_SEQ), \
+      ltype_name(args->cell[index]->type), index);
+
+/**
+ * `(range end)` counts from 0, `(range start end)` and `(range start end
+ * step)` from `start`. `end` itself is never part of the range.
+ */
+lval* builtin_range(lenv* env, lval* args) {
+  UNUSED(env);
+
+  LASSERT(args, args->count >= 1 && args->count <= 3,
+    "Function 'range' expects 1 to 3 arguments but got %i.", args->count);
+
+  for (int i = 0; i < args->count; i++) {
+    LASSERT_ARG_TYPE_AT(args, "range", LVAL_NUM, i);
+  }
+
+  long start = args->count == 1 ? 0 : args->cell[0]->num;
+  long end = args->cell[args->count == 1 ? 0 : 1]->num;
+  long step = args->count == 3 ? args->cell[2]->num : 1;
+
+  LASSERT(args, step != 0, "Function 'range' expects a step other than 0.");
+
+  lval* val = lval_seq(LSEQ_RANGE, NULL, NULL);
+  val->seq->start = start;
+  val->seq->end = end;
+  val->seq->step = step;
+
+  lval_del(args);
+  return val;
+}
+
+lval* builtin_iterate(lenv* env, lval* args) {
+  UNUSED(env);
+
+  LASSERT_ARG_COUNT(args, "iterate", 2);
+  LASSERT_ARG_TYPE_AT(args, "iterate", LVAL_FUN, 0);
+
+  lval* func = lval_pop(args, 0);
+  lval* seed = lval_take(args, 0);
+
+  return lval_seq(LSEQ_ITERATE, func, seed);
+}
+
+lval* builtin_lazy(lval* args, char* name, lseq_kind kind) {
+  LASSERT_ARG_COUNT(args, name, 2);
+  LASSERT_ARG_TYPE_AT(args, name, LVAL_FUN, 0);
+  LASSERT_SEQUENCE_AT(args, name, 1);
+
+  lval* func = lval_pop(args, 0);
+  lval* source = lval_take(args, 0);
+
+  return lval_seq(kind, func, source);
+}
+
+lval* builtin_lazy_map(lenv* env, lval* args) {
+  UNUSED(env);
+  return builtin_lazy(args, "lazy-map", LSEQ_MAP);
+}
+
+lval* builtin_lazy_filter(lenv* env, lval* args) {
+  UNUSED(env);
+  return builtin_lazy(args, "lazy-filter", LSEQ_FILTER);
+}
+
+lval* builtin_take_while(lenv* env, lval* args) {
+  UNUSED(env);
+  return builtin_lazy(args, "take-while", LSEQ_TAKE_WHILE);
+}
+
+lval* builtin_realize(lenv* env, lval* args) {
+  LASSERT_ARG_COUNT(args, "realize", 1);
+  LASSERT_SEQUENCE_AT(args, "realize", 0);
+
+  lval* val = lval_take(args, 0);
+
+  if (val->type == LVAL_QEXPR) {
+    return val;
+  }
+
+  return lseq_realize(env, val);
+}
+
+/**
+ * folds the Q-Expression or sequence `list` from the left, one element at a
+ * time, starting from `acc`.
+ */
+lval* lval_fold(lenv* env, lval* func, lval* acc, lval* list) {
+  lcursor* cursor = lcursor_new(list);
+  lval* val;
+
+  while (acc->type != LVAL_ERR && (val = lcursor_next(env, cursor))) {
+    if (val->type == LVAL_ERR) {
+      lval_del(acc);
+      acc = val;
+      break;
+    }
+
+    lval* pair = lval_add(lval_add(lval_sexpr(), acc), val);
+    acc = lval_call(env, func, pair);
+  }
+
+  lcursor_del(cursor);
+  return acc;
+}
+
+lval* builtin_fold(lenv* env, lval* args) {
+  LASSERT_ARG_COUNT(args, "fold", 3);
+  LASSERT_ARG_TYPE_AT(args, "fold", LVAL_FUN, 0);
+  LASSERT_SEQUENCE_AT(args, "fold", 2);
+  LASSERT(args,
+    args->cell[2]->type != LVAL_SEQ || !args->cell[2]->seq->infinite,
+    "Function 'fold' cannot consume a Sequence that never ends.");
+
+  lval* acc = lval_fold(env, args->cell[0], lval_copy(args->cell[1]),
+    args->cell[2]);
+
+  lval_del(args);
+  return acc;
+}
+
+/**
+ * `while`, `dotimes`, `for-each` and `loop` iterate without recursing, so a
+ * step costs neither C stack nor a call. like the branches of `if`, their
+ * operands are Q-Expressions: `(while {test} {body})`, `(dotimes {i n}
+ * {body})`, `(for-each {x list} {body})` and `(loop {a 0 b 1} {body})`. the
+ * variables live in a single frame for the whole loop, and every step
+ * rebinds them in place. the first three evaluate to `()`, or to the first
+ * error their body runs into.
+ *
+ * `(recur x y)` starts the body of the innermost `loop` over, with its
+ * variables bound to `x` and `y`, and otherwise `loop` evaluates to whatever
+ * its body did. `recur` returns a marker that only makes it back to the
+ * `loop` from tail position: the body itself, the branches of `if`, the last
+ * expression of `do`, the results of `cond` and `case`, and the body of
+ * `let`. as an argument, a test, or the result of a call it becomes an
+ * ordinary error instead, see `lrecur_escape`.
+ */
+lval* builtin_recur(lenv* env, lval* args) {
+  UNUSED(env);
+
+  if (RECUR) {
+    lval_del(RECUR);
+  }
+
+  lval* marker = lval_alloc();
+  marker->type = LVAL_ERR;
+  marker->err = RECUR_ERR;
+
+  RECUR = args;
+  return marker;
+}
+
+/**
+ * returns the arguments of the `recur` that `result` comes from and deletes
+ * it, or returns `NULL` when it's any other value.
+ */
+lval* lrecur_take(lval* result) {
+  if (!lval_is_recur(result)) {
+    return NULL;
+  }
+
+  lval* args = RECUR;
+  RECUR = NULL;
+  lval_del(result);
+
+  return args;
+}
+
+/**
+ * checks that `bindings` holds symbols each followed by an expression,
+ * `pairs` of them unless that is -1.
+ */
+lval* lbindings_check(lval* bindings, char* name, int pairs) {
+  int valid = bindings->type == LVAL_QEXPR && bindings->count % 2 == 0 &&
+    (pairs < 0 || bindings->count == pairs * 2);
+
+  for (int i = 0; valid && i < bindings->count; i += 2) {
+    valid = bindings->cell[i]->type == LVAL_SYM;
+  }
+
+  if (valid) {
+    return NULL;
+  }
+
+  return lval_err(
+    "Function '%s' expects a %s of symbols and values at index 0 instead.",
+      name, ltype_name(LVAL_QEXPR));
+}
+
+lval* lwhile_eval(lenv* env, lval* test, lval* body) {
+  while (1) {
+    if (--FUEL < 0 && lbudget_refuel()) {
+      return lbudget_err();
+    }
+
+    lval* cond = lval_eval_operand(env, test);
+    lval* err = lval_expect_num(cond, "while", 0);
+
+    if (err) {
+      return err;
+    }
+
+    int pass = cond->num != 0;
+    lval_del(cond);
+
+    if (!pass) {
+      return lval_sexpr();
+    }
+
+    lval* result = lval_eval_operand(env, body);
+
+    if (result->type == LVAL_ERR) {
+      return lrecur_escape(result);
+    }
+
+    lval_del(result);
+  }
+}
+
+lval* ldotimes_eval(lenv* env, lval* bindings, lval* body) {
+  lval* err = lbindings_check(bindings, "dotimes", 1);
+
+  if (err) {
+    return err;
+  }
+
+  lval* times = lval_eval_ref(env, bindings->cell[1]);
+  err = lval_expect_num(times, "dotimes", 0);
+
+  if (err) {
+    return err;
+  }
+
+  long count = times->num;
+  lval_del(times);
+
+  lenv* frame = lenv_frame(env, 1);
+  lenv_bind(frame, bindings->cell[0], lval_num(0));
+  lval* result = NULL;
+
+  for (long i = 0; i < count; i++) {
+    if (--FUEL < 0 && lbudget_refuel()) {
+      result = lbudget_err();
+      break;
+    }
+
+    if (frame->vals[0]->type == LVAL_NUM) {
+      frame->vals[0]->num = i;
+    } else {
+      lval_del(frame->vals[0]);
+      frame->vals[0] = lval_num(i);
+    }
+
+    result = lval_eval_operand(frame, body);
+
+    if (result->type == LVAL_ERR) {
+      lrecur_escape(result);
+      break;
+    }
+
+    lval_del(result);
+    result = NULL;
+  }
+
+  lenv_frame_del(frame);
+  return result ? result : lval_sexpr();
+}
+
+lval* lforeach_eval(lenv* env, lval* bindings, lval* body) {
+  lval* err = lbindings_check(bindings, "for-each", 1);
+
+  if (err) {
+    return err;
+  }
+
+  lval* list = lval_eval_ref(env, bindings->cell[1]);
+
+  if (list->type == LVAL_ERR) {
+    return lrecur_escape(list);
+  }
+
+  if (list->type != LVAL_QEXPR && list->type != LVAL_SEQ) {
+    err = lval_err(
+      "Function 'for-each' expects a %s or %s but got (a/an) %s instead.",
+        ltype_name(LVAL_QEXPR), ltype_name(LVAL_SEQ), ltype_name(list->type));
+    lval_del(list);
+    return err;
+  }
+
+  if (list->type == LVAL_SEQ && list->seq->infinite) {
+    lval_del(list);
+    return lval_err(
+      "Function 'for-each' cannot consume a Sequence that never ends.");
+  }
+
+  lenv* frame = lenv_frame(env, 1);
+  lcursor* cursor = lcursor_new(list);
+  lval* result = NULL;
+  lval* val;
+
+  while ((val = lcursor_next(env, cursor))) {
+    if (--FUEL < 0 && lbudget_refuel()) {
+      lval_del(val);
+      result = lbudget_err();
+      break;
+    }
+
+    if (val->type == LVAL_ERR) {
+      result = lrecur_escape(val);
+      break;
+    }
+
+    if (frame->count) {
+      lval_del(frame->vals[0]);
+      frame->vals[0] = val;
+    } else {
+      lenv_bind(frame, bindings->cell[0], val);
+    }
+
+    result = lval_eval_operand(frame, body);
+
+    if (result->type == LVAL_ERR) {
+      lrecur_escape(result);
+      break;
+    }
+
+    lval_del(result);
+    result = NULL;
+  }
+
+  lcursor_del(cursor);
+  lenv_frame_del(frame);
+  lval_del(list);
+
+  return result ? result : lval_sexpr();
+}
+
+lval* lloop_eval(lenv* env, lval* bindings, lval* body) {
+  lval* err = lbindings_check(bindings, "loop", -1);
+
+  if (err) {
+    return err;
+  }
+
+  int vars = bindings->count / 2;
+  lenv* frame = lenv_frame(env, vars);
+
+  for (int i = 0; i < vars; i++) {
+    lval* val = lval_eval_ref(frame, bindings->cell[i * 2 + 1]);
+
+    if (val->type == LVAL_ERR) {
+      lenv_frame_del(frame);
+      return lrecur_escape(val);
+    }
+
+    lenv_bind(frame, bindings->cell[i * 2], val);
+  }
+
+  if (RECUR) {
+    lval_del(RECUR);
+    RECUR = NULL;
+  }
+
+  lval* result;
+
+  while (1) {
+    if (--FUEL < 0 && lbudget_refuel()) {
+      result = lbudget_err();
+      break;
+    }
+
+    result = lval_eval_operand(frame, body);
+    lval* args = lrecur_take(result);
+
+    if (!args) {
+      break;
+    }
+
+    if (args->count != vars) {
+      result = lval_err("Function 'recur' expects %i argument but got %i.",
+        vars, args->count);
+      lval_del(args);
+      break;
+    }
+
+    for (int i = 0; i < vars; i++) {
+      lval_del(frame->vals[i]);
+      frame->vals[i] = args->cell[i];
+    }
+
+    lval_resize(args, 0);
+    lval_del(args);
+  }
+
+  lenv_frame_del(frame);
+  return result;
+}
+
+lval* special_while(lenv* env, lval* expr) {
+  if (expr->count != 3) {
+    return lval_err("Function 'while' expects 2 argument but got %i.",
+      expr->count - 1);
+  }
+
+  return lwhile_eval(env, expr->cell[1], expr->cell[2]);
+}
+
+lval* special_dotimes(lenv* env, lval* expr) {
+  if (expr->count != 3) {
+    return lval_err("Function 'dotimes' expects 2 argument but got %i.",
+      expr->count - 1);
+  }
+
+  return ldotimes_eval(env, expr->cell[1], expr->cell[2]);
+}
+
+lval* special_for_each(lenv* env, lval* expr) {
+  if (expr->count != 3) {
+    return lval_err("Function 'for-each' expects 2 argument but got %i.",
+      expr->count - 1);
+  }
+
+  return lforeach_eval(env, expr->cell[1], expr->cell[2]);
+}
+
+lval* special_loop(lenv* env, lval* expr) {
+  if (expr->count != 3) {
+    return lval_err("Function 'loop' expects 2 argument but got %i.",
+      expr->count - 1);
+  }
+
+  return lloop_eval(env, expr->cell[1], expr->cell[2]);
+}
+
+lval* builtin_while(lenv* env, lval* args) {
+  LASSERT_ARG_COUNT(args, "while", 2);
+
+  lval* result = lwhile_eval(env, args->cell[0], args->cell[1]);
+  lval_del(args);
+
+  return result;
+}
+
+lval* builtin_dotimes(lenv* env, lval* args) {
+  LASSERT_ARG_COUNT(args, "dotimes", 2);
+
+  lval* result = ldotimes_eval(env, args->cell[0], args->cell[1]);
+  lval_del(args);
+
+  return result;
+}
+
+lval* builtin_for_each(lenv* env, lval* args) {
+  LASSERT_ARG_COUNT(args, "for-each", 2);
+
+  lval* result = lforeach_eval(env, args->cell[0], args->cell[1]);
+  lval_del(args);
+
+  return result;
+}
+
+lval* builtin_loop(lenv* env, lval* args) {
+  LASSERT_ARG_COUNT(args, "loop", 2);
+
+  lval* result = lloop_eval(env, args->cell[0], args->cell[1]);
+  lval_del(args);
+
+  return result;
+}
+
+/**
+ * `open-lines` maps a file into memory and returns the sequence of its lines,
+ * which are read one at a time, either with `next-line` or by anything that
+ * consumes sequences. `(fold-lines f z "path")` is the same as `(fold f z
+ * (open-lines "path"))`.
+ */
+lval* lseq_open_lines(char* filename) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+
+    return lval_err("Could not open %s", filename);
+  }
+
+  char* data = NULL;
+
+  if (st.st_size > 0) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+
+  close(fd);
+
+  if (data == MAP_FAILED) {
+    return lval_err("Could not map %s", filename);
+  }
+
+  if (data) {
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+  }
+
+  lval* val = lval_seq(LSEQ_LINES, NULL, NULL);
+  val->seq->data = data;
+  val->seq->end = data ? st.st_size : 0;
+
+  return val;
+}
+
+lval* builtin_open_lines(lenv* env, lval* args) {
+  UNUSED(env);
+
+  LASSERT_ARG_COUNT(args, "open-lines", 1);
+  LASSERT_ARG_TYPE_AT(args, "open-lines", LVAL_STR, 0);
+
+  lval* val = lseq_open_lines(args->cell[0]->str);
+
+  lval_del(args);
+  return val;
+}
+
+/**
+ * returns `{line rest}`, the next line and the lines after it, or `()` once
+ * there are none left. like any other sequence, a value from `open-lines`
+ * never changes, only `rest` starts further along the same mapped file.
+ */
+lval* builtin_next_line(lenv* env, lval* args) {
+  LASSERT_ARG_COUNT(args, "next-line", 1);
+  LASSERT(args,
+    args->cell[0]->type == LVAL_SEQ && args->cell[0]->seq->kind == LSEQ_LINES,
+    "Function 'next-line' expects a %s from 'open-lines'.",
+      ltype_name(LVAL_SEQ));
+
+  lval* rest = lval_take(args, 0);
+  lval* line = lseq_line(env->ctx, rest->seq, &rest->offset);
+
+  if (!line) {
+    lval_del(rest);
+    return lval_sexpr();
+  }
+
+  return lval_add(lval_add(lval_qexpr(), line), rest);
+}
+
+lval* builtin_fold_lines(lenv* env, lval* args) {
+  LASSERT_ARG_COUNT(args, "fold-lines", 3);
+  LASSERT_ARG_TYPE_AT(args, "fold-lines", LVAL_FUN, 0);
+  LASSERT_ARG_TYPE_AT(args, "fold-lines", LVAL_STR, 2);
+
+  lval* lines = lseq_open_lines(args->cell[2]->str);
+
+  if (lines->type == LVAL_ERR) {
+    lval_del(args);
+    return lines;
+  }
+
+  lval* acc = lval_fold(env, args->cell[0], lval_copy(args->cell[1]), lines);
+
+  lval_del(lines);
+  lval_del(args);
+
+  return acc;
+}
+
+/**
+ * `(pipeline source f g ... sink)` runs every element of the Q-Expression or
+ * sequence `source` through `f`, then `g`, and so on, and folds what comes out
+ * of the last stage with `sink`, starting from the first of those. it gives
+ * the same result as a `fold` over nested maps, but every stage runs on a
+ * thread of its own, as does reading `source`, while `sink` runs on the
+ * calling thread, so each of them works on a different element at the same
+ * time. like the jobs of `pmap`, the calling environment is frozen while a
+ * pipeline runs, and every stage evaluates in an environment of its own whose
+ * parent is that one. a pipeline run from inside another one, or a parallel
+ * job, or with a single thread, runs every stage in turn on the current
+ * thread instead.
+ *
+ * neighbouring stages are connected by an `lpipe`, a bounded ring of
+ * `PIPE_SIZE` values that only one thread ever writes to and only one reads
+ * from, so it needs no locks. values are moved through it, never copied. a
+ * writer only publishes what it has written every `PIPE_BATCH` values, or
+ * before it has to wait, and the reader does the same with the slots it has
+ * emptied, so the two rarely touch the same cache line. a writer that finds
+ * the ring full waits for the reader to catch up, which is what keeps a fast
+ * stage from running ahead of a slow one. waiting spins for a while, then
+ * yields, and then sleeps. the end of the elements is marked with `NULL`.
+ *
+ * an error, from any stage, is passed along like any other value and stops
+ * the source from reading any further. every stage still finishes the values
+ * already handed to it, so the error the sink ends up with is always the
+ * first one in order. `(pipeline-stats)` describes the last pipeline run.
+ */
+#define PIPE_SIZE 1024
+#define PIPE_BATCH 32
+#define PIPE_SPINS 256
+
+typedef struct {
+  _Alignas(64) unsigned long tail;
+  unsigned long seen_head;
+  unsigned long next_tail;
+  _Alignas(64) unsigned long head;
+  unsigned long seen_tail;
+  unsigned long next_head;
+  lval* items[PIPE_SIZE];
+} lpipe;
+
+/**
+ * `busy` is the time spent on the stage's own work, and the depths are of
+ * the pipe into the stage, as seen every time something is taken from it.
+ */
+struct lstage_stats {
+  long items;
+  uint64_t busy;
+  long empty_waits;
+  long full_waits;
+  long pops;
+  long max_depth;
+  long total_depth;
+};
+
+typedef struct lpipeline lpipeline;
+
+typedef struct {
+  lpipeline* pipeline;
+  lval* func;
+  lpipe* in;
+  lpipe* out;
+  lstage_stats stats;
+  pthread_t thread;
+} lstage;
+
+struct lpipeline {
+  lenv* env;
+  lval* source;
+  lstage* stages;
+  int count;
+  int stop;
+  lbudget* budget;
+  ltrace* trace;
+};
+
+lpipe* lpipe_new(void) {
+  lpipe* pipe = aligned_alloc(64, sizeof(lpipe));
+  pipe->tail = pipe->seen_head = pipe->next_tail = 0;
+  pipe->head = pipe->seen_tail = pipe->next_head = 0;
+  return pipe;
+}
+
+void lpipe_wait(int* spins) {
+  (*spins)++;
+
+  if (*spins < PIPE_SPINS) {
+    return;
+  }
+
+  if (*spins < 2 * PIPE_SPINS) {
+    sched_yield();
+    return;
+  }
+
+  struct timespec pause = { 0, 50000 };
+  nanosleep(&pause, NULL);
+}
+
+void lpipe_flush(lpipe* pipe) {
+  __atomic_store_n(&pipe->tail, pipe->next_tail, __ATOMIC_RELEASE);
+}
+
+void lpipe_push(lpipe* pipe, lval* val, lstage_stats* stats) {
+  if (pipe->next_tail - pipe->seen_head == PIPE_SIZE) {
+    pipe->seen_head = __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE);
+
+    if (pipe->next_tail - pipe->seen_head == PIPE_SIZE) {
+      int spins = 0;
+
+      stats->full_waits++;
+      lpipe_flush(pipe);
+
+      while (pipe->next_tail - pipe->seen_head == PIPE_SIZE) {
+        lpipe_wait(&spins);
+        pipe->seen_head = __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE);
+      }
+    }
+  }
+
+  pipe->items[pipe->next_tail % PIPE_SIZE] = val;
+  pipe->next_tail++;
+
+  if (!val || pipe->next_tail - pipe->tail >= PIPE_BATCH) {
+    lpipe_flush(pipe);
+  }
+}
+
+/**
+ * returns the next value, waiting for it if need be. `out` is where the
+ * caller writes to, which is flushed before waiting so that nothing is held
+ * back from the next stage.
+ */
+lval* lpipe_pop(lpipe* pipe, lpipe* out, lstage_stats* stats) {
+  if (pipe->next_head == pipe->seen_tail) {
+    __atomic_store_n(&pipe->head, pipe->next_head, __ATOMIC_RELEASE);
+    pipe->seen_tail = __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE);
+
+    if (pipe->next_head == pipe->seen_tail) {
+      int spins = 0;
+
+      stats->empty_waits++;
+
+      if (out) {
+        lpipe_flush(out);
+      }
+
+      while (pipe->next_head == pipe->seen_tail) {
+        lpipe_wait(&spins);
+        pipe->seen_tail = __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE);
+      }
+    }
+  }
+
+  long depth = pipe->seen_tail - pipe->next_head;
+  stats->pops++;
+  stats->total_depth += depth;
+
+  if (depth > stats->max_depth) {
+    stats->max_depth = depth;
+  }
+
+  lval* val = pipe->items[pipe->next_head % PIPE_SIZE];
+  pipe->next_head++;
+
+  if (val) {
+    stats->items++;
+  }
+
+  if (pipe->next_head - pipe->head >= PIPE_BATCH) {
+    __atomic_store_n(&pipe->head, pipe->next_head, __ATOMIC_RELEASE);
+  }
+
+  return val;
+}
+
+/**
+ * what `stage` makes of `val`, an error passing through untouched.
+ */
+lval* lstage_apply(lenv* env, lstage* stage, lval* val) {
+  if (val->type == LVAL_ERR) {
+    return val;
+  }
+
+  uint64_t start = ltrace_now();
+  val = lval_call1(env, stage->func, val);
+  stage->stats.busy += ltrace_now() - start;
+
+  return val;
+}
+
+void lstage_source(lenv* env, lstage* stage) {
+  lpipeline* pipeline = stage->pipeline;
+  lcursor* cursor = lcursor_new(pipeline->source);
+
+  while (!__atomic_load_n(&pipeline->stop, __ATOMIC_RELAXED)) {
+    uint64_t start = ltrace_now();
+    lval* val = lcursor_next(env, cursor);
+    stage->stats.busy += ltrace_now() - start;
+
+    if (!val) {
+      break;
+    }
+
+    stage->stats.items++;
+    lpipe_push(stage->out, val, &stage->stats);
+  }
+
+  lpipe_push(stage->out, NULL, &stage->stats);
+  lcursor_del(cursor);
+}
+
+void lstage_map(lenv* env, lstage* stage) {
+  lval* val;
+
+  while ((val = lpipe_pop(stage->in, stage->out, &stage->stats))) {
+    val = lstage_apply(env, stage, val);
+
+    if (val->type == LVAL_ERR) {
+      __atomic_store_n(&stage->pipeline->stop, 1, __ATOMIC_RELAXED);
+    }
+
+    lpipe_push(stage->out, val, &stage->stats);
+  }
+
+  lpipe_push(stage->out, NULL, &stage->stats);
+}
+
+/**
+ * folds what comes out of the last stage, and keeps emptying its pipe once
+ * the result is an error.
+ */
+lval* lstage_sink(lenv* env, lstage* stage) {
+  lval* acc = NULL;
+  lval* val;
+
+  while ((val = lpipe_pop(stage->in, NULL, &stage->stats))) {
+    if (acc && acc->type == LVAL_ERR) {
+      lval_del(val);
+      continue;
+    }
+
+    if (!acc || val->type == LVAL_ERR) {
+      if (acc) {
+        lval_del(acc);
+      }
+
+      acc = val;
+    } else {
+      uint64_t start = ltrace_now();
+      acc = lval_call(env, stage->func, lval_add(lval_add(lval_sexpr(), acc), val));
+      stage->stats.busy += ltrace_now() - start;
+    }
+
+    if (acc->type == LVAL_ERR) {
+      __atomic_store_n(&stage->pipeline->stop, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  return acc ? acc : lval_qexpr();
+}
+
+void* lstage_thread(void* arg) {
+  lstage* stage = arg;
+  lpipeline* pipeline = stage->pipeline;
+
+  char here;
+  STACK_LIMIT = (char*) ((uintptr_t) &here - POOL_STACK_SIZE + STACK_MARGIN);
+
+  lenv* env = lenv_new(pipeline->env->ctx);
+  env->par = pipeline->env;
+
+  TRACE = pipeline->trace;
+  lbudget_switch(pipeline->budget);
+  PARALLEL_DEPTH++;
+
+  if (stage->in) {
+    lstage_map(env, stage);
+  } else {
+    lstage_source(env, stage);
+  }
+
+  PARALLEL_DEPTH--;
+  lbudget_switch(NULL);
+  lenv_del(env);
+  lenv_frame_drain();
+
+  return NULL;
+}
+
+/**
+ * runs every stage in turn for each element, on the current thread.
+ */
+lval* lpipeline_inline(lpipeline* pipeline) {
+  lenv* env = pipeline->env;
+  lstage* sink = &pipeline->stages[pipeline->count - 1];
+  lcursor* cursor = lcursor_new(pipeline->source);
+  lval* acc = NULL;
+  lval* val;
+
+  while ((!acc || acc->type != LVAL_ERR) && (val = lcursor_next(env, cursor))) {
+    for (int i = 1; i < pipeline->count - 1; i++) {
+      val = lstage_apply(env, &pipeline->stages[i], val);
+    }
+
+    if (!acc || val->type == LVAL_ERR) {
+      if (acc) {
+        lval_del(acc);
+      }
+
+      acc = val;
+    } else {
+      acc = lval_call(env, sink->func, lval_add(lval_add(lval_sexpr(), acc), val));
+    }
+  }
+
+  lcursor_del(cursor);
+  return acc ? acc : lval_qexpr();
+}
+
+lval* lpipeline_run(lpipeline* pipeline) {
+  lithp_ctx* ctx = pipeline->env->ctx;
+  int size = ctx->threads ? ctx->threads : (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (PARALLEL_DEPTH || size <= 1) {
+    return lpipeline_inline(pipeline);
+  }
+
+  ldefer_force_all(ctx);
+
+  pipeline->budget = BUDGET;
+  pipeline->trace = TRACE;
+
+  for (int i = 1; i < pipeline->count; i++) {
+    pipeline->stages[i].in = lpipe_new();
+    pipeline->stages[i - 1].out = pipeline->stages[i].in;
+  }
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, POOL_STACK_SIZE);
+
+  for (int i = 0; i < pipeline->count - 1; i++) {
+    pthread_create(&pipeline->stages[i].thread, &attr, lstage_thread,
+      &pipeline->stages[i]);
+  }
+
+  pthread_attr_destroy(&attr);
+
+  lenv* env = lenv_new(ctx);
+  env->par = pipeline->env;
+
+  PARALLEL_DEPTH++;
+  lval* result = lstage_sink(env, &pipeline->stages[pipeline->count - 1]);
+  PARALLEL_DEPTH--;
+
+  lenv_del(env);
+
+  for (int i = 0; i < pipeline->count - 1; i++) {
+    pthread_join(pipeline->stages[i].thread, NULL);
+  }
+
+  for (int i = 1; i < pipeline->count; i++) {
+    free(pipeline->stages[i].in);
+  }
+
+  free(ctx->pipeline_stats);
+  ctx->pipeline_stats = malloc(sizeof(lstage_stats) * pipeline->count);
+  ctx->pipeline_stages = pipeline->count;
+
+  for (int i = 0; i < pipeline->count; i++) {
+    ctx->pipeline_stats[i] = pipeline->stages[i].stats;
+  }
+
+  return result;
+}
+
+lval* builtin_pipeline(lenv* env, lval* args) {
+  LASSERT(args, args->count >= 2,
+    "Function 'pipeline' expects a source and a sink but got %i arguments.",
+      args->count);
+  LASSERT_SEQUENCE_AT(args, "pipeline", 0);
+  LASSERT(args,
+    args->cell[0]->type != LVAL_SEQ || !args->cell[0]->seq->infinite,
+    "Function 'pipeline' cannot consume a Sequence that never ends.");
+
+  for (int i = 1; i < args->count; i++) {
+    LASSERT_ARG_TYPE_AT(args, "pipeline", LVAL_FUN, i);
+  }
+
+  lpipeline pipeline = {
+    env, args->cell[0], calloc(args->count, sizeof(lstage)), args->count, 0,
+    NULL, NULL
+  };
+
+  for (int i = 0; i < args->count; i++) {
+    pipeline.stages[i].pipeline = &pipeline;
+    pipeline.stages[i].func = i ? args->cell[i] : NULL;
+  }
+
+  lval* result = lpipeline_run(&pipeline);
+
+  free(pipeline.stages);
+  lval_del(args);
+
+  return result;
+}
+
+/**
+ * one entry for each stage of the last pipeline, the source first and the
+ * sink last. `per-sec` is how many elements the stage would get through in a
+ * second if it never had to wait, `empty-waits` and `full-waits` how often
+ * it found the pipe into it empty, or the one out of it full, and the depths
+ * are of the pipe into it.
+ */
+lval* builtin_pipeline_stats(lenv* env, lval* args) {
+  LASSERT_ARG_COUNT(args, "pipeline-stats", 0);
+  lval_del(args);
+
+  lithp_ctx* ctx = env->ctx;
+  lval* stats = lval_qexpr();
+
+  for (int i = 0; i < ctx->pipeline_stages; i++) {
+    lstage_stats* stage = &ctx->pipeline_stats[i];
+    lval* entry = lval_qexpr();
+
+    lval_add(entry, lval_sym("stage"));
+    lval_add(entry, lval_num(i));
+    lval_add(entry, lval_sym("items"));
+    lval_add(entry, lval_num(stage->items));
+    lval_add(entry, lval_sym("busy-ms"));
+    lval_add(entry, lval_num((long) (stage->busy / 1000000)));
+    lval_add(entry, lval_sym("per-sec"));
+    lval_add(entry, lval_num(stage->busy
+      ? (long) ((double) stage->items * 1e9 / (double) stage->busy) : 0));
+    lval_add(entry, lval_sym("empty-waits"));
+    lval_add(entry, lval_num(stage->empty_waits));
+    lval_add(entry, lval_sym("full-waits"));
+    lval_add(entry, lval_num(stage->full_waits));
+    lval_add(entry, lval_sym("max-depth"));
+    lval_add(entry, lval_num(stage->max_depth));
+    lval_add(entry, lval_sym("avg-depth"));
+    lval_add(entry, lval_num(stage->pops ? stage->total_depth / stage->pops : 0));
+
+    lval_add(stats, entry);
+  }
+
+  return stats;
+}
+
+/**
+ * `dump` writes a value to a file in a compact binary format, which `undump`
+ * reads back far faster than `load` can parse the same value as source. a
+ * dump starts with `DUMP_MAGIC` and a version byte, followed by the table of
+ * every distinct symbol in the value, and then the value itself. each value
+ * is a tag byte and its contents: numbers are zigzag encoded varints, strings
+ * and symbol names a varint length and their bytes, symbols the varint index
+ * of their name in the table, and expressions their varint length and cells.
+ * lambdas are their formals and body. builtins, partially applied functions,
+ * channels and sequences inside other values can't be dumped.
+ */
+#define DUMP_MAGIC "LITHPDMP"
+#define DUMP_VERSION 1
+#define DUMP_MAX_DEPTH 4096
+
+enum {
+  DUMP_NUM,
+  DUMP_STR,
+  DUMP_SYM,
+  DUMP_SEXPR,
+  DUMP_QEXPR,
+  DUMP_ERR,
+  DUMP_LAMBDA
+};
+
+void lbuf_varint(lbuf* buf, unsigned long n) {
+  lbuf_reserve(buf, 10);
+
+  while (n >= 0x80) {
+    buf->data[buf->len++] = (char) (n | 0x80);
+    n >>= 7;
+  }
+
+  buf->data[buf->len++] = (char) n;
+}
+
+void lbuf_bytes(lbuf* buf, char* str) {
+  size_t len = strlen(str);
+
+  lbuf_varint(buf, len);
+  lbuf_write(buf, str, len);
+}
+
+/**
+ * fills the symbol table, and returns an error if `val` holds anything that
+ * can't be dumped.
+ */
+lval* dump_scan(lsymtab* tab, lval* val, int depth) {
+  if (depth > DUMP_MAX_DEPTH) {
+    return lval_err("Cannot dump values nested deeper than %i.", DUMP_MAX_DEPTH);
+  }
+
+  switch (val->type) {
+    case LVAL_NUM:
+    case LVAL_STR:
+    case LVAL_ERR:
+      return NULL;
+
+    case LVAL_SYM:
+      lsymtab_intern(tab, val->sym);
+      return NULL;
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      for (int i = 0; i < val->count; i++) {
+        lval* err = dump_scan(tab, val->cell[i], depth + 1);
+
+        if (err) {
+          return err;
+        }
+      }
+
+      return NULL;
+
+    case LVAL_FUN:
+      if (!val->builtin && !val->env) {
+        lval* err = dump_scan(tab, val->fun->formals, depth + 1);
+        return err ? err : dump_scan(tab, val->fun->body, depth + 1);
+      }
+      break;
 
-  LASSERT_ARG_COUNT(args, "tail", 1);
-  LASSERT_ARG_TYPE_AT(args, "tail", LVAL_QEXPR, 0);
-  LASSERT(args, args->cell[0]->count != 0,
-    "Function 'tail' passed an empty Q-Expression.");
+    default:
+      break;
+  }
 
-  // take the first argument, delete the first child and return it
-  lval* arg = lval_take(args, 0);
-  lval_del(lval_pop(arg, 0));
+  return lval_err("Cannot dump (a/an) %s.",
+    val->type == LVAL_FUN ? "builtin or partially applied Function"
+      : ltype_name(val->type));
+}
+
+void dump_write(lbuf* buf, lsymtab* tab, lval* val) {
+  switch (val->type) {
+    case LVAL_NUM:
+      lbuf_putc(buf, DUMP_NUM);
+      lbuf_varint(buf,
+        ((unsigned long) val->num << 1) ^ (unsigned long) (val->num >> 63));
+      break;
+
+    case LVAL_STR:
+      lbuf_putc(buf, DUMP_STR);
+      lbuf_bytes(buf, val->str);
+      break;
+
+    case LVAL_ERR:
+      lbuf_putc(buf, DUMP_ERR);
+      lbuf_bytes(buf, val->err);
+      break;
+
+    case LVAL_SYM:
+      lbuf_putc(buf, DUMP_SYM);
+      lbuf_varint(buf, lsymtab_intern(tab, val->sym));
+      break;
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      lbuf_putc(buf, val->type == LVAL_SEXPR ? DUMP_SEXPR : DUMP_QEXPR);
+      lbuf_varint(buf, val->count);
+
+      for (int i = 0; i < val->count; i++) {
+        dump_write(buf, tab, val->cell[i]);
+      }
+      break;
+
+    case LVAL_FUN:
+      lbuf_putc(buf, DUMP_LAMBDA);
+      dump_write(buf, tab, val->fun->formals);
+      dump_write(buf, tab, val->fun->body);
+      break;
+
+    default:
+      break;
+  }
+}
+
+/**
+ * writes the symbol table, which `dump_scan` filled, followed by `val`.
+ */
+void dump_body(lbuf* buf, lsymtab* tab, lval* val) {
+  lbuf_varint(buf, tab->count);
+
+  for (int i = 0; i < tab->count; i++) {
+    lbuf_bytes(buf, tab->syms[i]);
+  }
+
+  dump_write(buf, tab, val);
+}
+
+lval* builtin_dump(lenv* env, lval* args) {
+  LREALIZE(env, args);
+
+  LASSERT_ARG_COUNT(args, "dump", 2);
+  LASSERT_ARG_TYPE_AT(args, "dump", LVAL_STR, 1);
+
+  lsymtab tab = { NULL, 0, NULL, 0 };
+  lval* err = dump_scan(&tab, args->cell[0], 0);
+
+  if (err) {
+    free(tab.syms);
+    free(tab.slots);
+    lval_del(args);
+    return err;
+  }
+
+  lbuf buf = { NULL, 0, 0 };
+  lbuf_write(&buf, DUMP_MAGIC, strlen(DUMP_MAGIC));
+  lbuf_putc(&buf, DUMP_VERSION);
+  dump_body(&buf, &tab, args->cell[0]);
+
+  FILE* file = fopen(args->cell[1]->str, "wb");
+  int written = file && fwrite(buf.data, 1, buf.len, file) == buf.len;
+
+  if (file && fclose(file) != 0) {
+    written = 0;
+  }
+
+  if (!written) {
+    err = lval_err("Could not write dump to %s", args->cell[1]->str);
+  }
+
+  free(buf.data);
+  free(tab.syms);
+  free(tab.slots);
+  lval_del(args);
+
+  return err ? err : lval_sexpr();
+}
+
+/**
+ * reads straight out of the mapped file. `ok` is cleared as soon as anything
+ * doesn't fit the format, or runs past the end of the file.
+ */
+typedef struct {
+  const unsigned char* pos;
+  const unsigned char* end;
+  lval** syms;
+  unsigned long sym_count;
+  lenv* env;
+  int ok;
+} lreader;
+
+unsigned long lreader_varint(lreader* r) {
+  unsigned long n = 0;
+
+  for (int shift = 0; shift < 64 && r->pos < r->end; shift += 7) {
+    unsigned char byte = *r->pos++;
+    n |= (unsigned long) (byte & 0x7f) << shift;
+
+    if (!(byte & 0x80)) {
+      return n;
+    }
+  }
+
+  r->ok = 0;
+  return 0;
+}
+
+/**
+ * returns the characters of a string or symbol as a `lstr`.
+ */
+char* lreader_bytes(lreader* r) {
+  unsigned long len = lreader_varint(r);
+
+  if (!r->ok || len > (unsigned long) (r->end - r->pos)) {
+    r->ok = 0;
+    return NULL;
+  }
+
+  char* str = lstr_intern(r->env->ctx, (const char*) r->pos, len);
+  r->pos += len;
+
+  return str;
+}
+
+lval* undump_value(lreader* r, int depth);
+
+/**
+ * every cell takes up at least two bytes, which keeps a corrupt length from
+ * allocating more than the file could hold.
+ */
+lval* undump_expr(lreader* r, lval* val, int depth) {
+  unsigned long count = lreader_varint(r);
+
+  if (!r->ok || count > (unsigned long) (r->end - r->pos) / 2) {
+    r->ok = 0;
+    return val;
+  }
+
+  val->cell = malloc(sizeof(lval*) * count);
+
+  for (unsigned long i = 0; i < count; i++) {
+    lval* cell = undump_value(r, depth + 1);
+
+    if (!cell) {
+      break;
+    }
+
+    val->cell[val->count++] = cell;
+  }
+
+  HEAP += sizeof(lval*) * val->count;
+
+  return val;
+}
+
+lval* undump_lambda(lreader* r, int depth) {
+  lval* formals = undump_value(r, depth + 1);
+  lval* body = r->ok ? undump_value(r, depth + 1) : NULL;
+
+  if (!body || formals->type != LVAL_QEXPR || body->type != LVAL_QEXPR) {
+    r->ok = 0;
+  }
+
+  for (int i = 0; r->ok && i < formals->count; i++) {
+    if (formals->cell[i]->type != LVAL_SYM) {
+      r->ok = 0;
+    }
+  }
+
+  if (!r->ok) {
+    if (formals) {
+      lval_del(formals);
+    }
+
+    if (body) {
+      lval_del(body);
+    }
+
+    return NULL;
+  }
+
+  lval* lambda = lval_lambda(formals, body);
+  lambda->fun->code = lval_optimize(r->env, lval_copy(body));
+
+  return lambda;
+}
+
+/**
+ * returns `NULL` once the file turns out to be corrupt.
+ */
+lval* undump_value(lreader* r, int depth) {
+  if (depth > DUMP_MAX_DEPTH || r->pos == r->end) {
+    r->ok = 0;
+    return NULL;
+  }
+
+  unsigned char tag = *r->pos++;
+  lval* val = NULL;
+  unsigned long n;
+  char* str;
+
+  switch (tag) {
+    case DUMP_NUM:
+      n = lreader_varint(r);
+      val = lval_num((long) (n >> 1) ^ -(long) (n & 1));
+      break;
+
+    case DUMP_STR:
+    case DUMP_ERR:
+      if ((str = lreader_bytes(r)) && tag == DUMP_STR) {
+        val = lval_str_of(str);
+      } else if (str) {
+        val = lval_alloc();
+        val->type = LVAL_ERR;
+        val->err = malloc(strlen(str) + 1);
+        strcpy(val->err, str);
+        lstr_release(str);
+      }
+      break;
+
+    case DUMP_SYM:
+      n = lreader_varint(r);
 
-  return arg;
+      if (n < r->sym_count) {
+        val = lval_copy(r->syms[n]);
+      } else {
+        r->ok = 0;
+      }
+      break;
+
+    case DUMP_SEXPR:
+      val = undump_expr(r, lval_sexpr(), depth);
+      break;
+
+    case DUMP_QEXPR:
+      val = undump_expr(r, lval_qexpr(), depth);
+      break;
+
+    case DUMP_LAMBDA:
+      val = undump_lambda(r, depth);
+      break;
+
+    default:
+      r->ok = 0;
+      break;
+  }
+
+  if (!r->ok && val) {
+    lval_del(val);
+    val = NULL;
+  }
+
+  if (val) {
+    val = lval_intern(r->env->ctx, val);
+  }
+
+  return val;
+}
+
+/**
+ * reads what `dump_body` wrote, which has to run up to the end of the reader.
+ * returns `NULL` if it doesn't, or is corrupt.
+ */
+lval* undump_body(lreader* r) {
+  r->sym_count = lreader_varint(r);
+
+  if (!r->ok || r->sym_count > (unsigned long) (r->end - r->pos)) {
+    return NULL;
+  }
+
+  r->syms = malloc(sizeof(lval*) * r->sym_count);
+  unsigned long syms = 0;
+
+  for (; r->ok && syms < r->sym_count; syms++) {
+    char* name = lreader_bytes(r);
+
+    if (!name) {
+      break;
+    }
+
+    r->syms[syms] = lval_sym_of(name);
+  }
+
+  lval* val = r->ok ? undump_value(r, 0) : NULL;
+
+  if (val && r->pos != r->end) {
+    lval_del(val);
+    val = NULL;
+  }
+
+  for (unsigned long i = 0; i < syms; i++) {
+    lval_del(r->syms[i]);
+  }
+
+  free(r->syms);
+  r->syms = NULL;
+
+  return val;
+}
+
+lval* builtin_undump(lenv* env, lval* args) {
+  LASSERT_ARG_COUNT(args, "undump", 1);
+  LASSERT_ARG_TYPE_AT(args, "undump", LVAL_STR, 0);
+
+  char* filename = args->cell[0]->str;
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+
+    lval* err = lval_err("Could not read dump from %s", filename);
+    lval_del(args);
+    return err;
+  }
+
+  void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  LASSERT(args, map != MAP_FAILED, "Could not map dump from %s", filename);
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  size_t header = strlen(DUMP_MAGIC) + 1;
+  lreader r = { map, (unsigned char*) map + st.st_size, NULL, 0, env, 1 };
+  lval* val = NULL;
+
+  if (
+    (size_t) st.st_size >= header &&
+    memcmp(map, DUMP_MAGIC, header - 1) == 0 &&
+    r.pos[header - 1] == DUMP_VERSION
+  ) {
+    r.pos += header;
+    val = undump_body(&r);
+  }
+
+  munmap(map, st.st_size);
+
+  if (!val) {
+    val = lval_err("%s is not a valid dump", filename);
+  }
+
+  lval_del(args);
+  return val;
 }
 
-lval* builtin_list(lenv* env, lval* args) {
-  UNUSED(env);
-  args->type = LVAL_QEXPR;
-  return args;
-}
+/**
+ * with the cache turned on, `load` keeps what it parsed from each file in a
+ * `.lithpc` file, next to the source or in `cache_dir`, and reads that back
+ * instead of parsing the file again. a cache file starts with `MODULE_MAGIC`,
+ * the dump version, the interpreter version and a hash of the grammar, then
+ * the size, modification time and content hash of the source it was made
+ * from, a hash of the rest of the file, and then the forms, dumped the same
+ * way `dump` does. it's used as is
+ * while the size and modification time still match, and otherwise only if
+ * the content hash does, in which case it's written again with the new time.
+ * anything else parses the source again and replaces the cache file. those
+ * are written to a temporary file first and renamed into place, so no other
+ * process ever reads one half written. not being able to write one isn't an
+ * error, the file just gets parsed again the next time.
+ */
+#define MODULE_MAGIC "LITHPMOD"
+
+typedef struct {
+  unsigned long size;
+  unsigned long sec;
+  unsigned long nsec;
+  unsigned long hash;
+} lmodule_key;
+
+/**
+ * the cache file of `foo.lithp` is `foo.lithpc`. in `cache_dir` the name also
+ * gets a hash of the full path of the source, so files with the same name in
+ * different directories don't share one.
+ */
+char* lmodule_path(lithp_ctx* ctx, char* filename) {
+  size_t len = strlen(filename);
+  int ext = len > 6 && strcmp(filename + len - 6, ".lithp") == 0;
+
+  if (!ctx->cache_dir) {
+    char* path = malloc(len + 8);
+    sprintf(path, ext ? "%sc" : "%s.lithpc", filename);
+    return path;
+  }
+
+  char* full = realpath(filename, NULL);
+  char* name = full ? full : filename;
+  char* base = strrchr(filename, '/');
+  base = base ? base + 1 : filename;
+
+  len = strlen(ctx->cache_dir) + strlen(base) + 32;
+  char* path = malloc(len);
+  snprintf(path, len, "%s/%s-%016lx.lithpc",
+    ctx->cache_dir, base, lhash(name, strlen(name)));
+
+  free(full);
+  return path;
+}
+
+/**
+ * reads all of `filename`, and fills in `key` from the file it read.
+ */
+char* lmodule_source(char* filename, lmodule_key* key) {
+  FILE* file = fopen(filename, "rb");
+  struct stat st;
+
+  if (!file || fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode)) {
+    if (file) {
+      fclose(file);
+    }
+
+    return NULL;
+  }
+
+  char* source = malloc(st.st_size + 1);
+  size_t len = fread(source, 1, st.st_size, file);
+  source[len] = '\0';
+  fclose(file);
+
+  key->size = len;
+  key->sec = st.st_mtim.tv_sec;
+  key->nsec = st.st_mtim.tv_nsec;
+  key->hash = lhash(source, len);
+
+  return source;
+}
+
+void lmodule_write(lithp_ctx* ctx, char* path, lmodule_key* key, lval* forms) {
+  lsymtab tab = { NULL, 0, NULL, 0 };
+  lval* err = dump_scan(&tab, forms, 0);
+
+  if (err) {
+    lval_del(err);
+    free(tab.syms);
+    free(tab.slots);
+    return;
+  }
+
+  lbuf body = { NULL, 0, 0 };
+  dump_body(&body, &tab, forms);
+
+  lbuf buf = { NULL, 0, 0 };
+  lbuf_write(&buf, MODULE_MAGIC, strlen(MODULE_MAGIC));
+  lbuf_putc(&buf, DUMP_VERSION);
+  lbuf_bytes(&buf, LITHP_VERSION);
+  lbuf_varint(&buf, ctx->grammar_hash);
+  lbuf_varint(&buf, key->size);
+  lbuf_varint(&buf, key->sec);
+  lbuf_varint(&buf, key->nsec);
+  lbuf_varint(&buf, key->hash);
+  lbuf_varint(&buf, lhash(body.data, body.len));
+  lbuf_write(&buf, body.data, body.len);
+
+  size_t len = strlen(path) + 8;
+  char* tmp = malloc(len);
+  snprintf(tmp, len, "%s.XXXXXX", path);
+
+  int fd = mkstemp(tmp);
+  FILE* file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+  int written = file && fchmod(fd, 0644) == 0 &&
+    fwrite(buf.data, 1, buf.len, file) == buf.len;
+
+  if (file && fclose(file) != 0) {
+    written = 0;
+  } else if (!file && fd >= 0) {
+    close(fd);
+  }
+
+  if (fd >= 0 && (!written || rename(tmp, path) != 0)) {
+    unlink(tmp);
+  }
+
+  free(tmp);
+  free(body.data);
+  free(buf.data);
+  free(tab.syms);
+  free(tab.slots);
+}
+
+/**
+ * reads the header of a cache file into `key`, and returns whether it was
+ * made by this interpreter and grammar, and is still intact.
+ */
+int lmodule_header(lreader* r, lithp_ctx* ctx, lmodule_key* key) {
+  size_t magic = strlen(MODULE_MAGIC);
+
+  if (
+    (size_t) (r->end - r->pos) <= magic ||
+    memcmp(r->pos, MODULE_MAGIC, magic) != 0 ||
+    r->pos[magic] != DUMP_VERSION
+  ) {
+    return 0;
+  }
+
+  r->pos += magic + 1;
+
+  unsigned long len = lreader_varint(r);
+  size_t version = strlen(LITHP_VERSION);
+
+  if (
+    !r->ok || len != version || (size_t) (r->end - r->pos) < version ||
+    memcmp(r->pos, LITHP_VERSION, version) != 0
+  ) {
+    return 0;
+  }
+
+  r->pos += version;
+
+  int grammar = lreader_varint(r) == ctx->grammar_hash;
+  key->size = lreader_varint(r);
+  key->sec = lreader_varint(r);
+  key->nsec = lreader_varint(r);
+  key->hash = lreader_varint(r);
+
+  unsigned long body = lreader_varint(r);
+
+  return r->ok && grammar &&
+    body == lhash((const char*) r->pos, r->end - r->pos);
+}
+
+/**
+ * returns the forms of `filename`, from its cache file if that's still valid,
+ * and otherwise parsed from the source, or the error parsing it ended in.
+ * returns `NULL` if the source can't be read, which `load` reports as usual.
+ */
+lval* lmodule_read(lenv* env, char* filename) {
+  lithp_ctx* ctx = env->ctx;
+  struct stat st;
+
+  if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return NULL;
+  }
+
+  lmodule_key key = { st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec, 0 };
+  lmodule_key cached;
+  char* path = lmodule_path(ctx, filename);
+  char* source = NULL;
+  lval* forms = NULL;
+
+  int fd = open(path, O_RDONLY);
+  void* map = MAP_FAILED;
+  size_t size = 0;
+
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+    size = st.st_size;
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  if (map != MAP_FAILED) {
+    lreader r = { map, (unsigned char*) map + size, NULL, 0, env, 1 };
+
+    if (lmodule_header(&r, ctx, &cached) && cached.size == key.size) {
+      int touched = cached.sec != key.sec || cached.nsec != key.nsec;
 
-lval* builtin_eval(lenv* env, lval* args) {
-  LASSERT_ARG_COUNT(args, "eval", 1);
-  LASSERT_ARG_TYPE_AT(args, "eval", LVAL_QEXPR, 0);
+      if (touched) {
+        source = lmodule_source(filename, &key);
+      }
 
-  lval* arg = lval_take(args, 0);
-  arg->type = LVAL_SEXPR;
+      if (!touched || (source && key.hash == cached.hash)) {
+        madvise(map, size, MADV_SEQUENTIAL);
+        forms = undump_body(&r);
+      }
 
-  return lval_eval(env, arg);
-}
+      if (forms && touched) {
+        lmodule_write(ctx, path, &key, forms);
+      }
+    }
 
-lval* builtin_join(lenv* env, lval* args) {
-  UNUSED(env);
+    munmap(map, size);
+  }
 
-  for (int i = 0; i < args->count; i++) {
-    LASSERT_ARG_TYPE_AT(args, "join", LVAL_QEXPR, i);
+  if (!forms && !source) {
+    source = lmodule_source(filename, &key);
   }
 
-  lval* joined = lval_pop(args, 0);
+  if (!forms && source) {
+    mpc_result_t r;
 
-  while (args->count) {
-    joined = lval_join(joined, lval_pop(args, 0));
+    if (mpc_parse(filename, source, ctx->lithp, &r)) {
+      forms = lval_read(ctx, r.output);
+      mpc_ast_delete(r.output);
+      lmodule_write(ctx, path, &key, forms);
+    } else {
+      char* err_msg = mpc_err_string(r.error);
+      mpc_err_delete(r.error);
+
+      forms = lval_err("Could not load file: %s", err_msg);
+      free(err_msg);
+    }
   }
 
-  lval_del(args);
+  free(source);
+  free(path);
 
-  return joined;
+  return forms;
 }
 
-lval* builtin_cons(lenv* env, lval* args) {
-  UNUSED(env);
+/**
+ * files that are known up front, like the ones given on the command line, can
+ * be read and parsed while the ones before them are still being evaluated.
+ * `lithp_prefetch` hands them to a few reader threads, which always take the
+ * earliest file nobody has started on yet, and stay at most `PREFETCH_AHEAD`
+ * files ahead of the ones taken. `load` takes the forms of a file from its
+ * reader instead of reading it again, and waits for them if they are still
+ * being read. a file nobody has started on is simply read by `load` itself.
+ * evaluation stays on the thread that calls `load`, in order.
+ *
+ * reading can happen next to evaluation because the parsers of the grammar
+ * are only ever read while parsing, every string and symbol goes through
+ * `lstr_intern`, which takes a lock, and `lload_read` doesn't look at any
+ * environment. forms are only taken if the file still has the size and age
+ * it had before it was read, so a file written by an earlier one is read
+ * again, the same as it would have been without any readers.
+ *
+ * a reader's allocations count in its own `HEAP`, which no budget looks at,
+ * so it keeps the bytes of the forms it read in `bytes` and hands them over
+ * with the forms. they count against the thread that takes them, the same as
+ * if it had read the file itself.
+ */
+#define PREFETCH_AHEAD 16
 
-  LASSERT_ARG_COUNT(args, "cons", 2);
-  LASSERT_ARG_TYPE_AT(args, "cons", LVAL_QEXPR, 1);
+enum {
+  LPREFETCH_WAITING,
+  LPREFETCH_READING,
+  LPREFETCH_READY,
+  LPREFETCH_TAKEN
+};
 
-  lval* list = lval_sexpr();
-  lval* head = lval_pop(args, 0);
-  lval* body = lval_pop(args, 0);
+typedef struct {
+  char* filename;
+  lmodule_key key;
+  lval* forms;
+  long bytes;
+  int state;
+} lprefetched;
+
+struct lprefetch {
+  lithp_ctx* ctx;
+  lprefetched* files;
+  int count;
+  int next;
+  int ahead;
+  int stop;
+  pthread_t* readers;
+  int reader_count;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  pthread_cond_t room;
+};
 
-  lval_add(list, head);
-  lval_join(list, body);
-  lval_del(args);
+/**
+ * the size and age of `filename`, which are all zero if it can't be found.
+ */
+lmodule_key lprefetch_key(const char* filename) {
+  lmodule_key key = { 0, 0, 0, 0 };
+  struct stat st;
+
+  if (stat(filename, &st) == 0) {
+    key.size = st.st_size;
+    key.sec = st.st_mtim.tv_sec;
+    key.nsec = st.st_mtim.tv_nsec;
+  }
 
-  return list;
+  return key;
 }
 
-lval* builtin_len(lenv* env, lval* args) {
-  UNUSED(env);
+void* lprefetch_thread(void* arg) {
+  lprefetch* prefetch = arg;
 
-  LASSERT_ARG_COUNT(args, "len", 1);
-  LASSERT_ARG_TYPE_AT(args, "len", LVAL_QEXPR, 0);
+  pthread_mutex_lock(&prefetch->lock);
 
-  long len = args->cell[0]->count;
-  lval_del(args);
+  while (!prefetch->stop && prefetch->next < prefetch->count) {
+    if (prefetch->ahead >= PREFETCH_AHEAD) {
+      pthread_cond_wait(&prefetch->room, &prefetch->lock);
+      continue;
+    }
 
-  return lval_num(len);
-}
+    lprefetched* file = &prefetch->files[prefetch->next++];
 
-lval* builtin_add(lenv* env, lval* val) {
-  return builtin_op(env, val, "+");
-}
+    // `load` may have got to it first
+    if (file->state != LPREFETCH_WAITING) {
+      continue;
+    }
 
-lval* builtin_sub(lenv* env, lval* val) {
-  return builtin_op(env, val, "-");
-}
+    file->state = LPREFETCH_READING;
+    prefetch->ahead++;
+    pthread_mutex_unlock(&prefetch->lock);
+
+    // the key is taken first, so a change made while reading is noticed
+    lmodule_key key = lprefetch_key(file->filename);
+    long heap = HEAP;
+    lval* forms = lload_read(prefetch->ctx, file->filename);
+    long bytes = HEAP - heap;
+    HEAP = heap;
+
+    pthread_mutex_lock(&prefetch->lock);
+    file->key = key;
+    file->forms = forms;
+    file->bytes = bytes;
+    file->state = LPREFETCH_READY;
+    pthread_cond_broadcast(&prefetch->ready);
+  }
 
-lval* builtin_mul(lenv* env, lval* val) {
-  return builtin_op(env, val, "*");
+  pthread_mutex_unlock(&prefetch->lock);
+  lenv_frame_drain();
+  return NULL;
 }
 
-lval* builtin_div(lenv* env, lval* val) {
-  return builtin_op(env, val, "/");
-}
+/**
+ * returns the forms read ahead for `filename`, or `NULL` if it has to be read
+ * by the caller.
+ */
+lval* lprefetch_take(lithp_ctx* ctx, const char* filename) {
+  lprefetch* prefetch = ctx->prefetch;
 
-lval* builtin_op(lenv* env, lval* val, char* op) {
-  UNUSED(env);
+  if (!prefetch) {
+    return NULL;
+  }
 
-  for (int i = 0; i < val->count; i++) {
-    if (val->cell[i]->type != LVAL_NUM) {
-      lval* err = lval_err("Arithmetic operator '%s' expects a %s but got (a/an) %s instead on index %i.",
-        op, ltype_name(LVAL_NUM), ltype_name(val->cell[i]->type), i);
+  pthread_mutex_lock(&prefetch->lock);
+  lprefetched* file = NULL;
 
-      lval_del(val);
-      return err;
+  for (int i = 0; i < prefetch->count; i++) {
+    lprefetched* next = &prefetch->files[i];
+
+    if (next->state != LPREFETCH_TAKEN && strcmp(next->filename, filename) == 0) {
+      file = next;
+      break;
     }
   }
 
-  lval* head = lval_pop(val, 0);
+  if (!file) {
+    pthread_mutex_unlock(&prefetch->lock);
+    return NULL;
+  }
 
-  // negatives
-  if ((strcmp(op, "-") == 0) && val->count == 0) {
-    val->num = -val->num;
+  while (file->state == LPREFETCH_READING) {
+    pthread_cond_wait(&prefetch->ready, &prefetch->lock);
   }
 
-  while (val->count > 0) {
-    lval* next = lval_pop(val, 0);
+  lval* forms = file->forms;
+  HEAP += file->bytes;
 
-    if (strcmp(op, "+") == 0) {
-      head->num += next->num;
-    } else if (strcmp(op, "-") == 0) {
-      head->num -= next->num;
-    } else if (strcmp(op, "*") == 0) {
-      head->num *= next->num;
-    } else if (strcmp(op, "/") == 0) {
-      if (next->num == 0) {
-        lval_del(head);
-        lval_del(next);
+  if (file->state == LPREFETCH_READY) {
+    prefetch->ahead--;
+    pthread_cond_signal(&prefetch->room);
+  }
 
-        head = lval_err("cannot devide by zero");
-        break;
-      }
+  file->state = LPREFETCH_TAKEN;
+  file->forms = NULL;
+  file->bytes = 0;
+  pthread_mutex_unlock(&prefetch->lock);
 
-      head->num /= next->num;
-    }
+  if (forms) {
+    lmodule_key key = lprefetch_key(filename);
 
-    lval_del(next);
+    if (memcmp(&key, &file->key, sizeof(lmodule_key)) != 0) {
+      lval_del(forms);
+      forms = NULL;
+    }
   }
 
-  lval_del(val);
-  return head;
+  return forms;
 }
 
-lval* builtin_gt(lenv* env, lval* val) {
-  return builtin_comp(env, val, ">");
-}
+/**
+ * stops the readers, once they're done with the files they are on, and
+ * throws away whatever was read but never taken.
+ */
+void lprefetch_del(lprefetch* prefetch) {
+  pthread_mutex_lock(&prefetch->lock);
+  prefetch->stop = 1;
+  pthread_cond_broadcast(&prefetch->room);
+  pthread_mutex_unlock(&prefetch->lock);
+
+  for (int i = 0; i < prefetch->reader_count; i++) {
+    pthread_join(prefetch->readers[i], NULL);
+  }
 
-lval* builtin_ge(lenv* env, lval* val) {
-  return builtin_comp(env, val, ">=");
-}
+  for (int i = 0; i < prefetch->count; i++) {
+    if (prefetch->files[i].forms) {
+      HEAP += prefetch->files[i].bytes;
+      lval_del(prefetch->files[i].forms);
+    }
 
-lval* builtin_lt(lenv* env, lval* val) {
-  return builtin_comp(env, val, "<");
+    free(prefetch->files[i].filename);
+  }
+
+  pthread_mutex_destroy(&prefetch->lock);
+  pthread_cond_destroy(&prefetch->ready);
+  pthread_cond_destroy(&prefetch->room);
+
+  free(prefetch->files);
+  free(prefetch->readers);
+  free(prefetch);
 }
 
-lval* builtin_le(lenv* env, lval* val) {
-  return builtin_comp(env, val, "<=");
+/**
+ * a trace dump starts with `LTRACE_MAGIC` and a version byte, then the names
+ * of the builtins and lambdas in the global environment, each the varint
+ * address it's recorded by and its name, and then the number of events and
+ * the events themselves, oldest first, exactly as they are in memory. so a
+ * dump can only be decoded on a machine with the same byte order, which is
+ * what `lithp_trace_decode` does.
+ */
+void ltrace_names(lbuf* buf, lenv* env) {
+  long count = 0;
+
+  for (int i = 0; i < env->count; i++) {
+    count += env->vals[i]->type == LVAL_FUN;
+  }
+
+  lbuf_varint(buf, count);
+
+  for (int i = 0; i < env->count; i++) {
+    lval* val = env->vals[i];
+
+    if (val->type == LVAL_FUN) {
+      lbuf_varint(buf, val->builtin
+        ? (uintptr_t) val->builtin : (uintptr_t) val->fun);
+      lbuf_bytes(buf, env->syms[i]);
+    }
+  }
 }
 
-lval* builtin_comp(lenv* env, lval* val, char* comp) {
-  UNUSED(env);
+/**
+ * events still being written while the dump is taken are left out.
+ */
+int ltrace_write(ltrace* trace, const char* path) {
+  lbuf events = { NULL, 0, 0 };
+  unsigned long head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+  unsigned long size = trace->mask + 1;
+  unsigned long count = 0;
 
-  for (int i = 0; i < val->count; i++) {
-    if (val->cell[i]->type != LVAL_NUM) {
-      lval* err = lval_err("Comparison operator '%s' expects a %s but got (a/an) %s instead on index %i.",
-        comp, ltype_name(LVAL_NUM), ltype_name(val->cell[i]->type), i);
+  for (unsigned long seq = head > size ? head - size : 0; seq < head; seq++) {
+    ltrace_event* slot = &trace->events[seq & trace->mask];
+    ltrace_event event;
 
-      lval_del(val);
-      return err;
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq + 1) {
+      continue;
+    }
+
+    memcpy(&event, slot, sizeof(event));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq + 1) {
+      lbuf_write(&events, (char*) &event, sizeof(event));
+      count++;
     }
   }
 
-  lval* left = lval_pop(val, 0);
-  lval* right = lval_pop(val, 0);
-  int result;
+  lbuf buf = { NULL, 0, 0 };
+  lbuf_write(&buf, LTRACE_MAGIC, strlen(LTRACE_MAGIC));
+  lbuf_putc(&buf, LTRACE_VERSION);
+  ltrace_names(&buf, trace->ctx->env);
+  lbuf_varint(&buf, count);
 
-  if (strcmp(comp, ">") == 0) {
-    result = left->num > right->num;
-  } else if (strcmp(comp, "<") == 0) {
-    result = left->num < right->num;
-  } else if (strcmp(comp, ">=") == 0) {
-    result = left->num >= right->num;
-  } else if (strcmp(comp, "<=") == 0) {
-    result = left->num <= right->num;
-  } else if (strcmp(comp, "==") == 0) {
-    result = lval_eq(left, right);
-  } else if (strcmp(comp, "!=") == 0) {
-    result = lval_eq(left, right) ? 0 : 1;
-  } else {
-    lval_del(left);
-    lval_del(right);
-    return lval_err("Unknown comparison operator: %s", comp);
+  pthread_mutex_lock(&trace->lock);
+
+  FILE* file = fopen(path, "wb");
+  int written = file && fwrite(buf.data, 1, buf.len, file) == buf.len &&
+    (!count || fwrite(events.data, 1, events.len, file) == events.len);
+
+  if (file && fclose(file) != 0) {
+    written = 0;
   }
 
-  lval_del(left);
-  lval_del(right);
+  pthread_mutex_unlock(&trace->lock);
 
-  return lval_num(result);
+  free(buf.data);
+  free(events.data);
+
+  return written;
 }
 
-lval* builtin_if(lenv* env, lval* expression) {
-  LASSERT_ARG_TYPE_AT(expression, "if", LVAL_NUM, 0);
-  LASSERT_ARG_TYPE_AT(expression, "if", LVAL_QEXPR, 1);
-  LASSERT_ARG_TYPE_AT(expression, "if", LVAL_QEXPR, 2);
+/**
+ * `lithp_trace_request` only bumps `TRACE_REQUESTS`, since it may run in a
+ * signal handler, and the next event recorded in each traced context then
+ * dumps its trace.
+ */
+void ltrace_dump_requested(ltrace* trace) {
+  int requests = TRACE_REQUESTS;
+  int seen = trace->requests;
 
-  lval* cond = lval_pop(expression, 0);
-  lval* pass = lval_pop(expression, 0);
-  lval* fail = lval_pop(expression, 0);
-  lval* resp;
+  if (
+    __atomic_compare_exchange_n(&trace->requests, &seen, requests, 0,
+      __ATOMIC_RELAXED, __ATOMIC_RELAXED) &&
+    trace->path
+  ) {
+    ltrace_write(trace, trace->path);
+  }
+}
 
-  pass->type = LVAL_SEXPR;
-  fail->type = LVAL_SEXPR;
+lval* builtin_trace_dump(lenv* env, lval* args) {
+  LASSERT_ARG_COUNT(args, "trace-dump", 1);
+  LASSERT_ARG_TYPE_AT(args, "trace-dump", LVAL_STR, 0);
+  LASSERT(args, env->ctx->trace, "Function 'trace-dump' needs tracing enabled.");
 
-  if (cond->num) {
-    resp = lval_eval(env, pass);
+  int written = ltrace_write(env->ctx->trace, args->cell[0]->str);
+  LASSERT(args, written, "Could not write trace to %s", args->cell[0]->str);
+
+  lval_del(args);
+  return lval_sexpr();
+}
+
+typedef struct {
+  uint64_t ref;
+  char* name;
+} ltrace_name;
+
+int ltrace_name_cmp(const void* a, const void* b) {
+  uint64_t x = ((const ltrace_name*) a)->ref;
+  uint64_t y = ((const ltrace_name*) b)->ref;
+
+  return (x > y) - (x < y);
+}
+
+void ltrace_print_ref(FILE* out, ltrace_name* names, long count, uint64_t ref,
+  char* kind) {
+  ltrace_name key = { ref, NULL };
+  ltrace_name* name = bsearch(&key, names, count, sizeof(ltrace_name),
+    ltrace_name_cmp);
+
+  if (name) {
+    fprintf(out, "%s", name->name);
   } else {
-    resp = lval_eval(env, fail);
+    fprintf(out, "%s@%llx", kind, (unsigned long long) ref);
   }
+}
 
-  lval_del(expression);
+/**
+ * prints one event per line: the time since the first event in
+ * microseconds, the thread it happened on, how many lambda calls deep it
+ * was, and what happened, indented by that depth.
+ */
+int lithp_trace_decode(const char* filename, FILE* out) {
+  FILE* file = fopen(filename, "rb");
 
-  return resp;
-}
+  if (!file) {
+    return 0;
+  }
 
-lval* builtin_not(lenv* env, lval* val) {
-  UNUSED(env);
+  lbuf data = { NULL, 0, 0 };
+  char chunk[4096];
+  size_t n;
 
-  LASSERT_ARG_COUNT(val, "not", 1);
-  LASSERT_ARG_TYPE_AT(val, "not", LVAL_NUM, 0);
+  while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    lbuf_write(&data, chunk, n);
+  }
 
-  int opposite = val->cell[0]->num ? 0 : 1;
+  fclose(file);
 
-  lval_del(val);
-  return lval_num(opposite);
-}
+  size_t header = strlen(LTRACE_MAGIC) + 1;
+  lreader r = { (unsigned char*) data.data,
+    (unsigned char*) data.data + data.len, NULL, 0, NULL, 1 };
 
-lval* builtin_or(lenv* env, lval* val) {
-  for (int i = 0; i < val->count; i++) {
-    if (val->cell[i]->type != LVAL_NUM) {
-      lval* err = lval_err("Expected '%s' but found '%s' on index %i.",
-        ltype_name(LVAL_NUM), ltype_name(val->cell[i]->type), i);
+  if (
+    data.len < header || memcmp(data.data, LTRACE_MAGIC, header - 1) != 0 ||
+    data.data[header - 1] != LTRACE_VERSION
+  ) {
+    free(data.data);
+    return 0;
+  }
 
-      lval_del(val);
-      return err;
-    }
+  r.pos += header;
+
+  unsigned long count = lreader_varint(&r);
+
+  if (count > (unsigned long) (r.end - r.pos) / 2) {
+    r.ok = 0;
   }
 
-  lval* cond;
-  lval* resp;
+  ltrace_name* names = malloc(sizeof(ltrace_name) * (r.ok ? count + 1 : 1));
+  unsigned long named = 0;
 
-  while (val->count) {
-    cond = lval_pop(val, 0);
-    resp = lval_eval(env, cond);
+  for (; r.ok && named < count; named++) {
+    uint64_t ref = lreader_varint(&r);
+    unsigned long len = lreader_varint(&r);
 
-    if (resp->num) {
-      lval_del(val);
-      return lval_num(1);
+    if (!r.ok || len > (unsigned long) (r.end - r.pos)) {
+      r.ok = 0;
+      break;
     }
+
+    names[named].ref = ref;
+    names[named].name = malloc(len + 1);
+    memcpy(names[named].name, r.pos, len);
+    names[named].name[len] = '\0';
+    r.pos += len;
   }
 
-  lval_del(val);
-  return lval_num(0);
-}
+  qsort(names, named, sizeof(ltrace_name), ltrace_name_cmp);
 
-lval* builtin_and(lenv* env, lval* val) {
-  for (int i = 0; i < val->count; i++) {
-    if (val->cell[i]->type != LVAL_NUM) {
-      lval* err = lval_err("Expected '%s' but found '%s' on index %i.",
-        ltype_name(LVAL_NUM), ltype_name(val->cell[i]->type), i);
+  unsigned long events = r.ok ? lreader_varint(&r) : 0;
 
-      lval_del(val);
-      return err;
-    }
+  if (!r.ok || events != (unsigned long) (r.end - r.pos) / sizeof(ltrace_event)) {
+    r.ok = 0;
+    events = 0;
+  }
+
+  uint64_t start = 0;
+
+  if (events) {
+    fprintf(out, "%14s  %-4s %6s  %s\n", "time (us)", "thr", "depth", "event");
   }
 
-  lval* cond;
-  lval* resp;
+  for (unsigned long i = 0; i < events; i++) {
+    ltrace_event event;
+    memcpy(&event, r.pos + i * sizeof(ltrace_event), sizeof(event));
+    event.text[LTRACE_TEXT - 1] = '\0';
+
+    if (i == 0) {
+      start = event.time;
+    }
+
+    fprintf(out, "%14.3f  t%-3u %6u  %*s", (event.time - start) / 1000.0,
+      event.thread, event.depth, (int) (event.depth < 32 ? event.depth : 32) * 2,
+      "");
+
+    switch (event.kind) {
+      case LTRACE_EVAL:
+        fprintf(out, "eval    %s (%lli args)\n",
+          event.text[0] ? event.text : "<expr>", (long long) event.arg);
+        break;
+
+      case LTRACE_BUILTIN:
+        fprintf(out, "builtin ");
+        ltrace_print_ref(out, names, named, event.ref, "builtin");
+        fprintf(out, " (%lli args)\n", (long long) event.arg);
+        break;
 
-  while (val->count) {
-    cond = lval_pop(val, 0);
-    resp = lval_eval(env, cond);
+      case LTRACE_ENTER:
+        fprintf(out, "enter   ");
+        ltrace_print_ref(out, names, named, event.ref, "lambda");
+        fprintf(out, " (%lli args)\n", (long long) event.arg);
+        break;
 
-    if (!resp->num) {
-      lval_del(val);
-      return lval_num(0);
-    }
-  }
+      case LTRACE_LEAVE:
+        fprintf(out, "leave   ");
+        ltrace_print_ref(out, names, named, event.ref, "lambda");
+        fprintf(out, " after %.3f us\n", event.arg / 1000.0);
+        break;
 
-  lval_del(val);
-  return lval_num(1);
-}
+      case LTRACE_ERROR:
+        fprintf(out, "error   %s\n", event.text);
+        break;
 
-lval* builtin_eq(lenv* env, lval* val) {
-  UNUSED(env);
+      default:
+        fprintf(out, "unknown event %u\n", event.kind);
+        break;
+    }
+  }
 
-  lval* left = lval_pop(val, 0);
-  lval* right = lval_pop(val, 0);
+  for (unsigned long i = 0; i < named; i++) {
+    free(names[i].name);
+  }
 
-  return lval_num(lval_eq(left, right));
-}
+  free(names);
+  free(data.data);
 
-lval* builtin_ne(lenv* env, lval* val) {
-  lval* res = builtin_eq(env, val);
-  res->num = res->num ? 0 : 1;
-  return res;
+  return r.ok;
 }
 
 /**
- * this function should act like any other builtin. it first checks for error
- * conditions and then performs some command and returns a value. in this case
- * it first checks that the input arguments are the correct types. it then
- * iterates over each symbol and value and puts them into the environment. if
- * there is an error we can return it, but on success we will return the empty
- * expression `()`.
+ * `lstack_run` calls `func` on the evaluation stack of the context, unless the
+ * current thread already knows where its stack ends, which means it's on that
+ * stack already, or it's a thread of the pool or a coroutine with a stack of
+ * its own. like the stacks of coroutines, it's only reserved, and costs as
+ * much memory as the deepest recursion so far actually touched. if it can't
+ * be reserved `func` runs on the stack of the caller, with only `max_depth`
+ * to guard it.
  */
-lval* builtin_var(lenv* env, lval* args, char* func) {
-  LASSERT_ARG_TYPE_AT(args, func, LVAL_QEXPR, 0);
-
-  lval* syms = args->cell[0];
+typedef lval*(*lstack_func)(lithp_ctx*, const char*, const char*);
+
+typedef struct {
+  lstack_func func;
+  lithp_ctx* ctx;
+  const char* name;
+  const char* source;
+  lval* result;
+} lstack_call;
+
+void lstack_main(unsigned int hi, unsigned int lo) {
+  lstack_call* call = (lstack_call*) (((uintptr_t) hi << 32) | lo);
+  call->result = call->func(call->ctx, call->name, call->source);
+}
 
-  for (int i = 0; i < syms->count; i++) {
-    LASSERT(args, syms->cell[i]->type == LVAL_SYM,
-      "Function '%s' cannot define non-symbol. Got %s but expected %s.",
-        func, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+lval* lstack_switch(
+  lithp_ctx* ctx, lstack_func func, const char* name, const char* source
+) {
+  if (STACK_LIMIT) {
+    return func(ctx, name, source);
   }
 
-  LASSERT(args, syms->count == args->count - 1,
-    "Function 'def' cannot define incorrect number of values to symbols");
+  if (!ctx->stack) {
+    size_t size = (size_t) ctx->max_depth * EVAL_FRAME_SIZE + 2 * STACK_MARGIN;
+    void* stack = mmap(NULL, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
 
-  for (int i = 0; i < syms->count; i++) {
-    if (strcmp(func, "def") == 0) {
-      lenv_def(env, syms->cell[i], args->cell[i + 1]);
+    if (stack == MAP_FAILED) {
+      return func(ctx, name, source);
     }
 
-    if (strcmp(func, "=") == 0) {
-      lenv_put(env, syms->cell[i], args->cell[i + 1]);
-    }
+    mprotect(stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+    ctx->stack = stack;
+    ctx->stack_size = size;
   }
 
-  lval_del(args);
-  return lval_sexpr();
-}
+  lstack_call call = { func, ctx, name, source, NULL };
+  uintptr_t self = (uintptr_t) &call;
+  ucontext_t caller;
+  ucontext_t context;
 
-lval* builtin_def(lenv* env, lval* args) {
-  return builtin_var(env, args, "def");
-}
+  getcontext(&context);
+  context.uc_stack.ss_sp = ctx->stack;
+  context.uc_stack.ss_size = ctx->stack_size;
+  context.uc_link = &caller;
+  makecontext(&context, (void (*)(void)) lstack_main, 2,
+    (unsigned int) (self >> 32), (unsigned int) self);
 
-lval* builtin_put(lenv* env, lval* args) {
-  return builtin_var(env, args, "=");
+  STACK_LIMIT = (char*) ctx->stack + STACK_MARGIN;
+  swapcontext(&caller, &context);
+  STACK_LIMIT = NULL;
+
+  return call.result;
 }
 
 /**
- * we can now add a builtin for our lambda function. we want it to take as
- * input some list of symbols, and a list that represents the code. after that
- * it should return a function lval. we've defined a few of builtins now, and
- * this one will follow the same format. like in `def` we do some error
- * checking to ensure that argument types and count are correct. then we just
- * pop the first two arguments from the list and pass them to our previously
- * defined function `lval_lambda`.
+ * a context may be used from inside a builtin of another one, so the trace and
+ * budget of the outer context are put back afterwards. each call gets a fresh
+ * budget from the limits of the context, if it has any. whatever was being
+ * evaluated when it ran out ends in the error saying so.
  */
-lval* builtin_lambda(lenv* env, lval* args) {
-  UNUSED(env);
+lval* lstack_run(
+  lithp_ctx* ctx, lstack_func func, const char* name, const char* source
+) {
+  ltrace* outer = TRACE;
+  lbudget* outer_budget = BUDGET;
+  lbudget budget;
 
-  LASSERT_ARG_COUNT(args, "\\", 2);
-  LASSERT_ARG_TYPE_AT(args, "\\", LVAL_QEXPR, 0);
-  LASSERT_ARG_TYPE_AT(args, "\\", LVAL_QEXPR, 1);
+  int limited = ctx->limit_steps || ctx->limit_mem || ctx->limit_ms;
 
-  for (int i = 0; i < args->cell[0]->count; i++) {
-    LASSERT(args, args->cell[0]->cell[i]->type == LVAL_SYM,
-      "Cannot define non-symbol. Got %s but expected %s",
-        ltype_name(args->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+  TRACE = ctx->trace;
+  lbudget_switch(NULL);
+
+  if (limited) {
+    lbudget_init(&budget, ctx->limit_steps, ctx->limit_mem, ctx->limit_ms);
+    lbudget_enter(&budget);
   }
 
-  lval* formals = lval_pop(args, 0);
-  lval* body = lval_pop(args, 0);
+  lval* result = lstack_switch(ctx, func, name, source);
 
-  lval_del(args);
-  return lval_lambda(formals, body);
+  if (limited) {
+    lbudget_leave(&budget);
+  }
+
+  TRACE = outer;
+  lbudget_switch(outer_budget);
+
+  return result;
 }
 
 /**
- * the environment always takes or returns copies of a value, so we need to
- * remember to delete these two `lval` after registration as we won't need them
- * any more.
+ * the parsers are built from `grammar` in the same order as the rules appear
+ * in the `grammar` file.
  */
-void lenv_add_builtin(lenv* env, char* name, lbuiltin func) {
-  lval* label = lval_sym(name);
-  lval* value = lval_builtin(func);
+lithp_ctx* lithp_new(const char* grammar) {
+  lithp_ctx* ctx = calloc(1, sizeof(lithp_ctx));
+  mpc_parser_t** p = ctx->parsers;
+
+  p[0] = mpc_new("number");
+  p[1] = mpc_new("string");
+  p[2] = mpc_new("comment");
+  p[3] = mpc_new("symbol");
+  p[4] = mpc_new("sexpr");
+  p[5] = mpc_new("qexpr");
+  p[6] = mpc_new("expr");
+  p[7] = mpc_new("lithp");
+  ctx->lithp = p[7];
+
+  mpc_err_t* err = mpca_lang(MPCA_LANG_DEFAULT, grammar,
+    p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7]);
+
+  if (err) {
+    mpc_err_print(err);
+    mpc_err_delete(err);
+    mpc_cleanup(8, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7]);
+    free(ctx);
+    return NULL;
+  }
 
-  lenv_put(env, label, value);
-  lval_del(label);
-  lval_del(value);
-}
+  pthread_mutex_init(&ctx->locals_lock, NULL);
+  pthread_mutex_init(&ctx->out_lock, NULL);
+  pthread_mutex_init(&ctx->strings.lock, NULL);
+  pthread_mutex_init(&ctx->lists.lock, NULL);
+  ctx->grammar_hash = lhash(grammar, strlen(grammar));
+  lithp_set_jit(ctx, 1);
+  lithp_set_optimize(ctx, 1);
+  lithp_set_max_depth(ctx, DEFAULT_MAX_DEPTH);
 
-void lenv_add_value(lenv * env, char* name, lval* value) {
-  lval* label = lval_sym(name);
-  lenv_put(env, label, value);
-  lval_del(label);
-  lval_del(value);
+  ctx->env = lenv_new(ctx);
+  lenv_add_builtins(ctx->env);
+
+  return ctx;
 }
 
-void lenv_add_builtins(lenv* env) {
-  lenv_add_builtin(env, "load",  builtin_load);
-  lenv_add_builtin(env, "\\",  builtin_lambda);
-  lenv_add_builtin(env, "def", builtin_def);
-  lenv_add_builtin(env, "=", builtin_put);
+void lithp_del(lithp_ctx* ctx) {
+  mpc_parser_t** p = ctx->parsers;
 
-  lenv_add_builtin(env, "print", builtin_print);
-  lenv_add_builtin(env, "error", builtin_error);
+  if (ctx->prefetch) {
+    lprefetch_del(ctx->prefetch);
+  }
 
-  lenv_add_builtin(env, "list", builtin_list);
-  lenv_add_builtin(env, "head", builtin_head);
-  lenv_add_builtin(env, "tail", builtin_tail);
-  lenv_add_builtin(env, "eval", builtin_eval);
-  lenv_add_builtin(env, "join", builtin_join);
-  lenv_add_builtin(env, "cons", builtin_cons);
-  lenv_add_builtin(env, "len",  builtin_len);
-  lenv_add_builtin(env, "arity",  builtin_arity);
+  if (ctx->pool) {
+    lpool_del(ctx->pool);
+  }
 
-  lenv_add_builtin(env, "+", builtin_add);
-  lenv_add_builtin(env, "-", builtin_sub);
-  lenv_add_builtin(env, "*", builtin_mul);
-  lenv_add_builtin(env, "/", builtin_div);
+  lsched_del(&ctx->sched);
 
-  lenv_add_builtin(env, "if", builtin_if);
-  lenv_add_builtin(env, ">", builtin_gt);
-  lenv_add_builtin(env, ">=", builtin_ge);
-  lenv_add_builtin(env, "<", builtin_lt);
-  lenv_add_builtin(env, "<=", builtin_le);
-  lenv_add_builtin(env, "==", builtin_eq);
-  lenv_add_builtin(env, "!=", builtin_ne);
+  for (int i = 0; i < LOCALS_SIZE; i++) {
+    while (ctx->deferred[i]) {
+      ldeferred* entry = ctx->deferred[i];
+      ctx->deferred[i] = entry->next;
+      lval_del(entry->form);
+      free(entry);
+    }
+  }
 
-  lenv_add_builtin(env, "and", builtin_and);
-  lenv_add_builtin(env, "&&", builtin_and);
-  lenv_add_builtin(env, "or", builtin_or);
-  lenv_add_builtin(env, "||", builtin_or);
+  lenv_del(ctx->env);
 
-  lenv_add_builtin(env, "not", builtin_not);
-  lenv_add_builtin(env, "!", builtin_not);
+  for (int i = 0; i < LOCALS_SIZE; i++) {
+    while (ctx->locals[i]) {
+      lname* name = ctx->locals[i];
+      ctx->locals[i] = name->next;
+      free(name->sym);
+      free(name);
+    }
+  }
 
-  lenv_add_value(env, "true", lval_num(1));
-  lenv_add_value(env, "false", lval_num(0));
-  lenv_add_value(env, "nil", lval_qexpr());
-}
+  lithp_flush(ctx);
+  free(ctx->out.data);
+  lstrtab_del(&ctx->strings);
+  lcellstab_del(&ctx->lists);
+  free(ctx->cache_dir);
+  free(ctx->pipeline_stats);
+  lithp_set_trace(ctx, 0, NULL);
 
-lval* lval_eval_sexpr(lenv* env, lval* val) {
-  for (int i = 0; i < val->count; i++) {
-    val->cell[i] = lval_eval(env, val->cell[i]);
+  if (ctx->stack) {
+    munmap(ctx->stack, ctx->stack_size);
   }
 
-  for (int i = 0; i < val->count; i++) {
-    if (val->cell[i]->type == LVAL_ERR) {
-      return lval_take(val, i);
-    }
+  pthread_mutex_destroy(&ctx->locals_lock);
+  pthread_mutex_destroy(&ctx->out_lock);
+  mpc_cleanup(8, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7]);
+  free(ctx);
+}
+
+lenv* lithp_env(lithp_ctx* ctx) {
+  return ctx->env;
+}
+
+void lithp_set_jit(lithp_ctx* ctx, int enabled) {
+#ifdef LITHP_JIT
+  ctx->jit = enabled;
+#else
+  UNUSED(enabled);
+  ctx->jit = 0;
+#endif
+}
+
+void lithp_set_optimize(lithp_ctx* ctx, int enabled) {
+  ctx->optimize = enabled;
+}
+
+void lithp_set_hashcons(lithp_ctx* ctx, int enabled) {
+  ctx->hashcons = enabled;
+}
+
+void lithp_set_lazy(lithp_ctx* ctx, int enabled) {
+  ctx->lazy = enabled;
+}
+
+/**
+ * keeps the last `events` events, rounded up to a power of two, or turns
+ * tracing off when that's zero. the trace is written to `path`, unless that's
+ * `NULL`, whenever an expression ends in an error and whenever
+ * `lithp_trace_request` is called. `(trace-dump "file")` writes it anywhere.
+ * only takes effect for the next call to `lithp_eval` or one of the others.
+ */
+void lithp_set_trace(lithp_ctx* ctx, long events, const char* path) {
+  ltrace* trace = ctx->trace;
+
+  if (trace) {
+    pthread_mutex_destroy(&trace->lock);
+    free(trace->events);
+    free(trace->path);
+    free(trace);
+    ctx->trace = NULL;
   }
 
-  if (val->count == 0) {
-    return val;
+  if (events <= 0) {
+    return;
   }
 
-  // LVAL_FUN to handle function calls with no arguments
-  // if (val->count == 1 && val->cell[0]->type != LVAL_FUN) {
-  // seg fault on `+` for some reason!
-  if (val->count == 1) {
-    return lval_take(val, 0);
+  unsigned long size = 1;
+
+  while (size < (unsigned long) events) {
+    size <<= 1;
   }
 
-  lval* head = lval_pop(val, 0);
+  trace = calloc(1, sizeof(ltrace));
+  trace->ctx = ctx;
+  trace->events = calloc(size, sizeof(ltrace_event));
+  trace->mask = size - 1;
+  trace->requests = TRACE_REQUESTS;
+  pthread_mutex_init(&trace->lock, NULL);
 
-  if (head->type != LVAL_FUN) {
-    lval_del(head);
-    lval_del(val);
-    return lval_err("first element is not a function");
+  if (path) {
+    trace->path = malloc(strlen(path) + 1);
+    strcpy(trace->path, path);
   }
 
-  lval* result = lval_call(env, head, val);
-  lval_del(head);
+  ctx->trace = trace;
+}
 
-  return result;
+void lithp_trace_request(void) {
+  TRACE_REQUESTS++;
 }
 
-lval* lval_eval(lenv* env, lval* val) {
-  if (val->type == LVAL_SYM) {
-    lval* ret = lenv_get(env, val);
-    lval_del(val);
-    return ret;
-  }
+/**
+ * bounds every call to `lithp_eval`, `lithp_load` and `lithp_load_string` to
+ * `steps` evaluation steps, `mem` more bytes of heap and `ms` milliseconds,
+ * zero meaning no limit. a call that runs out evaluates to an error, and a
+ * file stops loading once it does.
+ */
+void lithp_set_limits(lithp_ctx* ctx, long steps, long mem, long ms) {
+  ctx->limit_steps = steps > 0 ? steps : 0;
+  ctx->limit_mem = mem > 0 ? mem : 0;
+  ctx->limit_ms = ms > 0 ? ms : 0;
+}
 
-  if (val->type == LVAL_SEXPR) {
-    return lval_eval_sexpr(env, val);
+/**
+ * `dir` is where cache files are kept, or `NULL` to keep them next to the
+ * files they were made from.
+ */
+void lithp_set_cache(lithp_ctx* ctx, int enabled, const char* dir) {
+  ctx->cache = enabled;
+  free(ctx->cache_dir);
+  ctx->cache_dir = NULL;
+
+  if (dir) {
+    ctx->cache_dir = malloc(strlen(dir) + 1);
+    strcpy(ctx->cache_dir, dir);
   }
-
-  return val;
 }
 
 /**
- * we need to write the code that runs when an expression gets evaluated and a
- * function `lval` is called. when this function type is a builtin we can call
- * it as before, using the function pointer, but we need to do something
- * separate for our user defined functions. we need to bind each of the
- * arguments passed in, to each of the symbols in the `formals` field. once
- * this is done we need to evaluate the `body` field. using the `env` field as
- * an evironemnt, and the calling environment as a parent.
+ * the evaluation stack is reserved again to fit the new depth the next time
+ * it's needed.
  */
-lval* lval_call(lenv* env, lval* formals, lval* args) {
-  if (formals->builtin) {
-    return formals->builtin(env, args);
+void lithp_set_max_depth(lithp_ctx* ctx, long depth) {
+  ctx->max_depth = depth > 0 ? depth : DEFAULT_MAX_DEPTH;
+
+  if (ctx->stack) {
+    munmap(ctx->stack, ctx->stack_size);
+    ctx->stack = NULL;
   }
+}
 
-  int given = args->count;
-  int total = formals->formals->count;
+/**
+ * only has an effect before the first parallel builtin runs, since that is
+ * when the pool gets started. zero means one thread per processor.
+ */
+void lithp_set_threads(lithp_ctx* ctx, int threads) {
+  ctx->threads = threads;
+}
 
-  while (args->count) {
-    // if we've ran out of formal arguments to bind
-    if (formals->formals->count == 0) {
-      lval_del(args);
+/**
+ * starts reading `files` ahead of `load` on as many threads as
+ * `lithp_set_threads` allows, see `lprefetch`. there are no readers with a
+ * single thread. everything else should be set up before this is called.
+ */
+void lithp_prefetch(lithp_ctx* ctx, const char** files, int count) {
+  if (ctx->prefetch) {
+    lprefetch_del(ctx->prefetch);
+    ctx->prefetch = NULL;
+  }
 
-      return lval_err("Function passed too many arguments. Got %i but expected %i",
-        given, total);
-    }
+  int size = ctx->threads ? ctx->threads : (int) sysconf(_SC_NPROCESSORS_ONLN);
 
-    // pop the first symbol from the formals and pop the next arugment from the
-    // arguments list
-    lval* sym = lval_pop(formals->formals, 0);
-    lval* val;
+  if (size <= 1 || count <= 0) {
+    return;
+  }
 
-    if (strcmp(sym->sym, "&") == 0) {
-      // ensure '&' is followed b another sybol
-      if (formals->formals->count != 1) {
-        lval_del(args);
-        return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
-      }
+  lprefetch* prefetch = malloc(sizeof(lprefetch));
+  prefetch->ctx = ctx;
+  prefetch->files = calloc(count, sizeof(lprefetched));
+  prefetch->count = count;
+  prefetch->next = 0;
+  prefetch->ahead = 0;
+  prefetch->stop = 0;
+  prefetch->reader_count = size < count ? size : count;
+  prefetch->readers = malloc(sizeof(pthread_t) * prefetch->reader_count);
 
-      // next formal should be ound o remaning arguments
-      lval* nsym = lval_pop(formals->formals, 0);
-      lenv_put(formals->env, nsym, builtin_list(env, args));
+  for (int i = 0; i < count; i++) {
+    prefetch->files[i].filename = strdup(files[i]);
+    prefetch->files[i].state = LPREFETCH_WAITING;
+  }
 
-      lval_del(sym);
-      lval_del(nsym);
+  pthread_mutex_init(&prefetch->lock, NULL);
+  pthread_cond_init(&prefetch->ready, NULL);
+  pthread_cond_init(&prefetch->room, NULL);
 
-      break;
-    }
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, POOL_STACK_SIZE);
 
-    // bind a copy into the function's environment and then free them
-    val = lval_pop(args, 0);
-    lenv_put(formals->env, sym, val);
-    lval_del(sym);
-    lval_del(val);
+  for (int i = 0; i < prefetch->reader_count; i++) {
+    pthread_create(&prefetch->readers[i], &attr, lprefetch_thread, prefetch);
   }
 
-  // arguments list is now bound so we can clean up
-  lval_del(args);
+  pthread_attr_destroy(&attr);
 
-  // if '&' remains in formal list bind to empty list
-  if (
-    formals->formals->count > 0 &&
-    strcmp(formals->formals->cell[0]->sym, "&") == 0
-  ) {
-    // check to ensure that '&' is not passed invalidly
-    if (formals->formals->count != 2) {
-      return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
-    }
+  ctx->prefetch = prefetch;
+}
 
-    // pop and delete the '&' symbol
-    lval_del(lval_pop(formals->formals, 0));
+void lithp_add_builtin(lithp_ctx* ctx, char* name, lbuiltin func) {
+  lenv_add_builtin(ctx->env, name, func);
+}
 
-    // pop next symbol and create empty list
-    lval* sym = lval_pop(formals->formals, 0);
-    lval* val = lval_qexpr();
+lval* lithp_eval_source(lithp_ctx* ctx, const char* name, const char* source) {
+  mpc_result_t r;
 
-    // bind to environment and delete
-    lenv_put(formals->env, sym, val);
-    lval_del(sym);
-    lval_del(val);
-  }
+  if (!mpc_parse(name, source, ctx->lithp, &r)) {
+    char* err_msg = mpc_err_string(r.error);
+    mpc_err_delete(r.error);
 
-  if (formals->formals->count == 0) {
-    formals->env->par = env;
+    lval* err = lval_err("%s", err_msg);
+    free(err_msg);
 
-    // if all formals have been bond, evaluate and return
-    return builtin_eval(formals->env,
-      lval_add(lval_sexpr(), lval_copy(formals->body)));
-  } else {
-    // otherwise return partially evaluated function
-    return lval_copy(formals);
+    return err;
   }
-}
 
-int main(int argc, char** argv) {
-  char* grammar = read("grammar");
+  lval* val = lbudget_check(lval_eval(ctx->env, lval_read(ctx, r.output)));
+  mpc_ast_delete(r.output);
+  lsched_drain(ctx);
+  lithp_flush(ctx);
 
-  if (!grammar) {
-    printf("failed to read grammar file");
-    exit(EXIT_FAILURE);
+  if (val->type == LVAL_ERR && ctx->trace && ctx->trace->path) {
+    ltrace_write(ctx->trace, ctx->trace->path);
   }
 
-  mpc_parser_t* Number = mpc_new("number");
-  mpc_parser_t* String = mpc_new("string");
-  mpc_parser_t* Comment = mpc_new("comment");
-  mpc_parser_t* Symbol = mpc_new("symbol");
-  mpc_parser_t* Sexpr = mpc_new("sexpr");
-  mpc_parser_t* Qexpr = mpc_new("qexpr");
-  mpc_parser_t* Expr = mpc_new("expr");
-  Lithp = mpc_new("lithp");
-
-  mpca_lang(MPCA_LANG_DEFAULT, grammar,
-    Number, String, Comment, Symbol, Sexpr, Qexpr, Expr, Lithp);
-  free(grammar);
+  return val;
+}
 
-  lenv* env = lenv_new();
-  lenv_add_builtins(env);
+lval* lithp_load_file(lithp_ctx* ctx, const char* filename, const char* unused) {
+  UNUSED(unused);
 
-  if (argc >= 2) {
-    for (int i = 1; i < argc; i++) {
-      lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
-      lval* x = builtin_load(env, args);
+  lval* args = lval_add(lval_sexpr(), lval_str((char*) filename));
+  return builtin_load(ctx->env, args);
+}
 
-      if (x->type == LVAL_ERR) {
-        lval_println(x);
-      }
+lval* lithp_load_source(lithp_ctx* ctx, const char* name, const char* source) {
+  mpc_result_t r;
 
-      lval_del(x);
-    }
-  } else {
-    printf("Lithp Version %s\n", VERSION);
+  if (!mpc_parse(name, source, ctx->lithp, &r)) {
+    char* err_msg = mpc_err_string(r.error);
+    mpc_err_delete(r.error);
 
-    lval* loader = lval_add(lval_sexpr(), lval_str("std.lithp"));
-    builtin_load(env, loader);
+    lval* err = lval_err("Could not load source: %s", err_msg);
+    free(err_msg);
 
-    printf("Loaded Standard Library from std.lithp\n");
-    printf("Press Ctrl+c to Exit\n\n");
+    return err;
+  }
 
-    while (1) {
-      mpc_result_t result;
-      char* input = readline(PROMPT);
+  return lenv_run(ctx->env, r.output);
+}
 
-      if (mpc_parse("<stdin>", input, Lithp, &result)) {
-        lval* val = lval_eval(env, lval_read(result.output));
-        lval_println(val);
-        lval_del(val);
-        mpc_ast_delete(result.output);
-      } else {
-        mpc_err_print(result.error);
-        mpc_err_delete(result.error);
-      }
+lval* lithp_eval(lithp_ctx* ctx, const char* name, const char* source) {
+  return lstack_run(ctx, lithp_eval_source, name, source);
+}
 
-      add_history(input);
-      free(input);
-    }
+lval* lithp_load(lithp_ctx* ctx, const char* filename) {
+  return lstack_run(ctx, lithp_load_file, filename, NULL);
+}
 
-    lval_del(loader);
-  }
+lval* lithp_load_string(lithp_ctx* ctx, const char* name, const char* source) {
+  return lstack_run(ctx, lithp_load_source, name, source);
+}
 
-  lenv_del(env);
-  mpc_cleanup(8, Number, String, Comment, Symbol, Sexpr, Qexpr, Expr, Lithp);
+long lithp_errors(lithp_ctx* ctx) {
+  return ctx->errors;
+}
 
-  return 0;
+/**
+ * only the thread that calls `fork` lives on in the child, so the pool, if
+ * there is one, is left behind and a new one gets started when it's needed.
+ * so are the readers of `lithp_prefetch`, and the files they haven't read yet
+ * are read by `load` itself.
+ */
+void lithp_forked(lithp_ctx* ctx) {
+  ctx->pool = NULL;
+  ctx->prefetch = NULL;
 }
@@ -0,0 +1,194 @@
+#ifndef LITHP_H
+#define LITHP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define UNUSED(x) (void)(x)
+
+#define LITHP_VERSION "0.0.0"
+
+#define LASSERT(args, cond, fmt, ...) \
+  if (!(cond)) { \
+    lval* err = lval_err(fmt, ##__VA_ARGS__); \
+    lval_del(args); \
+    return err; \
+  }
+
+#define LASSERT_ARG_COUNT(args, func, expected) \
+  LASSERT(args, expected == args->count, \
+    "Function '%s' expects %i argument but got %i.", \
+      func, expected, args->count);
+
+#define LASSERT_ARG_TYPE_AT(args, func, expected, index) \
+  LASSERT(args, args->cell[index]->type == expected, \
+    "Function '%s' expects a %s but got (a/an) %s at index %i instead.", \
+      func, ltype_name(expected), ltype_name(args->cell[index]->type), index);
+
+/**
+ * everything an interpreter needs lives in a `lithp_ctx`: the parser, the
+ * global environment, the jit and its stats, and the thread pool used by the
+ * parallel builtins. contexts don't share any state with each other, so a
+ * program can run as many of them as it likes, for example one per thread,
+ * without any locking between them. values must never be passed from one
+ * context to another.
+ */
+struct lval;
+struct lenv;
+struct lfunc;
+struct lcache;
+struct lchan;
+struct lseq;
+struct lcells;
+typedef struct lval lval;
+typedef struct lenv lenv;
+typedef struct lfunc lfunc;
+typedef struct lcache lcache;
+typedef struct lchan lchan;
+typedef struct lseq lseq;
+typedef struct lcells lcells;
+typedef struct lithp_ctx lithp_ctx;
+
+typedef lval*(*lbuiltin)(lenv*, lval*);
+
+/**
+ * with hash-consing turned on, the `cell` of a Q-Expression may belong to
+ * `shared`, which equal Q-Expressions and copies of them all point to. such
+ * cells must never be changed in place, so a builtin that changes the cells
+ * of a list it was given, other than through `lval_add` and `lval_pop`, has
+ * to call `lval_unshare` on it first.
+ */
+typedef enum {
+  LVAL_STR,
+  LVAL_FUN,
+  LVAL_SYM,
+  LVAL_SEXPR,
+  LVAL_QEXPR,
+  LVAL_NUM,
+  LVAL_ERR,
+  LVAL_CHAN,
+  LVAL_SEQ
+} lval_type;
+
+struct lval {
+  lval_type type;
+
+  // basic
+  long num;
+  char* err;
+  char* sym;
+  lcache* cache;
+  char* str;
+
+  // function
+  lbuiltin builtin;
+  lbuiltin special;
+  int nullary;
+  lfunc* fun;
+  lenv* env;
+
+  // channel
+  lchan* chan;
+
+  // lazy sequence
+  lseq* seq;
+  long offset;
+
+  // expression
+  int count;
+  struct lval** cell;
+  lcells* shared;
+};
+
+lval* lval_num(long);
+lval* lval_err(char*, ...);
+lval* lval_str(char*);
+lval* lval_sym(char*);
+lval* lval_sexpr(void);
+lval* lval_qexpr(void);
+lval* lval_builtin(lbuiltin);
+lval* lval_add(lval*, lval*);
+lval* lval_pop(lval*, int);
+lval* lval_take(lval*, int);
+lval* lval_copy(lval*);
+void lval_unshare(lval*);
+void lval_del(lval*);
+int lval_eq(lval*, lval*);
+void lval_print(lval*);
+void lval_println(lval*);
+char* ltype_name(lval_type);
+
+lval* lval_eval(lenv*, lval*);
+lval* lval_call(lenv*, lval*, lval*);
+lithp_ctx* lenv_ctx(lenv*);
+
+/**
+ * `grammar` is the source of the mpc grammar found in the `grammar` file.
+ * returns `NULL` if it can't be compiled.
+ */
+lithp_ctx* lithp_new(const char* grammar);
+void lithp_del(lithp_ctx*);
+
+lenv* lithp_env(lithp_ctx*);
+void lithp_set_jit(lithp_ctx*, int enabled);
+void lithp_set_optimize(lithp_ctx*, int enabled);
+void lithp_set_hashcons(lithp_ctx*, int enabled);
+void lithp_set_lazy(lithp_ctx*, int enabled);
+void lithp_set_cache(lithp_ctx*, int enabled, const char* dir);
+void lithp_set_threads(lithp_ctx*, int threads);
+void lithp_add_builtin(lithp_ctx*, char* name, lbuiltin func);
+void lithp_forked(lithp_ctx*);
+
+/**
+ * `lithp_eval` reads all of `source` as a single S-Expression, the same way
+ * the REPL treats a line of input, and `lithp_load` evaluates every
+ * expression in a file, the same way `load` does, as does `lithp_load_string`
+ * for `source`. they all return a new value which the caller has to delete.
+ * `lithp_errors` counts the expressions loaded so far that ended in an error.
+ */
+lval* lithp_eval(lithp_ctx*, const char* name, const char* source);
+lval* lithp_load(lithp_ctx*, const char* filename);
+lval* lithp_load_string(lithp_ctx*, const char* name, const char* source);
+long lithp_errors(lithp_ctx*);
+
+/**
+ * `lithp_prefetch` reads and parses `files` on threads of its own, ahead of
+ * the calls to `lithp_load` that evaluate them, which still run one after
+ * another on the calling thread. call it once everything else is set up.
+ */
+void lithp_prefetch(lithp_ctx*, const char** files, int count);
+
+/**
+ * a call to a lambda nested more than `depth` calls deep, 100000 unless set
+ * otherwise, evaluates to an error instead. the three functions above run on
+ * a stack of their own which is reserved to fit that many calls. limits, if
+ * set, bound the steps, the bytes of values, strings, lists and environments
+ * held on top of what there was before, and the milliseconds each of those
+ * calls may take, zero meaning no limit. memory is counted per call, so other
+ * threads and other contexts never count towards it.
+ */
+void lithp_set_max_depth(lithp_ctx*, long depth);
+void lithp_set_limits(lithp_ctx*, long steps, long mem, long ms);
+
+/**
+ * with tracing on, the context keeps a record of the most recent steps of
+ * evaluation, see `lithp_set_trace`. `lithp_trace_request` asks every traced
+ * context to write out its trace, and is safe to call from a signal handler.
+ * `lithp_trace_decode` prints a trace written that way as a timeline to `out`,
+ * and returns zero if it isn't a valid trace.
+ */
+void lithp_set_trace(lithp_ctx*, long events, const char* path);
+void lithp_trace_request(void);
+int lithp_trace_decode(const char* filename, FILE* out);
+
+/**
+ * `print` writes to a buffer owned by the context, which `lithp_eval` and
+ * `lithp_load` flush before they return. `lithp_print` writes `val` and a
+ * newline to that same buffer, and `lithp_flush` writes the buffer out. call
+ * it before writing to stdout directly while a program may still be running.
+ */
+void lithp_print(lithp_ctx*, lval* val);
+void lithp_flush(lithp_ctx*);
+
+#endif
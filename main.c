@@ -0,0 +1,610 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lithp.h"
+#include "readline.h"
+
+const char* PROMPT = "lithp> ";
+const char* VERSION = LITHP_VERSION;
+
+char* read_file(char* filename) {
+  char* buffer = 0;
+  long length;
+
+  FILE* file = fopen(filename, "r");
+
+  if (file) {
+    fseek(file, 0, SEEK_END);
+    length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    buffer = malloc(length + 1);
+
+    if (buffer) {
+      length = fread(buffer, 1, length, file);
+      buffer[length] = '\0';
+    }
+
+    fclose(file);
+  }
+
+  return buffer;
+}
+
+/**
+ * `--serve` loads the prelude once, every file given on the command line or
+ * `std.lithp` when there are none, and then forks `SERVE_WORKERS` workers
+ * that all wait on the same socket. each worker inherits the warm heap copy
+ * on write, serves a single request and exits, and the server forks a fresh
+ * one in its place, so no request ever sees what an earlier one defined.
+ *
+ * a request is a single line, either `load <path>` or `eval <length>`
+ * followed by that many bytes of source. the response is a line with the
+ * exit status and the length of the output, followed by the output itself.
+ * the status is 1 when loading failed or any expression ended in an error.
+ * every worker reports how long its request took, from accepting the
+ * connection to sending the response, and the server logs that along with
+ * percentiles over the last `SERVE_WINDOW` requests. an `eval` of more than
+ * `SERVE_MAX_SOURCE` bytes is refused before any of it is read.
+ */
+#define SERVE_WORKERS 4
+#define SERVE_WINDOW 1024
+#define SERVE_LINE 4096
+#define SERVE_MAX_SOURCE (64L * 1024 * 1024)
+
+volatile sig_atomic_t STOPPING = 0;
+
+void serve_stop(int sig) {
+  UNUSED(sig);
+  STOPPING = 1;
+}
+
+int io_write(int fd, const char* buf, size_t len) {
+  while (len) {
+    ssize_t n = write(fd, buf, len);
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0) {
+      return 0;
+    }
+
+    buf += n;
+    len -= n;
+  }
+
+  return 1;
+}
+
+int io_read(int fd, char* buf, size_t len) {
+  while (len) {
+    ssize_t n = read(fd, buf, len);
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0) {
+      return 0;
+    }
+
+    buf += n;
+    len -= n;
+  }
+
+  return 1;
+}
+
+int io_line(int fd, char* line) {
+  for (int i = 0; i < SERVE_LINE - 1; i++) {
+    if (!io_read(fd, &line[i], 1)) {
+      return 0;
+    }
+
+    if (line[i] == '\n') {
+      line[i] = '\0';
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+int unix_socket(char* path, struct sockaddr_un* addr) {
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", path);
+    return -1;
+  }
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, path);
+
+  return socket(AF_UNIX, SOCK_STREAM, 0);
+}
+
+/**
+ * whatever the request prints goes to a temporary file first, so that the
+ * length of the output is known before any of it is sent.
+ */
+void serve_request(lithp_ctx* ctx, int conn) {
+  char line[SERVE_LINE];
+  long errors = lithp_errors(ctx);
+  long length;
+  lval* result;
+
+  FILE* out = tmpfile();
+  int saved = dup(STDOUT_FILENO);
+
+  fflush(stdout);
+  dup2(fileno(out), STDOUT_FILENO);
+
+  if (!io_line(conn, line)) {
+    result = lval_err("bad request");
+  } else if (strncmp(line, "load ", 5) == 0) {
+    result = lithp_load(ctx, line + 5);
+  } else if (sscanf(line, "eval %ld", &length) == 1 && length >= 0) {
+    char* source = length <= SERVE_MAX_SOURCE ? malloc(length + 1) : NULL;
+
+    if (length > SERVE_MAX_SOURCE) {
+      result = lval_err("request too large: %ld bytes, at most %ld",
+        length, SERVE_MAX_SOURCE);
+    } else if (!source) {
+      result = lval_err("out of memory reading %ld bytes", length);
+    } else {
+      source[length] = '\0';
+
+      result = io_read(conn, source, length)
+        ? lithp_load_string(ctx, "<client>", source)
+        : lval_err("request ended early");
+
+      free(source);
+    }
+  } else {
+    result = lval_err("bad request: %s", line);
+  }
+
+  if (result->type == LVAL_ERR) {
+    lithp_print(ctx, result);
+    lithp_flush(ctx);
+  }
+
+  int status = result->type == LVAL_ERR || lithp_errors(ctx) != errors;
+  lval_del(result);
+
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+
+  long size = ftell(out);
+  char* output = malloc(size + 1);
+  rewind(out);
+  size = fread(output, 1, size, out);
+  fclose(out);
+
+  int header = snprintf(line, SERVE_LINE, "%d %ld\n", status, size);
+
+  if (io_write(conn, line, header)) {
+    io_write(conn, output, size);
+  }
+
+  free(output);
+}
+
+long serve_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void serve_worker(lithp_ctx* ctx, int sock, int report) {
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  lithp_forked(ctx);
+
+  int conn;
+
+  while ((conn = accept(sock, NULL, NULL)) < 0) {
+    if (errno != EINTR) {
+      _exit(EXIT_FAILURE);
+    }
+  }
+
+  long start = serve_now();
+  serve_request(ctx, conn);
+  close(conn);
+
+  long usec = serve_now() - start;
+  io_write(report, (char*) &usec, sizeof(long));
+
+  _exit(EXIT_SUCCESS);
+}
+
+int serve_compare(const void* a, const void* b) {
+  long left = *(const long*) a;
+  long right = *(const long*) b;
+  return (left > right) - (left < right);
+}
+
+void serve_log(long* window, long served, long usec) {
+  long count = served < SERVE_WINDOW ? served : SERVE_WINDOW;
+  long sorted[SERVE_WINDOW];
+
+  memcpy(sorted, window, sizeof(long) * count);
+  qsort(sorted, count, sizeof(long), serve_compare);
+
+  fprintf(stderr, "request %ld: %.3fms (p50 %.3fms p90 %.3fms p99 %.3fms)\n",
+    served, usec / 1000.0,
+    sorted[(count - 1) * 50 / 100] / 1000.0,
+    sorted[(count - 1) * 90 / 100] / 1000.0,
+    sorted[(count - 1) * 99 / 100] / 1000.0);
+}
+
+pid_t serve_fork(lithp_ctx* ctx, int sock, int report) {
+  pid_t pid = fork();
+
+  if (pid == 0) {
+    serve_worker(ctx, sock, report);
+  }
+
+  return pid;
+}
+
+int serve(lithp_ctx* ctx, char* path) {
+  struct sockaddr_un addr;
+  int sock = unix_socket(path, &addr);
+  int report[2];
+
+  unlink(path);
+
+  if (
+    sock < 0 ||
+    bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+    listen(sock, SOMAXCONN) < 0 ||
+    pipe(report) < 0
+  ) {
+    perror("lithp --serve");
+    return EXIT_FAILURE;
+  }
+
+  fcntl(report[0], F_SETFL, O_NONBLOCK);
+
+  struct sigaction stop;
+  memset(&stop, 0, sizeof(stop));
+  stop.sa_handler = serve_stop;
+  sigaction(SIGINT, &stop, NULL);
+  sigaction(SIGTERM, &stop, NULL);
+
+  fflush(stdout);
+
+  pid_t workers[SERVE_WORKERS];
+  long window[SERVE_WINDOW];
+  long served = 0;
+  long usec;
+
+  for (int i = 0; i < SERVE_WORKERS; i++) {
+    workers[i] = serve_fork(ctx, sock, report[1]);
+  }
+
+  fprintf(stderr, "serving on %s with %d workers\n", path, SERVE_WORKERS);
+
+  while (!STOPPING) {
+    pid_t pid = waitpid(-1, NULL, 0);
+
+    if (pid < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      break;
+    }
+
+    while (read(report[0], &usec, sizeof(long)) == sizeof(long)) {
+      window[served++ % SERVE_WINDOW] = usec;
+      serve_log(window, served, usec);
+    }
+
+    for (int i = 0; i < SERVE_WORKERS && !STOPPING; i++) {
+      if (workers[i] == pid) {
+        workers[i] = serve_fork(ctx, sock, report[1]);
+      }
+    }
+  }
+
+  for (int i = 0; i < SERVE_WORKERS; i++) {
+    kill(workers[i], SIGTERM);
+  }
+
+  while (waitpid(-1, NULL, 0) > 0);
+
+  close(sock);
+  unlink(path);
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * `--client` sends a single file, or `-` for source read from stdin, to a
+ * server, prints whatever comes back and exits with the status it got.
+ */
+int client(char* path, char* file) {
+  struct sockaddr_un addr;
+  int sock = unix_socket(path, &addr);
+  char line[SERVE_LINE];
+  int sent;
+
+  if (sock < 0 || connect(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+    perror("lithp --client");
+    return EXIT_FAILURE;
+  }
+
+  if (strcmp(file, "-") == 0) {
+    size_t length = 0;
+    size_t cap = SERVE_LINE;
+    char* source = malloc(cap);
+    size_t n;
+
+    while ((n = fread(source + length, 1, cap - length, stdin)) > 0) {
+      length += n;
+
+      if (length == cap) {
+        cap *= 2;
+        source = realloc(source, cap);
+      }
+    }
+
+    int header = snprintf(line, SERVE_LINE, "eval %zu\n", length);
+    sent = io_write(sock, line, header) && io_write(sock, source, length);
+    free(source);
+  } else {
+    char full[PATH_MAX];
+
+    if (!realpath(file, full)) {
+      perror(file);
+      return EXIT_FAILURE;
+    }
+
+    int header = snprintf(line, SERVE_LINE, "load %s\n", full);
+    sent = io_write(sock, line, header);
+  }
+
+  int status;
+  long size;
+
+  if (!sent || !io_line(sock, line) || sscanf(line, "%d %ld", &status, &size) != 2) {
+    fprintf(stderr, "lithp --client: no response from %s\n", path);
+    return EXIT_FAILURE;
+  }
+
+  char buf[SERVE_LINE];
+
+  while (size > 0) {
+    ssize_t n = read(sock, buf, size < SERVE_LINE ? size : SERVE_LINE);
+
+    if (n <= 0) {
+      break;
+    }
+
+    fwrite(buf, 1, n, stdout);
+    size -= n;
+  }
+
+  close(sock);
+  return status;
+}
+
+/**
+ * a number of bytes, optionally followed by `k`, `m` or `g`.
+ */
+long parse_size(const char* arg) {
+  char* end;
+  long size = strtol(arg, &end, 10);
+
+  switch (*end) {
+    case 'k':
+    case 'K':
+      return size << 10;
+
+    case 'm':
+    case 'M':
+      return size << 20;
+
+    case 'g':
+    case 'G':
+      return size << 30;
+
+    default:
+      return size;
+  }
+}
+
+/**
+ * `--trace` keeps the last `TRACE_EVENTS` events, unless `--trace-size` says
+ * otherwise, and writes them to the given file whenever an expression ends in
+ * an error or the process gets `SIGUSR1`. `--trace-decode` prints such a file.
+ */
+#define TRACE_EVENTS 65536
+
+void trace_signal(int sig) {
+  UNUSED(sig);
+  lithp_trace_request();
+}
+
+int main(int argc, char** argv) {
+  char** files = malloc(sizeof(char*) * argc);
+  int file_count = 0;
+  int jit = -1;
+  int optimize = 1;
+  int hashcons = 0;
+  int lazy = 0;
+  int cache = 0;
+  char* cache_dir = NULL;
+  char* trace_path = NULL;
+  long trace_size = TRACE_EVENTS;
+  char* decode_path = NULL;
+  int threads = 0;
+  long max_depth = 0;
+  long max_steps = 0;
+  long max_mem = 0;
+  long timeout = 0;
+  char* serve_path = NULL;
+  char* client_path = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--jit") == 0) {
+      jit = 1;
+    } else if (strcmp(argv[i], "--no-jit") == 0) {
+      jit = 0;
+    } else if (strcmp(argv[i], "--no-opt") == 0) {
+      optimize = 0;
+    } else if (strcmp(argv[i], "--hashcons") == 0) {
+      hashcons = 1;
+    } else if (strcmp(argv[i], "--lazy") == 0) {
+      lazy = 1;
+    } else if (strcmp(argv[i], "--cache") == 0) {
+      cache = 1;
+    } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+      cache = 1;
+      cache_dir = argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_path = argv[++i];
+    } else if (strcmp(argv[i], "--trace-size") == 0 && i + 1 < argc) {
+      trace_size = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--trace-decode") == 0 && i + 1 < argc) {
+      decode_path = argv[++i];
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc) {
+      max_depth = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--max-steps") == 0 && i + 1 < argc) {
+      max_steps = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--max-mem") == 0 && i + 1 < argc) {
+      max_mem = parse_size(argv[++i]);
+    } else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+      timeout = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+      serve_path = argv[++i];
+    } else if (strcmp(argv[i], "--client") == 0 && i + 1 < argc) {
+      client_path = argv[++i];
+    } else if (strncmp(argv[i], "--", 2) == 0) {
+      printf("unknown option %s\n", argv[i]);
+      exit(EXIT_FAILURE);
+    } else {
+      files[file_count++] = argv[i];
+    }
+  }
+
+  if (decode_path) {
+    free(files);
+
+    if (!lithp_trace_decode(decode_path, stdout)) {
+      printf("%s is not a valid trace\n", decode_path);
+      return EXIT_FAILURE;
+    }
+
+    return 0;
+  }
+
+  if (client_path) {
+    if (file_count != 1) {
+      printf("--client expects a single file, or - for stdin\n");
+      exit(EXIT_FAILURE);
+    }
+
+    return client(client_path, files[0]);
+  }
+
+  char* grammar = read_file("grammar");
+
+  if (!grammar) {
+    printf("failed to read grammar file");
+    exit(EXIT_FAILURE);
+  }
+
+  lithp_ctx* ctx = lithp_new(grammar);
+  free(grammar);
+
+  if (!ctx) {
+    exit(EXIT_FAILURE);
+  }
+
+  if (jit >= 0) {
+    lithp_set_jit(ctx, jit);
+  }
+
+  lithp_set_optimize(ctx, optimize);
+  lithp_set_hashcons(ctx, hashcons);
+  lithp_set_lazy(ctx, lazy);
+  lithp_set_cache(ctx, cache, cache_dir);
+
+  if (trace_path) {
+    lithp_set_trace(ctx, trace_size, trace_path);
+    signal(SIGUSR1, trace_signal);
+  }
+  lithp_set_threads(ctx, threads);
+  lithp_set_max_depth(ctx, max_depth);
+  lithp_set_limits(ctx, max_steps, max_mem, timeout);
+
+  if (serve_path && !file_count) {
+    files[file_count++] = "std.lithp";
+  }
+
+  if (file_count > 1) {
+    lithp_prefetch(ctx, (const char**) files, file_count);
+  }
+
+  for (int i = 0; i < file_count; i++) {
+    lval* x = lithp_load(ctx, files[i]);
+
+    if (x->type == LVAL_ERR) {
+      lithp_print(ctx, x);
+    }
+
+    lval_del(x);
+  }
+
+  lithp_flush(ctx);
+
+  int status = EXIT_SUCCESS;
+
+  if (serve_path) {
+    status = serve(ctx, serve_path);
+  } else if (!file_count) {
+    printf("Lithp Version %s\n", VERSION);
+
+    lval_del(lithp_load(ctx, "std.lithp"));
+
+    printf("Loaded Standard Library from std.lithp\n");
+    printf("Press Ctrl+c to Exit\n\n");
+
+    char* input;
+
+    while ((input = readline(PROMPT))) {
+      lval* val = lithp_eval(ctx, "<stdin>", input);
+      lithp_print(ctx, val);
+      lithp_flush(ctx);
+      lval_del(val);
+
+      add_history(input);
+      free(input);
+    }
+  }
+
+  free(files);
+  lithp_del(ctx);
+
+  return status;
+}
@@ -7,19 +7,30 @@
 #include <string.h>
 
 #define INPUT_SIZE 2048
-static char INPUT[INPUT_SIZE];
 
-void add_history(char * ignore) {
+int add_history(const char * ignore) {
   (void) ignore;
+  return 0;
 }
 
+/**
+ * the line is read into a buffer on the stack, so any number of threads can
+ * be reading at the same time. returns `NULL` at the end of the input.
+ */
 char * readline(const char * prompt) {
+  char input[INPUT_SIZE];
+
   fputs(prompt, stdout);
-  fgets(INPUT, INPUT_SIZE, stdin);
+  fflush(stdout);
+
+  if (!fgets(input, INPUT_SIZE, stdin)) {
+    return NULL;
+  }
+
+  input[strcspn(input, "\n")] = '\0';
 
-  char * tmp = malloc(strlen(INPUT) + 1);
-  strcpy(tmp, INPUT);
-  tmp[strlen(tmp) - 1] = '\0';
+  char * tmp = malloc(strlen(input) + 1);
+  strcpy(tmp, input);
 
   return tmp;
 }